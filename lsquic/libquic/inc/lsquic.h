@@ -1478,6 +1478,30 @@ lsquic_conn_get_min_datagram_size (lsquic_conn_t *);
 int
 lsquic_conn_set_min_datagram_size (lsquic_conn_t *, size_t sz);
 
+/**
+ * Transport state of a connection, see @ref lsquic_conn_get_info().
+ */
+struct lsquic_conn_info
+{
+    uint64_t    lci_cwnd;           /* Congestion window, in bytes */
+    uint64_t    lci_bytes_in_flight;/* Sent but not yet acknowledged */
+    uint64_t    lci_pacing_rate;    /* Bytes per second */
+    /* Bottleneck bandwidth, in bytes per second.  This is the BBR estimate
+     * when BBR is in use and has samples; otherwise it is cwnd / srtt.
+     */
+    uint64_t    lci_bw_estimate;
+    uint32_t    lci_srtt;           /* Microseconds */
+    uint32_t    lci_rttvar;         /* Microseconds */
+    uint32_t    lci_min_rtt;        /* Microseconds */
+};
+
+/**
+ * Fill in transport state of the connection.  Returns 0 on success and -1
+ * if the connection does not support it (only IETF full connections do).
+ */
+int
+lsquic_conn_get_info (lsquic_conn_t *, struct lsquic_conn_info *);
+
 struct lsquic_logger_if {
     int     (*log_buf)(void *logger_ctx, const char *buf, size_t len);
 };
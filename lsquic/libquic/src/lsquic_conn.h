@@ -268,6 +268,10 @@ struct conn_iface
     /* Optional method */
     void
     (*ci_early_data_failed) (struct lsquic_conn *);
+
+    /* Optional method */
+    int
+    (*ci_get_info) (struct lsquic_conn *, struct lsquic_conn_info *);
 };
 
 #define LSCONN_CCE_BITS 3
@@ -7385,6 +7385,16 @@ ietf_full_conn_ci_get_min_datagram_size (struct lsquic_conn *lconn)
 }
 
 
+static int
+ietf_full_conn_ci_get_info (struct lsquic_conn *lconn,
+                                                struct lsquic_conn_info *info)
+{
+    struct ietf_full_conn *conn = (struct ietf_full_conn *) lconn;
+    lsquic_send_ctl_get_info(&conn->ifc_send_ctl, info);
+    return 0;
+}
+
+
 static int
 ietf_full_conn_ci_set_min_datagram_size (struct lsquic_conn *lconn,
                                                             size_t new_size)
@@ -8123,6 +8133,7 @@ ietf_full_conn_ci_log_stats (struct lsquic_conn *lconn)
     .ci_drop_crypto_streams  =  ietf_full_conn_ci_drop_crypto_streams, \
     .ci_early_data_failed    =  ietf_full_conn_ci_early_data_failed, \
     .ci_get_engine           =  ietf_full_conn_ci_get_engine, \
+    .ci_get_info             =  ietf_full_conn_ci_get_info, \
     .ci_get_min_datagram_size=  ietf_full_conn_ci_get_min_datagram_size, \
     .ci_get_path             =  ietf_full_conn_ci_get_path, \
     .ci_hsk_done             =  ietf_full_conn_ci_hsk_done, \
@@ -4184,3 +4184,30 @@ lsquic_send_ctl_stash_0rtt_packets (struct lsquic_send_ctl *ctl)
 
     LSQ_DEBUG("stashed %u 0-RTT packet%.*s", count, count != 1, "s");
 }
+
+
+void
+lsquic_send_ctl_get_info (const struct lsquic_send_ctl *ctl,
+                                                struct lsquic_conn_info *info)
+{
+    const struct lsquic_rtt_stats *const rtt = &ctl->sc_conn_pub->rtt_stats;
+    struct bandwidth bw;
+
+    info->lci_cwnd = ctl->sc_ci->cci_get_cwnd(ctl->sc_cong_ctl);
+    info->lci_bytes_in_flight = ctl->sc_bytes_unacked_all;
+    info->lci_pacing_rate = ctl->sc_ci->cci_pacing_rate(ctl->sc_cong_ctl,
+                                            lsquic_send_ctl_in_recovery(ctl));
+    info->lci_srtt = lsquic_rtt_stats_get_srtt(rtt);
+    info->lci_rttvar = lsquic_rtt_stats_get_rttvar(rtt);
+    info->lci_min_rtt = lsquic_rtt_stats_get_min_rtt(rtt);
+
+    /* The adaptive controller feeds BBR until it settles on one of them */
+    if (ctl->sc_ci == &lsquic_cong_bbr_if
+                                || ctl->sc_ci == &lsquic_cong_adaptive_if)
+        bw = BW(minmax_get(&ctl->sc_adaptive_cc.acc_bbr.bbr_max_bandwidth));
+    else
+        bw = BW(0);
+    info->lci_bw_estimate = BW_TO_BYTES_PER_SEC(&bw);
+    if (info->lci_bw_estimate == 0 && info->lci_srtt)
+        info->lci_bw_estimate = info->lci_cwnd * 1000000 / info->lci_srtt;
+}
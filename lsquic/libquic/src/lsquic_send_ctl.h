@@ -472,4 +472,10 @@ lsquic_send_ctl_0rtt_to_1rtt (struct lsquic_send_ctl *);
 void
 lsquic_send_ctl_stash_0rtt_packets (struct lsquic_send_ctl *);
 
+struct lsquic_conn_info;
+
+void
+lsquic_send_ctl_get_info (const struct lsquic_send_ctl *,
+                                                struct lsquic_conn_info *);
+
 #endif
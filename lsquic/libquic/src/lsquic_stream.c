@@ -3219,6 +3219,15 @@ lsquic_stream_set_priority_internal (lsquic_stream_t *stream, unsigned priority)
 }
 
 
+int
+lsquic_stream_set_priority (lsquic_stream_t *stream, unsigned priority)
+{
+    if (stream->sm_bflags & SMBF_HTTP_PRIO)
+        return -1;
+    return lsquic_stream_set_priority_internal(stream, priority);
+}
+
+
 lsquic_stream_ctx_t *
 lsquic_stream_get_ctx (const lsquic_stream_t *stream)
 {
@@ -1,22 +1,89 @@
 
 #include "lsquic_types.h"
 #include <arpa/inet.h>
+#include <sys/uio.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include "spsc_queue.h"
 
 #define QUIC_LOG(fmt, ...) printf("##QUIC## "fmt "\n", ##__VA_ARGS__)
 #define QUIC_TRACE QUIC_LOG("%s",__func__)
 
 typedef struct contrl_ctx contrl_ctx_t;
 
+#define QUIC_MAX_CONN 8   /*一个引擎同时支持的连接数*/
+#define QUIC_MAX_STREAM 8 /*每个连接的流数，每个流有自己的队列，互不阻塞*/
+
+//每个流的发送配置，quic_set_streams设置，quic_open时生效
+typedef struct quic_stream_cfg_
+{
+    int priority; //1~256，越小越先发(比如音频、关键帧)，0表示用lsquic默认值
+    int weight;   //同一优先级的流按权重分带宽，每次on_write最多写weight个发送单位
+    int datagram; //1表示这个流的数据项走QUIC DATAGRAM，丢了不重传，接收端按帧号重排、超时丢帧
+    int fec;      //datagram流的关键帧每fec个分片加一个异或校验分片(能补回其中丢的一个)，0不加，最大255
+    unsigned int max_bytes; //队列里最多排多少字节，0只受队列槽位数限制
+    int max_delay;          //新帧和队头的时间戳差超过这个(ms)就算积压，0不看时间，要有帧信息
+} quic_stream_cfg;
+
+#define QUIC_FRAME_KEY 1   /*关键帧，新GOP的开始*/
+#define QUIC_FRAME_NOREF 2 /*非参考帧，丢了不影响后面的帧解码*/
+
+//数据项的帧信息，quic_set_frame_info设置的回调在quic_push_data和quic线程里都会调用
+typedef struct quic_frame_info_
+{
+    int flags;    //QUIC_FRAME_KEY QUIC_FRAME_NOREF
+    long long ts; //时间戳(ms)
+} quic_frame_info;
+
+//每个流的发送队列统计，数值是近似快照
+typedef struct quic_send_stats_
+{
+    unsigned long long queued_bytes;
+    unsigned int queued_frames;
+    long long delay;                //最新一帧和队头的时间戳差(ms)
+    unsigned long long drop_frames; //入队时丢的和积压时从队头清掉的帧
+    unsigned long long drop_bytes;
+    unsigned long long drop_gops;   //积压时来了新关键帧，把排着的旧GOP整个丢掉的次数
+} quic_send_stats;
+
 // typedef void(*on_connect)(void* args, int status);
 // typedef void(*on_close)(void* args);
 // typedef void(*on_send)(void* args, void* stream);
 typedef void(*on_data)(void* args, void* data, int len);
+//分帧模式下收到一个完整的帧，data只在回调里有效
+typedef void(*on_frame)(void* args, int conn, int stream, void* data, int len);
+
+#define QUIC_FRAME_HDR_LEN 4 /*分帧模式的帧头：4字节大端的帧长，后面跟帧数据*/
+#define QUIC_FRAME_MAX (16 * 1024 * 1024) /*默认的最大帧长，超过认为对端出错，关掉这个流*/
+
+#define QUIC_TRANSPORT_INTERVAL 200 /*默认多久回调一次传输状态(ms)*/
+
+//连接的传输状态和建议码率，quic_set_transport_cb设置
+typedef struct quic_transport_stats_
+{
+    int conn;
+    unsigned int srtt;    //us
+    unsigned int rttvar;  //us
+    unsigned int min_rtt; //us
+    unsigned long long cwnd;            //字节
+    unsigned long long bytes_in_flight;
+    unsigned long long bandwidth;       //估计的瓶颈带宽(字节/秒)，BBR的估计，没有时是cwnd/srtt
+    unsigned long long pacing_rate;     //字节/秒
+    unsigned long long queued_bytes;    //这个连接所有流的发送队列里排着的字节
+    long long queue_ms;                 //按估计带宽发完队列要多久，和队列里帧时间戳的跨度取大的
+    unsigned long long drop_frames;     //所有流累计丢掉的帧
+    unsigned long long target_bitrate;  //建议的编码码率(bit/s)
+} quic_transport_stats;
+
+//在quic线程里调用，不要阻塞
+typedef void (*on_transport)(void *param, quic_transport_stats *st);
 
 typedef int (*data_parse)(void *, void **);
 typedef void(*data_free)(void *);
 typedef void(*data_remake)(void* item, int len);
+//把数据项描述成最多max段iov(不拷贝)，返回段数。设置了就不再用fn_parse
+typedef int (*data_iov)(void *item, struct iovec *iov, int max);
+typedef void (*data_info)(void *item, quic_frame_info *info);
 
 enum Cmd
 {
@@ -37,16 +104,26 @@ enum Status
 struct contrl_ctx
 {
     enum Cmd cmd;
-    enum Status status;
-    struct sockaddr peer;
-    lsquic_conn_t *conn;
+    enum Status status;//引擎状态，连接的状态在各自的连接里，用quic_conn_status取
     int runing;
 
+    int stream_count;//每个连接打开的流数
+    quic_stream_cfg stream_cfg[QUIC_MAX_STREAM];
+    unsigned int queue_size;//每个流的队列容量
+    int udp_offload;//尝试打开GSO/GRO
+    int datagram;//有datagram流时打开lsquic的datagram扩展
+
     data_parse fn_parse;
     data_free fn_free;
-    data_remake fn_remake;
+    data_remake fn_remake;//v2不再使用，部分写入只移动偏移
+    data_iov fn_iov;
+    data_info fn_info;
 
     on_data fn_data;
+    on_frame fn_frame;//设置了就按帧回调，不再回调fn_data
+    unsigned int max_frame;
+    on_transport fn_transport;
+    int transport_ms;
     // on_send fn_send;
     // on_close fn_close;
     // on_connect fn_connect;
@@ -54,6 +131,8 @@ struct contrl_ctx
 
 	// sem_t sem;
     pthread_mutex_t mutex;
+    pthread_cond_t cond;//status变化时广播，quic_run/quic_connect/quic_close在上面等待
+    void *cctx;//quic_run创建的client_ctx，连接和流的队列都在里面，命令通过sev_post投递到它的loop
     // void* extern_data;
     // int extern_len;
 
@@ -66,13 +145,97 @@ void quic_setting(contrl_ctx_t *ctrl_ctx, on_data fn_data, data_parse fn_parse,
 
 int quic_run(contrl_ctx_t *ctrl_ctx);
 
+//数据项由多段内存组成时(比如帧头+帧数据)设置，发送时直接按iov拷进包里
+void quic_set_iov(contrl_ctx_t *ctrl_ctx, data_iov fn_iov);
+//quic_run之前调用，内核支持时用UDP_SEGMENT/UDP_GRO减少收发包的系统调用
+void quic_set_udp_offload(contrl_ctx_t *ctrl_ctx, int enable);
+//quic_run之前调用，收到的数据按QUIC_FRAME_HDR_LEN的帧头拼成完整的帧再回调，max_frame为0用QUIC_FRAME_MAX
+void quic_set_framing(contrl_ctx_t *ctrl_ctx, on_frame fn_frame, unsigned int max_frame);
+//设置后quic_push_data按GOP入队：积压时先丢非参考帧，参考帧放不下就一直丢到下一个关键帧，
+//来了关键帧把排着的旧GOP清掉；datagram流按它决定关键帧是否加校验分片
+void quic_set_frame_info(contrl_ctx_t *ctrl_ctx, data_info fn_info);
+//quic_run之前调用，每interval_ms(0用QUIC_TRANSPORT_INTERVAL)给每个连上的连接回调一次传输状态，编码器据此调码率
+void quic_set_transport_cb(contrl_ctx_t *ctrl_ctx, on_transport fn_transport, int interval_ms);
+
+//quic_run之前调用
+void quic_set_streams(contrl_ctx_t *ctrl_ctx, int count, quic_stream_cfg *cfg);
+void quic_set_queue_size(contrl_ctx_t *ctrl_ctx, unsigned int size);
+
+//新建一个连接，成功返回连接号(0~QUIC_MAX_CONN-1)，失败返回-1
+int quic_open(contrl_ctx_t *ctrl_ctx, char *ip, int port);
+int quic_close_conn(contrl_ctx_t *ctrl_ctx, int conn);
+int quic_conn_status(contrl_ctx_t *ctrl_ctx, int conn);
+
+//兼容原来单连接的用法，0号连接已经连上就直接返回1
 int quic_connect(contrl_ctx_t *ctrl_ctx,char *ip, int port);
-
+//关闭所有连接
 int quic_close(contrl_ctx_t *ctrl_ctx);
 
 int quic_status(contrl_ctx_t *ctrl_ctx);
 
-int quic_push_data(int index, void *data);
+//每个流只能在一个线程里push(单生产者)，返回0表示没入队(队列满或者按GOP策略丢掉)，数据项还归调用者
+int quic_push_data(contrl_ctx_t *ctrl_ctx, int conn, int stream, void *data);
+int quic_queue_stats(contrl_ctx_t *ctrl_ctx, int conn, int stream, spsc_stats *st);
+int quic_get_send_stats(contrl_ctx_t *ctrl_ctx, int conn, int stream, quic_send_stats *st);
 
 // void quic_send(contrl_ctx_t *ctrl_ctx, void* data, int len);
 // void quic_set_delay(contrl_ctx_t *ctrl_ctx, struct timeval *delay);
+
+
+/////////////////////////////// 服务端 ///////////////////////////////
+#define QUIC_SERVER_MAX_ENGINE 64 /*引擎号放在CID的一个字节里*/
+#define QUIC_DGRAM_LATENCY 100 /*datagram帧默认最多等多少ms，超过还没收齐就丢掉*/
+
+typedef struct quic_server_ quic_server_t;
+typedef struct quic_srv_conn_ quic_srv_conn;
+
+enum QuicSrvEvent
+{
+    QUIC_SRV_CONN_NEW,
+    QUIC_SRV_CONN_CLOSED,
+};
+
+//回调都在连接所在引擎的线程里调用，同一个连接的回调不会并发
+typedef void (*on_srv_conn)(void *param, quic_srv_conn *conn, int event);
+//stream是对端在这个连接上打开的第几个流(从0开始)，data为空、len为0表示这个流发完了
+//datagram流的帧按帧号顺序整帧回调，stream是发送端quic_set_streams里的流号
+typedef void (*on_srv_data)(void *param, quic_srv_conn *conn, int stream, void *data, int len);
+
+typedef struct quic_server_cfg_
+{
+    char *ip;    //为空监听所有地址
+    int port;
+    int engines; //引擎(线程)数，<=0用cpu核数
+    int pin;     //引擎线程绑核
+    int udp_offload;
+
+    on_srv_conn fn_conn;
+    on_srv_data fn_data;
+    on_srv_data fn_frame;   //设置了就按帧回调(格式同客户端的分帧模式)，不再回调fn_data
+    unsigned int max_frame; //0用QUIC_FRAME_MAX
+    on_srv_data fn_dgram;   //datagram流收齐的帧，为空时交给fn_frame/fn_data(流号可能和可靠流重复)
+    int dgram_latency;      //datagram帧的等待时限(ms)，0用QUIC_DGRAM_LATENCY
+    void *cb_param;
+} quic_server_cfg;
+
+typedef struct quic_server_stats_
+{
+    unsigned long long conns;   //累计接受的连接
+    unsigned long long active;  //当前的连接
+    unsigned long long bytes;   //收到的流数据
+    unsigned long long packets; //收到的udp包
+    unsigned long long steered; //按CID转给其他引擎的包
+    unsigned long long dg_frames;    //收齐交付的datagram帧
+    unsigned long long dg_lost;      //超时或者被挤出窗口丢掉的datagram帧
+    unsigned long long dg_recovered; //用校验分片补回来的分片
+} quic_server_stats;
+
+quic_server_t *quic_server_run(quic_server_cfg *cfg);
+void quic_server_stop(quic_server_t *srv);
+int quic_server_engines(quic_server_t *srv);
+int quic_server_get_stats(quic_server_t *srv, int engine, quic_server_stats *st);
+
+int quic_srv_conn_engine(quic_srv_conn *conn);
+void quic_srv_conn_set_ctx(quic_srv_conn *conn, void *ctx);
+void *quic_srv_conn_get_ctx(quic_srv_conn *conn);
+void quic_srv_conn_close(quic_srv_conn *conn);
@@ -1,4 +1,5 @@
 
+#define _GNU_SOURCE
 #include "lsquic.h"
 #include "quic_interface.h"
 #include <stdio.h>
@@ -13,33 +14,115 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
+#include <netinet/udp.h>
 
 #include "simple_event.h"
 #include "simple_event_macro.h"
 
 #define QUIC_API
 
-#define MAX_STREAM_COUNT 1
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define SEND_QUANTUM (16 * 1024) /*权重为1的流每次on_write最多写的字节数*/
 
 /////////////////////////////////////////////////////////////////
 
 typedef struct client_ctx client_ctx_t;
+typedef struct lsquic_conn_ctx quic_conn;
+typedef struct lsquic_stream_ctx quic_stream;
 
 typedef sev_base evb;
 typedef sev_io_event io_evt;
 typedef sev_custom_event cus_evt;
 
+#define FRAME_POOL_MIN 4096 /*池里最小的缓冲区，往上每级翻倍*/
+#define FRAME_POOL_CLASSES 13 /*4K~16M*/
+#define FRAME_POOL_KEEP 8 /*每级最多留几块*/
+
+//分帧模式下拼帧的缓冲区，按2的幂分级缓存，每个引擎一个，只在quic线程里用不加锁
+typedef struct frame_pool_
+{
+    void *free[FRAME_POOL_CLASSES];//空闲块的前8个字节存下一块
+    int count[FRAME_POOL_CLASSES];
+} frame_pool;
+
+//一个流上正在拼的帧
+typedef struct frame_rx_
+{
+    unsigned char hdr[QUIC_FRAME_HDR_LEN];
+    int hdr_got;
+    unsigned int len;//帧头里的长度
+    unsigned int got;
+    unsigned char *buf;//帧跨了多个数据块才从池里取
+    int cls;
+} frame_rx;
+
+//队列槽位对应的帧信息，生产者入队前写，消费者出队时读
+typedef struct frame_meta_
+{
+    unsigned int bytes;
+    unsigned int gop;
+    long long ts;
+} frame_meta;
+
+//流的上下文就是它的发送队列，生产者是编码线程(quic_push_data)，消费者是quic线程(on_write)
 struct lsquic_stream_ctx
 {
     lsquic_stream_t *stream;
-    client_ctx_t *cctx;
+    quic_conn *qc;
     int id;
+
+    spsc_queue que;
+    int priority;
+    int weight;
+    size_t head_off;//队头数据项已经写到流里的字节数
+    int idle;//队列空了就关掉wantwrite并置1，生产者入队时看到1就投递一次resume_stream
+
+    frame_rx rx;
+
+    int datagram;//走DATAGRAM，不开lsquic的流
+    int fec;
+    struct dgram_tx_ *dg;
+
+    //按GOP入队，见admit_frame
+    frame_meta *meta;
+    unsigned int max_bytes;
+    int max_delay;
+    long long qbytes;      //队列里的字节数，两边原子加减
+    unsigned int drop_gop; //生产者写，消费者把比它旧的GOP从队头清掉
+    unsigned int gop;      //gop、skip、last_ts生产者独占
+    int skip;              //GOP断了，丢到下一个关键帧
+    long long last_ts;
+    unsigned long long drop_frames;
+    unsigned long long drop_bytes;
+    unsigned long long drop_gops;
 };
 
+//连接槽位，quic_open分配，lsquic_engine_connect时作为conn_ctx传进去
 struct lsquic_conn_ctx
 {
     lsquic_conn_t *conn;
     client_ctx_t *cctx;
+    int id;
+    int used;
+    enum Status status;
+    struct sockaddr peer;
+
+    int stream_count;
+    int next_stream;
+    quic_stream streams[QUIC_MAX_STREAM];
+
+    int dg_ready;//握手完成并且对端支持datagram
+    int dg_next; //datagram流轮流发
 };
 
 struct client_ctx
@@ -49,143 +132,659 @@ struct client_ctx
     io_evt *ev_net;
 
     cus_evt *timer;
-    cus_evt *contrl;
 
     lsquic_engine_t *engine;
     struct lsquic_engine_settings *eng_cfg;
     struct sockaddr_in *local_addr;
 
-    int stream_count;
-    void *queue[MAX_STREAM_COUNT];
-    struct timeval *delay[MAX_STREAM_COUNT];
+    quic_conn conns[QUIC_MAX_CONN];
+
+    int gso;//内核支持UDP_SEGMENT，一次sendmsg发多个同样长度的包
+    int gro;//打开了UDP_GRO，一次收到的可能是多个包拼起来的
+    int send_blocked;//发送遇到EAGAIN，等socket可写后调用lsquic_engine_send_unsent_packets
+    struct recv_batch_ *rb;
+    struct send_batch_ *sb;
+    frame_pool fpool;
+    sev_timer_id tp_timer;//定期回调传输状态
 
     contrl_ctx_t *ctrl_ctx;
+    struct server_shard_ *shard;//服务端的引擎复用这里的收发包和定时器，客户端为空
 };
 
 /////////////////////////////////////////////////////////////////
-#define QUEUE_SIZE 500
-typedef struct queue_
-{
-    int max;
-    int front;
-    int tail;
-    void *data[QUEUE_SIZE];
+void client_process_conns(client_ctx_t *cctx);
 
-    pthread_mutex_t mutex;
-} queue;
+#define QUEUE_SIZE 512 /*默认容量，必须是2的幂，可以用quic_set_queue_size修改*/
 
-queue data_queue[MAX_STREAM_COUNT];
+#define SEND_BATCH 16
+#define SEND_IOV_MAX 64 /*一次writef最多拼的iov个数，单个数据项的iov不能超过这个数*/
 
-// 初始化队列
-void initQueue(queue *q)
+//把队头的一批数据项拼成iov给lsquic_stream_writef，数据只在打包时拷贝一次
+typedef struct send_reader_
+{
+    struct iovec iov[SEND_IOV_MAX];
+    int iovcnt;
+    int idx;       //当前读到的iov
+    size_t off;    //当前iov里已读的字节
+    size_t remain; //还可以读的字节，不超过这次的发送额度
+} send_reader;
+
+static size_t reader_read(void *ctx, void *buf, size_t count)
 {
-    q->max = QUEUE_SIZE;
-    q->front = 0;
-    q->tail = 0;
+    send_reader *rd = ctx;
+    size_t n = 0;
+    count = count < rd->remain ? count : rd->remain;
+    while (n < count && rd->idx < rd->iovcnt)
+    {
+        struct iovec *v = &rd->iov[rd->idx];
+        size_t len = v->iov_len - rd->off;
+        len = len < count - n ? len : count - n;
+        memcpy((char *)buf + n, (char *)v->iov_base + rd->off, len);
+        n += len;
+        rd->off += len;
+        if (rd->off == v->iov_len)
+        {
+            rd->idx++;
+            rd->off = 0;
+        }
+    }
+    rd->remain -= n;
+    return n;
 }
 
-// 检查队列是否为空
-int isEmpty(queue *q)
+static size_t reader_size(void *ctx)
 {
-    return q->front == q->tail;
+    return ((send_reader *)ctx)->remain;
 }
 
-// 检查队列是否已满
-int isFull(queue *q)
+//取数据项的iov，没有设置fn_iov就用fn_parse得到的一段连续内存
+static int item_iov(contrl_ctx_t *ctrl_ctx, void *item, struct iovec *iov, int max)
 {
-    return (q->tail + 1) % q->max == q->front;
+    if (ctrl_ctx->fn_iov)
+    {
+        return ctrl_ctx->fn_iov(item, iov, max);
+    }
+
+    void *data = 0;
+    int len = ctrl_ctx->fn_parse ? ctrl_ctx->fn_parse(item, &data) : 0;
+    iov[0].iov_base = data;
+    iov[0].iov_len = len > 0 ? len : 0;
+    return 1;
 }
 
-// 入队函数
-int enqueue(queue *q, void *item)
+//出队n个数据项，减掉它们的字节数
+static void queue_pop(quic_stream *qs, unsigned int n)
 {
-    pthread_mutex_lock(&q->mutex);
-    if (isFull(q))
+    long long bytes = 0;
+    for (unsigned int i = 0; i < n; i++)
     {
-        pthread_mutex_unlock(&q->mutex);
-        return 0; // 队列已满，入队失败
+        bytes += qs->meta[(qs->que.head + i) & qs->que.mask].bytes;
     }
-    q->data[q->tail] = item;
-    q->tail = (q->tail + 1) % q->max;
-    pthread_mutex_unlock(&q->mutex);
-    return 1; // 入队成功
+    __atomic_sub_fetch(&qs->qbytes, bytes, __ATOMIC_RELAXED);
+    spsc_pop_n(&qs->que, n);
 }
 
-// 出队函数
-void *dequeue(queue *q)
+//丢掉队头的数据项，记到丢帧统计里
+static void drop_head(quic_stream *qs, void *item)
 {
-    pthread_mutex_lock(&q->mutex);
-    if (isEmpty(q))
+    contrl_ctx_t *ctrl_ctx = qs->qc->cctx->ctrl_ctx;
+    frame_meta *m = &qs->meta[qs->que.head & qs->que.mask];
+    __atomic_add_fetch(&qs->drop_frames, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&qs->drop_bytes, m->bytes, __ATOMIC_RELAXED);
+    queue_pop(qs, 1);
+    if (ctrl_ctx->fn_free)
     {
-        pthread_mutex_unlock(&q->mutex);
-        return NULL; // 队列为空，出队失败
+        ctrl_ctx->fn_free(item);
     }
-    void *item = q->data[q->front];
-    q->front = (q->front + 1) % q->max;
-    pthread_mutex_unlock(&q->mutex);
-    return item; // 出队成功
 }
 
-void *queue_head(queue *q)
+//积压时生产者来了新的关键帧，队头比它旧的GOP都不用发了，正在发的数据项要发完(datagram流在两帧之间才调用)
+static void drop_stale(quic_stream *qs)
 {
-    pthread_mutex_lock(&q->mutex);
-    if (isEmpty(q))
+    unsigned int drop_gop = __atomic_load_n(&qs->drop_gop, __ATOMIC_ACQUIRE);
+    void *item;
+    while (qs->head_off == 0 && (item = spsc_peek(&qs->que)) != NULL)
     {
-        pthread_mutex_unlock(&q->mutex);
-        return NULL; 
+        frame_meta *m = &qs->meta[qs->que.head & qs->que.mask];
+        if ((int)(m->gop - drop_gop) >= 0)
+        {
+            break;
+        }
+        drop_head(qs, item);
     }
-    void *item = q->data[q->front];
-    pthread_mutex_unlock(&q->mutex);
-    return item; 
 }
 
-//从队列取出数据并填满缓冲区
-int send_data_from_queue(void* cctx, int num, lsquic_stream_t* stream)
+//从队列取出数据写到流里，写够budget字节就让给别的流
+//部分写入只移动队头数据项的偏移(head_off)，不再重新分配和拷贝剩下的数据
+int send_data_from_queue(quic_stream *qs, lsquic_stream_t *stream, int budget)
 {
-    void *que = ((client_ctx_t *)cctx)->queue[num];
-    contrl_ctx_t *ctrl_ctx = ((client_ctx_t *)cctx)->ctrl_ctx;
+    spsc_queue *que = &qs->que;
+    contrl_ctx_t *ctrl_ctx = qs->qc->cctx->ctrl_ctx;
 
     int ret = 0;
-    while (1)
+    void *items[SEND_BATCH];
+    size_t item_len[SEND_BATCH];
+    send_reader rd;
+    struct lsquic_reader reader = {reader_read, reader_size, &rd};
+    unsigned int n;
+
+    drop_stale(qs);
+
+    while (ret < budget && (n = spsc_peek_batch(que, items, SEND_BATCH)) > 0)
     {
-        void *item = queue_head((queue *)que);
-        if (!item)
+        //拼iov，队头数据项跳过已经发出去的部分
+        size_t total = 0;
+        unsigned int cnt = 0;
+        rd.iovcnt = 0;
+        for (; cnt < n && total < (size_t)(budget - ret); cnt++)
         {
+            int max = SEND_IOV_MAX - rd.iovcnt;
+            if (max <= 0)
+            {
+                break;
+            }
+            struct iovec *v = &rd.iov[rd.iovcnt];
+            int k = item_iov(ctrl_ctx, items[cnt], v, max);
+            if (k <= 0 || k > max)
+            {
+                break;
+            }
+
+            size_t len = 0;
+            for (int i = 0; i < k; i++)
+            {
+                len += v[i].iov_len;
+            }
+            item_len[cnt] = len;
+            total += len;
+            rd.iovcnt += k;
+        }
+        if (cnt == 0)
+        {
+            //队头的数据项描述不出来(超过SEND_IOV_MAX段)，永远发不出去，丢掉免得把流卡住
+            QUIC_LOG("item has too many iov, drop it");
+            drop_head(qs, items[0]);
+            qs->head_off = 0;
+            continue;
+        }
+
+        rd.idx = 0;
+        rd.off = 0;
+        total -= qs->head_off;
+        //队头已发的部分在前几个iov里，直接跳过
+        for (size_t skip = qs->head_off; skip > 0;)
+        {
+            size_t len = rd.iov[rd.idx].iov_len - rd.off;
+            if (skip < len)
+            {
+                rd.off += skip;
+                break;
+            }
+            skip -= len;
+            rd.idx++;
+            rd.off = 0;
+        }
+        rd.remain = total < (size_t)(budget - ret) ? total : (size_t)(budget - ret);
+
+        ssize_t wlen = lsquic_stream_writef(stream, &reader);
+        if (wlen < 0)
+        {
+            QUIC_LOG("lsquic_stream_writef error");
             break;
         }
+        ret += wlen;
 
-        int len = 0;
-        void *data = 0;
+        //写完的数据项出队，写了一部分的记下偏移
+        unsigned int done = 0;
+        size_t w = (size_t)wlen + qs->head_off;
+        for (; done < cnt && w >= item_len[done]; done++)
+        {
+            w -= item_len[done];
+            if (ctrl_ctx->fn_free)
+            {
+                ctrl_ctx->fn_free(items[done]);
+            }
+        }
+        qs->head_off = w;
+        queue_pop(qs, done);
 
-        if (ctrl_ctx->fn_parse)
+        if (done < cnt)
         {
-            len = ctrl_ctx->fn_parse(item, &data);
+            //缓冲区满了或者额度用完了
+            break;
         }
+    }
 
-        ssize_t wlen = lsquic_stream_write(stream, data, len);
-        ret += wlen;
-        if (wlen < len)
+    return ret;
+}
+
+/////////////////////////////////////////////////////////////////
+//datagram流：每个数据项是一帧，切成固定大小的分片装进DATAGRAM帧，丢了不重传
+//分片头：帧号(4) 分片号(2) 数据分片数(2) 标记(1) 流号(1) 校验分组(1) 保留(1) 帧长(4)，都是大端
+//关键帧每fec个数据分片后面跟一个校验分片(这一组的异或)，分片号从数据分片数开始
+
+#define DGRAM_SIZE 1100 /*每个DATAGRAM帧的长度，一个包里要放得下*/
+#define DGRAM_HDR 16
+#define DGRAM_CHUNK (DGRAM_SIZE - DGRAM_HDR)
+#define DGRAM_FLAG_KEY 1
+#define DGRAM_FLAG_FEC 2
+
+typedef struct dgram_tx_
+{
+    void *item; //正在发的数据项，最后一个分片发出去才出队
+    send_reader rd;
+    unsigned int seq;
+    unsigned int len;
+    int flags;
+    int chunks;
+    int next;       //下一个数据分片
+    int fec;        //这一帧的校验分组大小，0不加
+    int parity_due; //该发第几组的校验分片，-1没有
+    size_t parity_len;
+    unsigned char parity[DGRAM_CHUNK];
+} dgram_tx;
+
+static void put_be16(unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put_be32(unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static unsigned int get_be16(const unsigned char *p)
+{
+    return ((unsigned int)p[0] << 8) | p[1];
+}
+
+//取队头的数据项开始发新的一帧，没有数据返回0
+static int dgram_start(quic_stream *qs)
+{
+    contrl_ctx_t *ctrl_ctx = qs->qc->cctx->ctrl_ctx;
+    dgram_tx *tx = qs->dg;
+
+    drop_stale(qs);
+    for (;;)
+    {
+        void *item = spsc_peek(&qs->que);
+        if (!item)
         {
-            //缓冲区已满，剩余数据继续存在队头
-            if (ctrl_ctx->fn_remake)
+            //和on_write一样，先置idle再检查一次，避免和生产者的入队错过
+            __atomic_store_n(&qs->idle, 1, __ATOMIC_SEQ_CST);
+            if (spsc_empty(&qs->que) || !__atomic_exchange_n(&qs->idle, 0, __ATOMIC_SEQ_CST))
             {
-                ctrl_ctx->fn_remake(item, len - wlen);
-                break;
+                return 0;
+            }
+            continue;
+        }
+
+        quic_frame_info info = {0};
+        if (ctrl_ctx->fn_info)
+        {
+            ctrl_ctx->fn_info(item, &info);
+        }
+        tx->rd.iovcnt = item_iov(ctrl_ctx, item, tx->rd.iov, SEND_IOV_MAX);
+        size_t len = 0;
+        for (int i = 0; i < tx->rd.iovcnt; i++)
+        {
+            len += tx->rd.iov[i].iov_len;
+        }
+        size_t chunks = len ? (len + DGRAM_CHUNK - 1) / DGRAM_CHUNK : 1;
+        if (tx->rd.iovcnt < 0 || tx->rd.iovcnt > SEND_IOV_MAX || chunks > 0xff00)
+        {
+            QUIC_LOG("drop datagram frame, len %zu", len);
+            queue_pop(qs, 1);
+            if (ctrl_ctx->fn_free)
+            {
+                ctrl_ctx->fn_free(item);
+            }
+            continue;
+        }
+
+        tx->item = item;
+        tx->rd.idx = 0;
+        tx->rd.off = 0;
+        tx->rd.remain = len;
+        tx->len = len;
+        tx->flags = (info.flags & QUIC_FRAME_KEY) ? DGRAM_FLAG_KEY : 0;
+        tx->chunks = chunks;
+        tx->next = 0;
+        tx->fec = tx->flags & DGRAM_FLAG_KEY ? qs->fec : 0;
+        tx->parity_due = -1;
+        return 1;
+    }
+}
+
+//往buf里写下一个分片，返回DATAGRAM帧的长度
+static ssize_t dgram_fill(quic_stream *qs, unsigned char *buf)
+{
+    dgram_tx *tx = qs->dg;
+    unsigned char *p = buf + DGRAM_HDR;
+    int flags = tx->flags;
+    int idx;
+    size_t n;
+
+    if (tx->parity_due >= 0)
+    {
+        idx = tx->chunks + tx->parity_due;
+        flags |= DGRAM_FLAG_FEC;
+        n = tx->parity_len;
+        memcpy(p, tx->parity, n);
+        tx->parity_due = -1;
+    }
+    else
+    {
+        idx = tx->next++;
+        n = reader_read(&tx->rd, p, DGRAM_CHUNK);
+        if (tx->fec)
+        {
+            if (idx % tx->fec == 0)
+            {
+                memset(tx->parity, 0, DGRAM_CHUNK);
+                tx->parity_len = 0;
             }
-            else
+            for (size_t i = 0; i < n; i++)
             {
-                QUIC_LOG("fn_remake is null");
+                tx->parity[i] ^= p[i];
             }
+            tx->parity_len = n > tx->parity_len ? n : tx->parity_len;
+            if ((idx + 1) % tx->fec == 0 || idx + 1 == tx->chunks)
+            {
+                tx->parity_due = idx / tx->fec;
+            }
+        }
+    }
+
+    put_be32(buf, tx->seq);
+    put_be16(buf + 4, idx);
+    put_be16(buf + 6, tx->chunks);
+    buf[8] = flags;
+    buf[9] = qs->id;
+    buf[10] = tx->fec;
+    buf[11] = 0;
+    put_be32(buf + 12, tx->len);
+
+    if (tx->next == tx->chunks && tx->parity_due < 0)
+    {
+        contrl_ctx_t *ctrl_ctx = qs->qc->cctx->ctrl_ctx;
+        queue_pop(qs, 1);
+        if (ctrl_ctx->fn_free)
+        {
+            ctrl_ctx->fn_free(tx->item);
+        }
+        tx->item = NULL;
+        tx->seq++;
+    }
+    return DGRAM_HDR + n;
+}
+
+//lsquic有地方放DATAGRAM帧时调用，datagram流轮流每次发一个分片，都没数据了就不再要写
+static ssize_t quic_client_on_dg_write(lsquic_conn_t *conn, void *buf, size_t sz)
+{
+    quic_conn *qc = lsquic_conn_get_ctx(conn);
+    if (!qc || sz < DGRAM_SIZE)
+    {
+        return -1;
+    }
+
+    for (int n = 0; n < qc->stream_count; n++)
+    {
+        quic_stream *qs = &qc->streams[(qc->dg_next + n) % qc->stream_count];
+        if (!qs->datagram || (!qs->dg->item && !dgram_start(qs)))
+        {
+            continue;
+        }
+        qc->dg_next = (qs->id + 1) % qc->stream_count;
+        return dgram_fill(qs, buf);
+    }
+
+    lsquic_conn_want_datagram_write(conn, 0);
+    return -1;
+}
+
+//服务端不发datagram，打开扩展时lsquic要求有这个回调
+static void quic_client_on_datagram(lsquic_conn_t *conn, const void *buf, size_t len)
+{
+}
+
+//对端的传输参数到了才能用datagram，分片大小固定，让lsquic按这个大小留地方
+static void quic_client_on_hsk_done(lsquic_conn_t *conn, enum lsquic_hsk_status status)
+{
+    quic_conn *qc = lsquic_conn_get_ctx(conn);
+    if (!qc || (status != LSQ_HSK_OK && status != LSQ_HSK_RESUMED_OK))
+    {
+        return;
+    }
+
+    int dg = 0;
+    for (int i = 0; i < qc->stream_count; i++)
+    {
+        if (qc->streams[i].datagram)
+        {
+            __atomic_store_n(&qc->streams[i].idle, 0, __ATOMIC_RELEASE);
+            dg = 1;
         }
-        //数据完全拷到了缓冲区，出队
-        (void)dequeue((queue *)que);
+    }
+    if (!dg)
+    {
+        return;
+    }
+    if (lsquic_conn_set_min_datagram_size(conn, DGRAM_SIZE) != 0 || lsquic_conn_want_datagram_write(conn, 1) < 0)
+    {
+        QUIC_LOG("peer does not support datagram, conn %d", qc->id);
+        return;
+    }
+    qc->dg_ready = 1;
+}
+
+//连接关闭后丢掉队列里没发出去的数据，槽位复用时不会发旧数据
+static void drop_queue(quic_stream *qs)
+{
+    contrl_ctx_t *ctrl_ctx = qs->qc->cctx->ctrl_ctx;
+    void *item;
+    qs->head_off = 0;
+    if (qs->dg)
+    {
+        qs->dg->item = NULL;//还在队列里，下面一起释放
+        qs->dg->parity_due = -1;
+    }
+    while ((item = spsc_peek(&qs->que)) != NULL)
+    {
+        queue_pop(qs, 1);
         if (ctrl_ctx->fn_free)
         {
             ctrl_ctx->fn_free(item);
         }
     }
+}
 
-    return ret;
+/////////////////////////////////////////////////////////////////
+//收数据用lsquic_stream_readf，lsquic把重组好的连续数据块直接交给回调，不再先拷到栈上的小缓冲区
+//分帧模式下整个帧在一个数据块里就直接回调，跨块的才拷进池里的缓冲区拼起来
+
+typedef struct recv_ctx_ recv_ctx;
+typedef void (*recv_deliver)(recv_ctx *rc, const unsigned char *data, size_t len);
+
+struct recv_ctx_
+{
+    frame_pool *fp;
+    frame_rx *rx;//为空表示不分帧，数据块直接回调
+    unsigned int max;
+    recv_deliver deliver;
+    void *arg;
+    size_t bytes;
+    int error;//帧长超过max
+};
+
+static int frame_class(size_t len)
+{
+    int cls = 0;
+    size_t size = FRAME_POOL_MIN;
+    while (size < len)
+    {
+        size <<= 1;
+        cls++;
+    }
+    return cls;
+}
+
+static unsigned char *frame_buf_get(frame_pool *fp, size_t len, int *pcls)
+{
+    int cls = frame_class(len);
+    *pcls = cls;
+    if (cls >= FRAME_POOL_CLASSES)
+    {
+        return malloc(len);
+    }
+    void *buf = fp->free[cls];
+    if (buf)
+    {
+        fp->free[cls] = *(void **)buf;
+        fp->count[cls]--;
+        return buf;
+    }
+    return malloc((size_t)FRAME_POOL_MIN << cls);
+}
+
+static void frame_buf_put(frame_pool *fp, unsigned char *buf, int cls)
+{
+    if (cls >= FRAME_POOL_CLASSES || fp->count[cls] >= FRAME_POOL_KEEP)
+    {
+        free(buf);
+        return;
+    }
+    *(void **)buf = fp->free[cls];
+    fp->free[cls] = buf;
+    fp->count[cls]++;
+}
+
+static void frame_pool_clean(frame_pool *fp)
+{
+    for (int i = 0; i < FRAME_POOL_CLASSES; i++)
+    {
+        void *buf;
+        while ((buf = fp->free[i]) != NULL)
+        {
+            fp->free[i] = *(void **)buf;
+            free(buf);
+        }
+        fp->count[i] = 0;
+    }
+}
+
+//丢掉拼了一半的帧，流关闭或者槽位复用时调用
+static void frame_rx_reset(frame_pool *fp, frame_rx *rx)
+{
+    if (rx->buf)
+    {
+        frame_buf_put(fp, rx->buf, rx->cls);
+    }
+    memset(rx, 0, sizeof(*rx));
+}
+
+static unsigned int frame_len(const unsigned char *hdr)
+{
+    return ((unsigned int)hdr[0] << 24) | ((unsigned int)hdr[1] << 16) | ((unsigned int)hdr[2] << 8) | hdr[3];
+}
+
+static size_t recv_readf(void *ctx, const unsigned char *data, size_t len, int fin)
+{
+    recv_ctx *rc = ctx;
+    frame_rx *rx = rc->rx;
+    rc->bytes += len;
+    if (!rx)
+    {
+        rc->deliver(rc, data, len);
+        return len;
+    }
+
+    size_t off = 0;
+    while (off < len)
+    {
+        size_t left = len - off;
+        if (rx->hdr_got < QUIC_FRAME_HDR_LEN)
+        {
+            //整个帧都在这个数据块里，不拷贝
+            if (rx->hdr_got == 0 && left >= QUIC_FRAME_HDR_LEN)
+            {
+                unsigned int flen = frame_len(data + off);
+                if (flen <= rc->max && left - QUIC_FRAME_HDR_LEN >= flen)
+                {
+                    rc->deliver(rc, data + off + QUIC_FRAME_HDR_LEN, flen);
+                    off += QUIC_FRAME_HDR_LEN + flen;
+                    continue;
+                }
+            }
+
+            size_t n = QUIC_FRAME_HDR_LEN - rx->hdr_got;
+            n = n < left ? n : left;
+            memcpy(rx->hdr + rx->hdr_got, data + off, n);
+            rx->hdr_got += n;
+            off += n;
+            if (rx->hdr_got < QUIC_FRAME_HDR_LEN)
+            {
+                break;
+            }
+            rx->len = frame_len(rx->hdr);
+            if (rx->len > rc->max)
+            {
+                QUIC_LOG("frame too large %u", rx->len);
+                rc->error = 1;
+                return off;
+            }
+            rx->got = 0;
+            if (rx->len == 0)
+            {
+                rc->deliver(rc, rx->hdr, 0);
+                rx->hdr_got = 0;
+                continue;
+            }
+            rx->buf = frame_buf_get(rc->fp, rx->len, &rx->cls);
+            continue;
+        }
+
+        size_t n = rx->len - rx->got;
+        n = n < left ? n : left;
+        memcpy(rx->buf + rx->got, data + off, n);
+        rx->got += n;
+        off += n;
+        if (rx->got == rx->len)
+        {
+            rc->deliver(rc, rx->buf, rx->len);
+            frame_buf_put(rc->fp, rx->buf, rx->cls);
+            rx->buf = NULL;
+            rx->hdr_got = 0;
+        }
+    }
+    return len;
+}
+
+//把流上现在能读的都读完，返回0表示对端发完了(FIN)，-1出错，1等下一次on_read
+static int stream_recv(lsquic_stream_t *stream, recv_ctx *rc)
+{
+    ssize_t n;
+    while ((n = lsquic_stream_readf(stream, recv_readf, rc)) > 0 && !rc->error)
+        ;
+    if (rc->error)
+    {
+        return -1;
+    }
+    if (n == 0)
+    {
+        return 0;
+    }
+    if (errno != EWOULDBLOCK && errno != EAGAIN && errno != ECONNRESET)
+    {
+        QUIC_LOG("stream read error %d", errno);
+        return -1;
+    }
+    return errno == ECONNRESET ? -1 : 1;
 }
 
 // int get_data_from_queue(void *cctx, int num, void **data, void **pitem)
@@ -203,84 +802,136 @@ int send_data_from_queue(void* cctx, int num, lsquic_stream_t* stream)
 
 /////////////////////////////////////////////////////////////////
 
+//在quic线程里修改状态，唤醒等待状态的调用线程
+static void set_status(contrl_ctx_t *ctrl_ctx, enum Status *pstatus, enum Status status)
+{
+    pthread_mutex_lock(&ctrl_ctx->mutex);
+    *pstatus = status;
+    pthread_cond_broadcast(&ctrl_ctx->cond);
+    pthread_mutex_unlock(&ctrl_ctx->mutex);
+}
+
 static lsquic_conn_ctx_t *quic_client_on_new_conn(void *stream_if_ctx, lsquic_conn_t *conn)
 {
     client_ctx_t *cctx = stream_if_ctx;
     contrl_ctx_t *ctrl_ctx = cctx->ctrl_ctx;
 
-    lsquic_conn_ctx_t *conn_ctx = malloc(sizeof(lsquic_conn_ctx_t));
-
-    conn_ctx->conn = conn;
-    conn_ctx->cctx = cctx;
+    //连接槽位是lsquic_engine_connect时传进去的
+    quic_conn *qc = lsquic_conn_get_ctx(conn);
+    qc->conn = conn;
+    qc->next_stream = 0;
+    qc->dg_ready = 0;
 
-    for (int i = 0; i < cctx->stream_count; i++)
+    for (int i = 0; i < qc->stream_count; i++)
     {
-        lsquic_conn_make_stream(conn);
+        if (!qc->streams[i].datagram)
+        {
+            lsquic_conn_make_stream(conn);
+        }
     }
 
     // if(ctrl_ctx->fn_connect){
     //     ctrl_ctx->fn_connect(ctrl_ctx->cb_param, ctrl_ctx->status);
     // }
-    ctrl_ctx->status = STATUS_CONNECTED;
-    QUIC_LOG("new conn");
+    set_status(ctrl_ctx, &qc->status, STATUS_CONNECTED);
+    QUIC_LOG("new conn %d", qc->id);
 
-    return conn_ctx;
+    return qc;
 }
-static int stream_id = 0;
+
 static void quic_client_on_conn_closed(lsquic_conn_t *conn)
 {
-    lsquic_conn_ctx_t *conn_ctx = lsquic_conn_get_ctx(conn);
-    contrl_ctx_t *ctrl_ctx = conn_ctx->cctx->ctrl_ctx;
+    quic_conn *qc = lsquic_conn_get_ctx(conn);
+    contrl_ctx_t *ctrl_ctx = qc->cctx->ctrl_ctx;
 
     lsquic_conn_set_ctx(conn, NULL);
-    free(conn_ctx);
 
-    stream_id = 0;
-    QUIC_LOG("close conn");
+    for (int i = 0; i < qc->stream_count; i++)
+    {
+        drop_queue(&qc->streams[i]);
+    }
+    qc->conn = 0;
+    qc->dg_ready = 0;
+    QUIC_LOG("close conn %d", qc->id);
     // if(ctrl_ctx->fn_close){
     //     ctrl_ctx->fn_close(ctrl_ctx->cb_param);
     // }
-    ctrl_ctx->status = STATUS_CLOSE;
+
+    pthread_mutex_lock(&ctrl_ctx->mutex);
+    qc->status = STATUS_CLOSE;
+    qc->used = 0;
+    pthread_cond_broadcast(&ctrl_ctx->cond);
+    pthread_mutex_unlock(&ctrl_ctx->mutex);
 }
 
 static lsquic_stream_ctx_t *quic_client_on_new_stream(void *stream_if_ctx, lsquic_stream_t *stream)
 {
-    lsquic_stream_ctx_t *steam_ctx = calloc(1, sizeof(*steam_ctx));
-    steam_ctx->stream = stream;
+    quic_conn *qc = lsquic_conn_get_ctx(lsquic_stream_conn(stream));
+    while (qc && qc->next_stream < qc->stream_count && qc->streams[qc->next_stream].datagram)
+    {
+        qc->next_stream++;//datagram流不占lsquic的流
+    }
+    if (!qc || qc->next_stream >= qc->stream_count)
+    {
+        //对端开的流或者多出来的流不处理
+        QUIC_LOG("unexpected stream");
+        lsquic_stream_close(stream);
+        return NULL;
+    }
 
-    client_ctx_t *cctx = stream_if_ctx;
-    steam_ctx->cctx = cctx;
-    steam_ctx->id = stream_id;
+    quic_stream *qs = &qc->streams[qc->next_stream++];
+    qs->stream = stream;
+    __atomic_store_n(&qs->idle, 0, __ATOMIC_RELEASE);
 
-    stream_id++;
+    //lsquic按优先级调用on_write，同优先级的流轮流写
+    if (qs->priority > 0)
+    {
+        lsquic_stream_set_priority(stream, qs->priority);
+    }
 
-    QUIC_LOG("new stream");
+    QUIC_LOG("new stream %d-%d", qc->id, qs->id);
     lsquic_stream_wantread(stream, 1);
     lsquic_stream_wantwrite(stream, 1);
 
-    return steam_ctx;
+    return qs;
+}
+static void client_deliver(recv_ctx *rc, const unsigned char *data, size_t len)
+{
+    quic_stream *qs = rc->arg;
+    contrl_ctx_t *ctrl_ctx = qs->qc->cctx->ctrl_ctx;
+    if (ctrl_ctx->fn_frame)
+    {
+        ctrl_ctx->fn_frame(ctrl_ctx->cb_param, qs->qc->id, qs->id, (void *)data, (int)len);
+    }
+    else if (ctrl_ctx->fn_data)
+    {
+        ctrl_ctx->fn_data(ctrl_ctx->cb_param, (void *)data, (int)len);
+    }
 }
+
 static void quic_client_on_read(lsquic_stream_t *stream, lsquic_stream_ctx_t *st_h)
 {
     // QUIC_LOG("on read");
-    client_ctx_t *cctx = st_h->cctx;
+    quic_stream *qs = st_h;
+    client_ctx_t *cctx = qs->qc->cctx;
     contrl_ctx_t *ctrl_ctx = cctx->ctrl_ctx;
 
-    char buf[1024] = {0};
-
-    int rlen = 0;
-    do
+    recv_ctx rc = {
+        .fp = &cctx->fpool,
+        .rx = ctrl_ctx->fn_frame ? &qs->rx : NULL,
+        .max = ctrl_ctx->max_frame,
+        .deliver = client_deliver,
+        .arg = qs,
+    };
+    int ret = stream_recv(stream, &rc);
+    if (ret < 0)
     {
-        rlen = lsquic_stream_read(stream, buf, sizeof(buf));
-        
-        if (rlen>0)
-        {
-            ctrl_ctx->fn_data(ctrl_ctx->cb_param, buf, rlen);
-        }
-        
-    } while (rlen > 0);
-
-    lsquic_stream_wantread(stream, 1);
+        lsquic_stream_close(stream);
+    }
+    else if (ret == 0)
+    {
+        lsquic_stream_wantread(stream, 0);//对端不再发了，不然on_read会一直被调用
+    }
 }
 
 int tm_compare(struct timeval *point_time, struct timeval *cur)
@@ -335,17 +986,46 @@ int tm_compare(struct timeval *point_time, struct timeval *cur)
 
 static void quic_client_on_write(lsquic_stream_t *stream, lsquic_stream_ctx_t *st_h)
 {
-    client_ctx_t *cctx = st_h->cctx;
-    int num = st_h->id;
+    quic_stream *qs = st_h;
+    int weight = qs->weight > 0 ? qs->weight : 1;
+
+    int slen = send_data_from_queue(qs, stream, weight * SEND_QUANTUM);
+    if (slen > 0)
+    {
+        lsquic_stream_flush(stream);
+    }
 
-    int slen = send_data_from_queue(cctx, num, stream);
-    if (slen <= 0)
+    if (!spsc_empty(&qs->que))
     {
         return;
     }
 
-    lsquic_stream_flush(stream);
-    lsquic_stream_wantwrite(stream, 1);
+    //队列空了不再要写事件，否则引擎一直可tick，quic线程空转
+    //先置idle再检查一次队列，避免和生产者的入队错过
+    __atomic_store_n(&qs->idle, 1, __ATOMIC_SEQ_CST);
+    if (spsc_empty(&qs->que) || !__atomic_exchange_n(&qs->idle, 0, __ATOMIC_SEQ_CST))
+    {
+        lsquic_stream_wantwrite(stream, 0);
+    }
+}
+
+//生产者入队后投递到quic线程，重新打开写事件
+static void resume_stream(void *arg)
+{
+    quic_stream *qs = arg;
+    if (qs->datagram)
+    {
+        if (qs->qc->conn && qs->qc->dg_ready)
+        {
+            lsquic_conn_want_datagram_write(qs->qc->conn, 1);
+            client_process_conns(qs->qc->cctx);
+        }
+    }
+    else if (qs->stream)
+    {
+        lsquic_stream_wantwrite(qs->stream, 1);
+        client_process_conns(qs->qc->cctx);
+    }
 }
 
 // static void send_extern_data(contrl_ctx_t *ctrl_ctx, lsquic_stream_t *stream)
@@ -405,8 +1085,12 @@ static void quic_client_on_write(lsquic_stream_t *stream, lsquic_stream_ctx_t *s
 static void quic_client_on_close(lsquic_stream_t *stream, lsquic_stream_ctx_t *st_h)
 {
     // LOG("close stream");
-    //  client_ctx_t *cctx = st_h->cctx;
-    free(st_h);
+    if (st_h)
+    {
+        st_h->stream = 0;
+        __atomic_store_n(&st_h->idle, 0, __ATOMIC_RELEASE);
+        frame_rx_reset(&st_h->qc->cctx->fpool, &st_h->rx);
+    }
 }
 
 const struct lsquic_stream_if client_echo_stream_if = {
@@ -416,29 +1100,174 @@ const struct lsquic_stream_if client_echo_stream_if = {
     .on_read = quic_client_on_read,
     .on_write = quic_client_on_write,
     .on_close = quic_client_on_close,
+    .on_dg_write = quic_client_on_dg_write,
+    .on_datagram = quic_client_on_datagram,
+    .on_hsk_done = quic_client_on_hsk_done,
 };
 
+#define CTL_SZ 64
+#define RECV_BATCH 16        /*一次recvmmsg最多收的包数*/
+#define RECV_BUF_SIZE 2048   /*没开GRO时每个包的缓冲区*/
+#define GRO_BUF_SIZE 65536   /*开了GRO时一次可能收到64K*/
+#define SEND_MMSG 64         /*一次sendmmsg最多的msghdr个数*/
+#define SEND_IOV_TOTAL 1024  /*一次sendmmsg所有msghdr的iov总数*/
+#define GSO_MAX_SEGS 64      /*一个GSO包最多的分段数*/
+#define GSO_MAX_BYTES 65000
+
+typedef struct recv_batch_
+{
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iov[RECV_BATCH];
+    struct sockaddr_storage peer[RECV_BATCH];
+    unsigned char ctl[RECV_BATCH][CTL_SZ];
+    unsigned char *buf;
+    size_t buf_size;
+} recv_batch;
+
+typedef struct send_batch_
+{
+    struct mmsghdr msgs[SEND_MMSG];
+    unsigned int count[SEND_MMSG];//每个msghdr里包含几个lsquic的包
+    struct iovec iov[SEND_IOV_TOTAL];
+    unsigned char ctl[SEND_MMSG][CMSG_SPACE(sizeof(uint16_t))];
+} send_batch;
+
+static size_t spec_len(const struct lsquic_out_spec *spec)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < spec->iovlen; i++)
+    {
+        len += spec->iov[i].iov_len;
+    }
+    return len;
+}
+
+static socklen_t sa_len(const struct sockaddr *sa)
+{
+    return sa->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static int same_dest(const struct lsquic_out_spec *a, const struct lsquic_out_spec *b)
+{
+    return a->dest_sa == b->dest_sa ||
+           (a->dest_sa->sa_family == b->dest_sa->sa_family && 0 == memcmp(a->dest_sa, b->dest_sa, sa_len(a->dest_sa)));
+}
+
+//把从start开始的包装进一个msghdr，开了GSO时把同目的地的连续包合成一个(除最后一个外长度都要相同)
+//返回装进去的包数，iov不够时返回0
+static unsigned int fill_msg(client_ctx_t *cctx, const struct lsquic_out_spec *specs, unsigned int start, unsigned int n_specs,
+                             struct msghdr *msg, unsigned char *ctl, struct iovec *iov, unsigned int iov_left)
+{
+    size_t seg = spec_len(&specs[start]);
+    size_t total = 0;
+    unsigned int k = 0;
+    unsigned int niov = 0;
+
+    while (start + k < n_specs)
+    {
+        const struct lsquic_out_spec *spec = &specs[start + k];
+        size_t len = spec_len(spec);
+        if (k > 0 && (!cctx->gso || k >= GSO_MAX_SEGS || len > seg || total + len > GSO_MAX_BYTES || !same_dest(&specs[start], spec)))
+        {
+            break;
+        }
+        if (niov + spec->iovlen > iov_left)
+        {
+            break;
+        }
+
+        memcpy(&iov[niov], spec->iov, spec->iovlen * sizeof(struct iovec));
+        niov += spec->iovlen;
+        total += len;
+        k++;
+        if (len < seg)
+        {
+            break;//短包只能是最后一段
+        }
+    }
+    if (k == 0)
+    {
+        return 0;
+    }
+
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = (void *)specs[start].dest_sa;
+    msg->msg_namelen = sa_len(specs[start].dest_sa);
+    msg->msg_iov = iov;
+    msg->msg_iovlen = niov;
+    if (k > 1)
+    {
+        msg->msg_control = ctl;
+        msg->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t *)CMSG_DATA(cmsg) = (uint16_t)seg;
+    }
+    return k;
+}
+
+//一次sendmmsg发一批，没发完(EAGAIN)就打开可写事件，可写后再让引擎发剩下的
 static int send_packets_out(void *ctx, const struct lsquic_out_spec *specs,
                             unsigned n_specs)
 {
-    struct msghdr msg;
-    int sockfd;
-    unsigned n;
-
-    memset(&msg, 0, sizeof(msg));
-    sockfd = (int)(uintptr_t)ctx;
+    client_ctx_t *cctx = ctx;
+    send_batch *sb = cctx->sb;
+    unsigned int sent = 0;
 
-    for (n = 0; n < n_specs; ++n)
+    while (sent < n_specs)
     {
-        msg.msg_name = (void *)specs[n].dest_sa;
-        msg.msg_namelen = sizeof(struct sockaddr_in);
-        msg.msg_iov = specs[n].iov;
-        msg.msg_iovlen = specs[n].iovlen;
-        if (sendmsg(sockfd, &msg, 0) < 0)
+        unsigned int nmsg = 0;
+        unsigned int niov = 0;
+        unsigned int next = sent;
+        while (next < n_specs && nmsg < SEND_MMSG)
+        {
+            unsigned int k = fill_msg(cctx, specs, next, n_specs, &sb->msgs[nmsg].msg_hdr, sb->ctl[nmsg],
+                                      &sb->iov[niov], SEND_IOV_TOTAL - niov);
+            if (k == 0)
+            {
+                break;
+            }
+            niov += sb->msgs[nmsg].msg_hdr.msg_iovlen;
+            sb->count[nmsg++] = k;
+            next += k;
+        }
+        if (nmsg == 0)
+        {
+            errno = EINVAL;
+            break;
+        }
+
+        int r = sendmmsg(cctx->fd, sb->msgs, nmsg, 0);
+        if (r < 0 && errno == EIO && cctx->gso)
+        {
+            //网卡不支持校验和卸载时GSO会报EIO，关掉重发
+            QUIC_LOG("gso failed, disable it");
+            cctx->gso = 0;
+            continue;
+        }
+        if (r <= 0)
+        {
+            break;
+        }
+        for (int i = 0; i < r; i++)
+        {
+            sent += sb->count[i];
+        }
+        if ((unsigned int)r < nmsg)
+        {
+            errno = EAGAIN;
             break;
+        }
     }
 
-    return (int)n;
+    if (sent < n_specs && !cctx->send_blocked && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        cctx->send_blocked = 1;
+        mod_io_event(cctx->eb, cctx->ev_net, SEV_IO_READABLE | SEV_IO_WRITEABLE);
+    }
+    return sent > 0 ? (int)sent : -1;
 }
 
 int get_ecn(struct msghdr *msg)
@@ -453,356 +1282,1624 @@ int get_ecn(struct msghdr *msg)
             printf("ECN information: %d\n", ecn);
         }
     }
-    return ecn;
+    return ecn;
+}
+//开了GRO时取分段长度，没有返回0
+static int get_gro_size(struct msghdr *msg)
+{
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+        {
+            return *(int *)CMSG_DATA(cmsg);
+        }
+    }
+    return 0;
+}
+
+static int server_steer(struct server_shard_ *sh, unsigned char *buf, size_t len, struct sockaddr_storage *peer, int ecn);
+
+//recvmmsg把socket读空，全部交给引擎后只处理一次连接
+static void client_read_net_data(int fd, int what, void *arg)
+{
+    client_ctx_t *cctx = arg;
+    recv_batch *rb = cctx->rb;
+
+    if (what & SEV_IO_WRITEABLE)
+    {
+        cctx->send_blocked = 0;
+        mod_io_event(cctx->eb, cctx->ev_net, SEV_IO_READABLE);
+        lsquic_engine_send_unsent_packets(cctx->engine);
+    }
+
+    int n = RECV_BATCH;
+    while ((what & SEV_IO_READABLE) && n == RECV_BATCH)
+    {
+        for (int i = 0; i < RECV_BATCH; i++)
+        {
+            struct msghdr *msg = &rb->msgs[i].msg_hdr;
+            rb->iov[i].iov_base = rb->buf + i * rb->buf_size;
+            rb->iov[i].iov_len = rb->buf_size;
+            msg->msg_name = &rb->peer[i];
+            msg->msg_namelen = sizeof(rb->peer[i]);
+            msg->msg_iov = &rb->iov[i];
+            msg->msg_iovlen = 1;
+            msg->msg_control = rb->ctl[i];
+            msg->msg_controllen = CTL_SZ;
+            msg->msg_flags = 0;
+        }
+
+        n = recvmmsg(fd, rb->msgs, RECV_BATCH, 0, NULL);
+        if (n <= 0)
+        {
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            struct msghdr *msg = &rb->msgs[i].msg_hdr;
+            unsigned char *buf = rb->iov[i].iov_base;
+            size_t len = rb->msgs[i].msg_len;
+
+            int ecn = get_ecn(msg);
+            ecn = ecn < 0 ? 0 : ecn;
+
+            //GRO合并的包按分段长度拆开
+            size_t seg = cctx->gro ? (size_t)get_gro_size(msg) : 0;
+            seg = seg ? seg : len;
+            for (size_t off = 0; off < len; off += seg)
+            {
+                size_t plen = len - off < seg ? len - off : seg;
+                if (cctx->shard && server_steer(cctx->shard, buf + off, plen, &rb->peer[i], ecn))
+                {
+                    continue;//属于别的引擎的连接，已经转过去了
+                }
+                (void)lsquic_engine_packet_in(cctx->engine, buf + off, plen,
+                                              (struct sockaddr *)cctx->local_addr,
+                                              (struct sockaddr *)&rb->peer[i],
+                                              (void *)cctx, ecn);
+            }
+        }
+    }
+
+    client_process_conns(cctx);
+}
+
+int is_stop(contrl_ctx_t *ctrl_ctx)
+{
+    return !ctrl_ctx->runing;
+}
+
+void client_process_conns(client_ctx_t *cctx)
+{
+    lsquic_engine_t *engine = cctx->engine;
+    cus_evt *timer = cctx->timer;
+
+    int diff;
+    struct timeval timeout;
+
+    lsquic_engine_process_conns(engine);
+
+    if (lsquic_engine_earliest_adv_tick(engine, &diff))
+    {
+        if (diff < 0 || (unsigned)diff < cctx->eng_cfg->es_clock_granularity)
+        {
+            timeout.tv_sec = 0;
+            timeout.tv_usec = cctx->eng_cfg->es_clock_granularity;
+        }
+        else
+        {
+            timeout.tv_sec = (unsigned)diff / 1000000;
+            timeout.tv_usec = (unsigned)diff % 1000000;
+        }
+        if (!is_stop(cctx->ctrl_ctx))
+            add_cus_event(cctx->eb, timer, &timeout);
+    }
+}
+
+static void timer_handler(int fd, int event, int is_overtime, void *arg)
+{
+    client_ctx_t *cctx = arg;
+    if (!is_stop(cctx->ctrl_ctx))
+        client_process_conns(cctx);
+}
+
+//以下命令都通过sev_post投递到quic线程执行，不再轮询ctrl_ctx->cmd
+static void do_connect(void *arg)
+{
+    quic_conn *qc = arg;
+    client_ctx_t *ctx = qc->cctx;
+
+    if (qc->status != STATUS_CONNECTED && !qc->conn)
+    {
+        //把连接槽位作为conn_ctx传进去，回调里用lsquic_conn_get_ctx取回
+        qc->conn = lsquic_engine_connect(ctx->engine, N_LSQVER, (struct sockaddr *)ctx->local_addr, (struct sockaddr *)&qc->peer,
+                                         0, qc, 0, 0, 0, 0, 0, 0);
+        client_process_conns(ctx);
+        QUIC_LOG("connect to quic_sever\n");
+    }
+}
+
+static void do_close(void *arg)
+{
+    quic_conn *qc = arg;
+    client_ctx_t *ctx = qc->cctx;
+    contrl_ctx_t *ctrl_ctx = ctx->ctrl_ctx;
+
+    if (qc->conn)
+    {
+        lsquic_conn_close(qc->conn);
+        client_process_conns(ctx);
+        QUIC_LOG("connect close\n");
+    }
+    else
+    {
+        pthread_mutex_lock(&ctrl_ctx->mutex);
+        qc->status = STATUS_CLOSE;
+        qc->used = 0;
+        pthread_cond_broadcast(&ctrl_ctx->cond);
+        pthread_mutex_unlock(&ctrl_ctx->mutex);
+    }
+}
+
+static int post_cmd(contrl_ctx_t *ctrl_ctx, post_callback fn, void *arg)
+{
+    client_ctx_t *ctx = ctrl_ctx->cctx;
+    if (!ctx || !ctrl_ctx->runing)
+    {
+        return -1;
+    }
+    return sev_post(ctx->eb, fn, arg);
+}
+
+static quic_conn *get_conn(contrl_ctx_t *ctrl_ctx, int conn)
+{
+    client_ctx_t *ctx = ctrl_ctx->cctx;
+    if (!ctx || conn < 0 || conn >= QUIC_MAX_CONN)
+    {
+        return NULL;
+    }
+    return &ctx->conns[conn];
+}
+
+static void make_addr(struct sockaddr_in *addr, char *ip, int port)
+{
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    addr->sin_addr.s_addr = ip == 0 ? INADDR_ANY : inet_addr(ip);
+}
+
+int make_udp_sock(struct sockaddr_in *local_addr)
+{
+    int res = 0;
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    flags |= O_NONBLOCK;
+    res = fcntl(sockfd, F_SETFL, flags);
+    if (res < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    res = bind(sockfd, (const struct sockaddr *)local_addr, sizeof(struct sockaddr_in));
+    if (res < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+//客户端和服务端引擎共用：socket的io事件、引擎的定时器、收发包的批处理缓冲区和引擎本身
+static int make_engine_ctx(contrl_ctx_t *ctrl_ctx, client_ctx_t *ctx, evb *eb, int sock, unsigned flags, struct sockaddr_in *local_addr,
+                           struct lsquic_engine_settings *setting, struct lsquic_engine_api *engine_api)
+{
+    ctx->fd = sock;
+
+    ctx->eb = eb;
+
+    ctx->ev_net = new_io_event(sock, SEV_IO_READABLE, 1, client_read_net_data, (void *)ctx);
+    add_io_event(ctx->eb, ctx->ev_net);
+
+    ctx->timer = new_cus_event(2, 0, 0, timer_handler, ctx);
+    sev_cus_set_priority(ctx->timer, SEV_PRI_TIMER);//引擎的tick和定时器一起在io之前跑
+
+    if (ctrl_ctx->udp_offload)
+    {
+        //内核不支持时getsockopt/setsockopt会失败，退回到逐包收发
+        int val = 0;
+        socklen_t vlen = sizeof(val);
+        ctx->gso = 0 == getsockopt(sock, SOL_UDP, UDP_SEGMENT, &val, &vlen);
+        val = 1;
+        ctx->gro = 0 == setsockopt(sock, SOL_UDP, UDP_GRO, &val, sizeof(val));
+        QUIC_LOG("udp gso %d gro %d", ctx->gso, ctx->gro);
+    }
+
+    ctx->rb = (recv_batch *)calloc(1, sizeof(recv_batch));
+    ctx->rb->buf_size = ctx->gro ? GRO_BUF_SIZE : RECV_BUF_SIZE;
+    ctx->rb->buf = (unsigned char *)malloc(RECV_BATCH * ctx->rb->buf_size);
+    ctx->sb = (send_batch *)calloc(1, sizeof(send_batch));
+
+    lsquic_engine_init_settings(setting, flags);
+    setting->es_datagrams = ctrl_ctx->datagram;
+    if (!(flags & LSENG_SERVER))
+    {
+        //gQUIC 46/50的短包头不带CID，客户端引擎会改成按本地地址找连接，一个socket上只能有一个连接
+        //只用IETF版本(connect时本来选的就是最高的IETF版本)，连接按CID区分
+        setting->es_versions &= LSQUIC_IETF_VERSIONS;
+    }
+
+    ctx->engine = lsquic_engine_new(flags, engine_api);
+    ctx->eng_cfg = setting;
+
+    ctx->local_addr = local_addr;
+    ctx->ctrl_ctx = ctrl_ctx;
+    return ctx->engine ? 0 : -1;
+}
+
+//释放make_engine_ctx创建的东西，sev_base由调用者释放
+static void clean_engine_ctx(client_ctx_t *ctx)
+{
+    lsquic_engine_destroy(ctx->engine);
+    free_cus_event(ctx->timer);
+    free_io_event(ctx->ev_net);
+    close(ctx->fd);
+
+    free(ctx->rb->buf);
+    free(ctx->rb);
+    free(ctx->sb);
+    frame_pool_clean(&ctx->fpool);
+}
+
+int make_client_ctx(contrl_ctx_t *ctrl_ctx, client_ctx_t *ctx, int sock, struct sockaddr_in *local_addr, struct lsquic_engine_settings *setting, struct lsquic_engine_api *engine_api)
+{
+    make_engine_ctx(ctrl_ctx, ctx, sev_new_base(), sock, 0, local_addr, setting, engine_api);
+
+    for (int i = 0; i < QUIC_MAX_CONN; i++)
+    {
+        quic_conn *qc = &ctx->conns[i];
+        qc->cctx = ctx;
+        qc->id = i;
+        for (int k = 0; k < QUIC_MAX_STREAM; k++)
+        {
+            qc->streams[k].qc = qc;
+            qc->streams[k].id = k;
+        }
+    }
+    return 0;
+}
+
+void loop(client_ctx_t *ctx)
+{
+    sev_loop(ctx->eb);
+}
+
+void clean_client_ctx(client_ctx_t *ctx)
+{
+    clean_engine_ctx(ctx);
+    if (ctx->tp_timer)
+    {
+        cancel_timer(ctx->eb, ctx->tp_timer);
+    }
+    sev_free_base(ctx->eb);
+
+    for (int i = 0; i < QUIC_MAX_CONN; i++)
+    {
+        for (int k = 0; k < QUIC_MAX_STREAM; k++)
+        {
+            if (ctx->conns[i].streams[k].que.data)
+            {
+                drop_queue(&ctx->conns[i].streams[k]);
+                spsc_destroy(&ctx->conns[i].streams[k].que);
+            }
+            free(ctx->conns[i].streams[k].dg);
+            free(ctx->conns[i].streams[k].meta);
+        }
+    }
+}
+
+static void start_transport_report(client_ctx_t *ctx);
+
+static void *quic_thread(void *args)
+{
+    contrl_ctx_t *ctrl_ctx = (contrl_ctx_t *)args;
+
+    int fd = 0;
+    client_ctx_t *ctx = ctrl_ctx->cctx;
+    struct sockaddr_in local;
+    struct lsquic_engine_settings setting;
+
+    struct sockaddr_in *local_addr = &local;
+    make_addr(local_addr, 0, 0);
+    fd = make_udp_sock(local_addr);
+
+    struct lsquic_engine_api engine_api = {
+        .ea_settings = &setting,
+        .ea_packets_out = send_packets_out,
+        .ea_packets_out_ctx = (void *)ctx,
+        .ea_stream_if = &client_echo_stream_if,
+        .ea_stream_if_ctx = ctx,
+    };
+
+    make_client_ctx(ctrl_ctx, ctx, fd, &local, &setting, &engine_api);
+    ctrl_ctx->runing = 1;
+    start_transport_report(ctx);
+    set_status(ctrl_ctx, &ctrl_ctx->status, STATUS_RUNING);
+    QUIC_LOG("start loop");
+    loop(ctx);
+    ctrl_ctx->runing = 0;
+
+    pthread_mutex_lock(&ctrl_ctx->mutex);
+    ctrl_ctx->cctx = 0;
+    pthread_mutex_unlock(&ctrl_ctx->mutex);
+    clean_client_ctx(ctx);
+    free(ctx);
+    return 0;
+}
+
+//在条件变量上等待状态变成status，不再忙等
+static int wait_status(contrl_ctx_t *ctrl_ctx, enum Status *pstatus, int status, int overtime/*ms*/)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += overtime / 1000;
+    ts.tv_nsec += (overtime % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    int ret = 1;
+    pthread_mutex_lock(&ctrl_ctx->mutex);
+    while (*pstatus != status)
+    {
+        if (ETIMEDOUT == pthread_cond_timedwait(&ctrl_ctx->cond, &ctrl_ctx->mutex, &ts))
+        {
+            ret = *pstatus == status;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ctrl_ctx->mutex);
+
+    if (!ret)
+    {
+        QUIC_LOG("wait status %d overtime",status);
+    }
+    return ret;
+}
+
+QUIC_API void quic_setting(contrl_ctx_t *ctrl_ctx, on_data fn_data, data_parse fn_parse, data_free fn_free, data_remake fn_remake, void* param)
+{
+    QUIC_TRACE;
+    ctrl_ctx->fn_data = fn_data;
+    ctrl_ctx->fn_parse = fn_parse;
+    ctrl_ctx->fn_free = fn_free;
+    ctrl_ctx->fn_remake = fn_remake;
+    ctrl_ctx->cb_param = param;
+}
+
+QUIC_API void quic_set_iov(contrl_ctx_t *ctrl_ctx, data_iov fn_iov)
+{
+    ctrl_ctx->fn_iov = fn_iov;
+}
+
+//quic_run之前调用，内核支持时打开UDP_SEGMENT(GSO)和UDP_GRO
+QUIC_API void quic_set_udp_offload(contrl_ctx_t *ctrl_ctx, int enable)
+{
+    ctrl_ctx->udp_offload = enable;
+}
+
+QUIC_API void quic_set_transport_cb(contrl_ctx_t *ctrl_ctx, on_transport fn_transport, int interval_ms)
+{
+    ctrl_ctx->fn_transport = fn_transport;
+    ctrl_ctx->transport_ms = interval_ms;
+}
+
+QUIC_API void quic_set_frame_info(contrl_ctx_t *ctrl_ctx, data_info fn_info)
+{
+    ctrl_ctx->fn_info = fn_info;
+}
+
+QUIC_API void quic_set_framing(contrl_ctx_t *ctrl_ctx, on_frame fn_frame, unsigned int max_frame)
+{
+    ctrl_ctx->fn_frame = fn_frame;
+    ctrl_ctx->max_frame = max_frame ? max_frame : QUIC_FRAME_MAX;
+}
+
+// QUIC_API void quic_setting(contrl_ctx_t *ctrl_ctx, on_data fn_data, on_send fn_send, on_close fn_close, on_connect fn_connect, void* param)
+// {
+//     QUIC_TRACE;
+//     ctrl_ctx->fn_data = fn_data;
+//     ctrl_ctx->fn_send = fn_send;
+//     ctrl_ctx->fn_close = fn_close;
+//     ctrl_ctx->fn_connect = fn_connect;
+//     ctrl_ctx->cb_param = param;
+// }
+
+//每个连接打开count个流，cfg可以为空(都用默认优先级，权重1)
+QUIC_API void quic_set_streams(contrl_ctx_t *ctrl_ctx, int count, quic_stream_cfg *cfg)
+{
+    count = count < 1 ? 1 : count;
+    count = count > QUIC_MAX_STREAM ? QUIC_MAX_STREAM : count;
+
+    pthread_mutex_lock(&ctrl_ctx->mutex);
+    ctrl_ctx->stream_count = count;
+    ctrl_ctx->datagram = 0;
+    for (int i = 0; i < count; i++)
+    {
+        ctrl_ctx->stream_cfg[i].priority = cfg ? cfg[i].priority : 0;
+        ctrl_ctx->stream_cfg[i].weight = cfg && cfg[i].weight > 0 ? cfg[i].weight : 1;
+        ctrl_ctx->stream_cfg[i].datagram = cfg ? cfg[i].datagram : 0;
+        ctrl_ctx->stream_cfg[i].fec = cfg && cfg[i].fec > 0 ? (cfg[i].fec > 255 ? 255 : cfg[i].fec) : 0;
+        ctrl_ctx->stream_cfg[i].max_bytes = cfg ? cfg[i].max_bytes : 0;
+        ctrl_ctx->stream_cfg[i].max_delay = cfg && cfg[i].max_delay > 0 ? cfg[i].max_delay : 0;
+        ctrl_ctx->datagram |= ctrl_ctx->stream_cfg[i].datagram;
+    }
+    pthread_mutex_unlock(&ctrl_ctx->mutex);
+}
+
+//quic_run之前调用，容量向上取整到2的幂
+QUIC_API void quic_set_queue_size(contrl_ctx_t *ctrl_ctx, unsigned int size)
+{
+    ctrl_ctx->queue_size = size;
+}
+
+QUIC_API int quic_run(contrl_ctx_t *ctrl_ctx)
+{
+    QUIC_TRACE;
+    if (ctrl_ctx->runing)
+    {
+        return 1;
+    }
+
+    //条件变量用单调时钟，系统时间跳变不影响等待超时
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctrl_ctx->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (ctrl_ctx->stream_count <= 0)
+    {
+        quic_set_streams(ctrl_ctx, 1, NULL);
+    }
+    if (!ctrl_ctx->queue_size)
+    {
+        ctrl_ctx->queue_size = QUEUE_SIZE;
+    }
+
+    //client_ctx在这里分配，quic_open/quic_push_data可以直接找到连接和队列
+    ctrl_ctx->cctx = calloc(1, sizeof(client_ctx_t));
+
+    pthread_t thread1;
+    if (pthread_create(&thread1, NULL, quic_thread, (void *)ctrl_ctx))
+    {
+        free(ctrl_ctx->cctx);
+        ctrl_ctx->cctx = 0;
+        return 0;
+    }
+    pthread_detach(thread1);
+
+    if (!wait_status(ctrl_ctx, &ctrl_ctx->status, STATUS_RUNING, 2000))
+    {
+        return 0;
+    }
+
+    QUIC_TRACE;
+    return 1;
+}
+
+QUIC_API int quic_open(contrl_ctx_t *ctrl_ctx, char *ip, int port)
+{
+    QUIC_TRACE;
+    quic_conn *qc = NULL;
+
+    pthread_mutex_lock(&ctrl_ctx->mutex);
+    client_ctx_t *ctx = ctrl_ctx->cctx;
+    for (int i = 0; ctx && i < QUIC_MAX_CONN; i++)
+    {
+        if (!ctx->conns[i].used)
+        {
+            qc = &ctx->conns[i];
+            break;
+        }
+    }
+    if (qc)
+    {
+        qc->used = 1;
+        qc->status = STATUS_NONE;
+        make_addr((struct sockaddr_in *)&qc->peer, ip, port);
+
+        qc->stream_count = ctrl_ctx->stream_count;
+        for (int i = 0; i < qc->stream_count; i++)
+        {
+            quic_stream *qs = &qc->streams[i];
+            qs->priority = ctrl_ctx->stream_cfg[i].priority;
+            qs->weight = ctrl_ctx->stream_cfg[i].weight;
+            qs->datagram = ctrl_ctx->stream_cfg[i].datagram;
+            qs->fec = ctrl_ctx->stream_cfg[i].fec;
+            qs->max_bytes = ctrl_ctx->stream_cfg[i].max_bytes;
+            qs->max_delay = ctrl_ctx->stream_cfg[i].max_delay;
+            qs->skip = 0;
+            if (qs->datagram && !qs->dg)
+            {
+                qs->dg = calloc(1, sizeof(dgram_tx));
+            }
+            if (!qs->que.data && spsc_init(&qs->que, ctrl_ctx->queue_size) != 0)
+            {
+                QUIC_LOG("init queue failed");
+            }
+            if (qs->que.data && !qs->meta)
+            {
+                qs->meta = calloc(qs->que.cap, sizeof(frame_meta));
+            }
+        }
+    }
+    pthread_mutex_unlock(&ctrl_ctx->mutex);
+
+    if (!qc)
+    {
+        QUIC_LOG("no free conn");
+        return -1;
+    }
+
+    if (post_cmd(ctrl_ctx, do_connect, qc) != 0)
+    {
+        pthread_mutex_lock(&ctrl_ctx->mutex);
+        qc->used = 0;
+        pthread_mutex_unlock(&ctrl_ctx->mutex);
+        return -1;
+    }
+    if (!wait_status(ctrl_ctx, &qc->status, STATUS_CONNECTED, 1000))
+    {
+        quic_close_conn(ctrl_ctx, qc->id);
+        return -1;
+    }
+
+    QUIC_TRACE;
+    return qc->id;
+}
+
+QUIC_API int quic_close_conn(contrl_ctx_t *ctrl_ctx, int conn)
+{
+    quic_conn *qc = get_conn(ctrl_ctx, conn);
+    if (!qc || !qc->used)
+    {
+        return 1;
+    }
+
+    if (post_cmd(ctrl_ctx, do_close, qc) != 0 || !wait_status(ctrl_ctx, &qc->status, STATUS_CLOSE, 1000))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+QUIC_API int quic_conn_status(contrl_ctx_t *ctrl_ctx, int conn)
+{
+    quic_conn *qc = get_conn(ctrl_ctx, conn);
+    if (!qc || !qc->used)
+    {
+        return STATUS_NONE;
+    }
+    return qc->status;
+}
+
+QUIC_API int quic_connect(contrl_ctx_t *ctrl_ctx, char *ip, int port)
+{
+    QUIC_TRACE;
+    if (STATUS_CONNECTED == quic_conn_status(ctrl_ctx, 0))
+    {
+        return 1;
+    }
+
+    return quic_open(ctrl_ctx, ip, port) >= 0;
+}
+
+QUIC_API int quic_close(contrl_ctx_t *ctrl_ctx)
+{
+    QUIC_TRACE;
+
+    int ret = 1;
+    for (int i = 0; i < QUIC_MAX_CONN; i++)
+    {
+        if (!quic_close_conn(ctrl_ctx, i))
+        {
+            ret = 0;
+        }
+    }
+
+    QUIC_TRACE;
+    return ret;
+}
+
+//0号连接在用就返回它的状态，否则返回引擎的状态
+QUIC_API int quic_status(contrl_ctx_t *ctrl_ctx)
+{
+    int status = quic_conn_status(ctrl_ctx, 0);
+    return status != STATUS_NONE ? status : ctrl_ctx->status;
+}
+
+static size_t item_bytes(contrl_ctx_t *ctrl_ctx, void *item)
+{
+    struct iovec iov[SEND_IOV_MAX];
+    int k = item_iov(ctrl_ctx, item, iov, SEND_IOV_MAX);
+    size_t len = 0;
+    for (int i = 0; i < k && i < SEND_IOV_MAX; i++)
+    {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+static void drop_frame(quic_stream *qs, size_t len)
+{
+    __atomic_add_fetch(&qs->drop_frames, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&qs->drop_bytes, len, __ATOMIC_RELAXED);
+}
+
+//生产者线程里决定这一帧能不能入队，gop为0(没有帧信息)时只按容量拒绝
+//积压(槽位满、超过max_bytes或者max_delay)时：非参考帧直接丢；参考帧放不下后面的帧都解不了，一直丢到下一个关键帧；
+//关键帧让消费者把排着的旧GOP清掉，有槽位就入队
+static int admit_frame(quic_stream *qs, int gop, quic_frame_info *info, size_t len)
+{
+    int key = info->flags & QUIC_FRAME_KEY;
+    if (gop && key)
+    {
+        qs->gop++;
+    }
+    if (gop && qs->skip && !key)
+    {
+        drop_frame(qs, len);
+        return 0;
+    }
+
+    int full = spsc_size(&qs->que) >= qs->que.cap;
+    int over = full || (qs->max_bytes && __atomic_load_n(&qs->qbytes, __ATOMIC_RELAXED) + (long long)len > qs->max_bytes);
+    if (!over && gop && qs->max_delay && !spsc_empty(&qs->que))
+    {
+        unsigned int head = __atomic_load_n(&qs->que.head, __ATOMIC_ACQUIRE);
+        over = info->ts - qs->meta[head & qs->que.mask].ts > qs->max_delay;
+    }
+    if (!over)
+    {
+        qs->skip = 0;
+        return 1;
+    }
+
+    if (gop && key)
+    {
+        __atomic_store_n(&qs->drop_gop, qs->gop, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&qs->drop_gops, 1, __ATOMIC_RELAXED);
+        qs->skip = full;
+        if (!full)
+        {
+            return 1;
+        }
+    }
+    else if (gop && !(info->flags & QUIC_FRAME_NOREF))
+    {
+        qs->skip = 1;
+    }
+    drop_frame(qs, len);
+    return 0;
+}
+
+//同一个流只能在一个线程里调用(单生产者)，队列满、按GOP策略丢掉或者连接不存在返回0
+QUIC_API int quic_push_data(contrl_ctx_t *ctrl_ctx, int conn, int stream, void *data)
+{
+    quic_conn *qc = get_conn(ctrl_ctx, conn);
+    if (!qc || !__atomic_load_n(&qc->used, __ATOMIC_ACQUIRE) || stream < 0 || stream >= qc->stream_count)
+    {
+        return 0;
+    }
+
+    quic_stream *qs = &qc->streams[stream];
+    quic_frame_info info = {0};
+    if (ctrl_ctx->fn_info)
+    {
+        ctrl_ctx->fn_info(data, &info);
+    }
+    size_t len = item_bytes(ctrl_ctx, data);
+    if (!admit_frame(qs, ctrl_ctx->fn_info != NULL, &info, len))
+    {
+        return 0;//admit_frame已经记到drop_frames里了
+    }
+
+    //admit_frame确认过有槽位，只有生产者会占用槽位
+    frame_meta *m = &qs->meta[qs->que.tail & qs->que.mask];
+    m->bytes = len;
+    m->gop = qs->gop;
+    m->ts = info.ts;
+    __atomic_add_fetch(&qs->qbytes, (long long)len, __ATOMIC_RELAXED);
+    int ret = spsc_push(&qs->que, (void *)data);
+    if (!ret)
+    {
+        __atomic_sub_fetch(&qs->qbytes, (long long)len, __ATOMIC_RELAXED);
+        return ret;
+    }
+    qs->last_ts = info.ts;
+
+    //quic线程已经关掉了这个流的写事件，投递一次让它重新打开
+    if (__atomic_load_n(&qs->idle, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&qs->idle, 0, __ATOMIC_SEQ_CST))
+    {
+        post_cmd(ctrl_ctx, resume_stream, qs);
+    }
+    return ret;
+}
+
+QUIC_API int quic_queue_stats(contrl_ctx_t *ctrl_ctx, int conn, int stream, spsc_stats *st)
+{
+    quic_conn *qc = get_conn(ctrl_ctx, conn);
+    if (!qc || stream < 0 || stream >= QUIC_MAX_STREAM || !qc->streams[stream].que.data)
+    {
+        return -1;
+    }
+    spsc_get_stats(&qc->streams[stream].que, st);
+    return 0;
+}
+
+static void send_stats(quic_stream *qs, quic_send_stats *st)
+{
+    long long bytes = __atomic_load_n(&qs->qbytes, __ATOMIC_RELAXED);
+    st->queued_bytes = bytes > 0 ? bytes : 0;
+    st->queued_frames = spsc_size(&qs->que);
+    st->delay = 0;
+    if (st->queued_frames)
+    {
+        unsigned int head = __atomic_load_n(&qs->que.head, __ATOMIC_ACQUIRE);
+        st->delay = qs->last_ts - qs->meta[head & qs->que.mask].ts;
+        st->delay = st->delay > 0 ? st->delay : 0;
+    }
+    st->drop_frames = __atomic_load_n(&qs->drop_frames, __ATOMIC_RELAXED);
+    st->drop_bytes = __atomic_load_n(&qs->drop_bytes, __ATOMIC_RELAXED);
+    st->drop_gops = __atomic_load_n(&qs->drop_gops, __ATOMIC_RELAXED);
+}
+
+#define TARGET_HEADROOM 85 /*建议码率占估计带宽的百分比，剩下的留给包头、重传和带宽波动*/
+#define TARGET_DRAIN_MS 1000 /*队列里积压的数据希望在多久内发完，建议码率要让出这部分*/
+
+//建议码率：估计带宽留出余量，再减去在TARGET_DRAIN_MS内发完积压需要的码率，最低是带宽的1/10
+static unsigned long long target_bitrate(unsigned long long bandwidth, unsigned long long queued)
+{
+    unsigned long long bw = bandwidth * 8;
+    unsigned long long target = bw * TARGET_HEADROOM / 100;
+    unsigned long long drain = queued * 8 * 1000 / TARGET_DRAIN_MS;
+    return target > drain + bw / 10 ? target - drain : bw / 10;
+}
+
+static void transport_report(void *arg)
+{
+    client_ctx_t *cctx = arg;
+    contrl_ctx_t *ctrl_ctx = cctx->ctrl_ctx;
+    cctx->tp_timer = 0;
+    if (is_stop(ctrl_ctx))
+    {
+        return;
+    }
+
+    for (int i = 0; i < QUIC_MAX_CONN; i++)
+    {
+        quic_conn *qc = &cctx->conns[i];
+        struct lsquic_conn_info info;
+        if (!qc->conn || qc->status != STATUS_CONNECTED || lsquic_conn_get_info(qc->conn, &info) != 0)
+        {
+            continue;
+        }
+
+        quic_transport_stats st = {0};
+        st.conn = qc->id;
+        st.srtt = info.lci_srtt;
+        st.rttvar = info.lci_rttvar;
+        st.min_rtt = info.lci_min_rtt;
+        st.cwnd = info.lci_cwnd;
+        st.bytes_in_flight = info.lci_bytes_in_flight;
+        st.bandwidth = info.lci_bw_estimate;
+        st.pacing_rate = info.lci_pacing_rate;
+        for (int k = 0; k < qc->stream_count; k++)
+        {
+            quic_send_stats ss;
+            if (!qc->streams[k].que.data)
+            {
+                continue;
+            }
+            send_stats(&qc->streams[k], &ss);
+            st.queued_bytes += ss.queued_bytes;
+            st.drop_frames += ss.drop_frames;
+            st.queue_ms = ss.delay > st.queue_ms ? ss.delay : st.queue_ms;
+        }
+        if (st.bandwidth)
+        {
+            long long ms = st.queued_bytes * 1000 / st.bandwidth;
+            st.queue_ms = ms > st.queue_ms ? ms : st.queue_ms;
+        }
+        st.target_bitrate = target_bitrate(st.bandwidth, st.queued_bytes);
+        ctrl_ctx->fn_transport(ctrl_ctx->cb_param, &st);
+    }
+
+    start_transport_report(cctx);
+}
+
+static void start_transport_report(client_ctx_t *ctx)
+{
+    contrl_ctx_t *ctrl_ctx = ctx->ctrl_ctx;
+    if (!ctrl_ctx->fn_transport)
+    {
+        return;
+    }
+    int ms = ctrl_ctx->transport_ms > 0 ? ctrl_ctx->transport_ms : QUIC_TRANSPORT_INTERVAL;
+    struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+    ctx->tp_timer = set_timer(ctx->eb, transport_report, 0, ctx, &tv);
+}
+
+QUIC_API int quic_get_send_stats(contrl_ctx_t *ctrl_ctx, int conn, int stream, quic_send_stats *st)
+{
+    quic_conn *qc = get_conn(ctrl_ctx, conn);
+    if (!qc || stream < 0 || stream >= QUIC_MAX_STREAM || !qc->streams[stream].que.data)
+    {
+        return -1;
+    }
+    send_stats(&qc->streams[stream], st);
+    return 0;
+}
+
+/////////////////////////////// 服务端 ///////////////////////////////
+//N个引擎各跑在sev_pool的一个线程上，每个引擎一个SO_REUSEPORT的udp socket，内核按四元组把包分到各个socket
+//服务端生成的CID第一个字节是引擎号、第二个字节是这个服务的标记，握手之后的短包头包按目的CID转给所属的引擎，
+//对端地址变了(NAT重绑定、迁移)被内核分到别的socket时连接也还在原来的引擎上
+
+#define SRV_RCVBUF (4 * 1024 * 1024)
+
+struct quic_srv_conn_
+{
+    lsquic_conn_t *conn;
+    struct server_shard_ *shard;
+    void *ctx;       //quic_srv_conn_set_ctx设置的用户数据
+    int next_stream; //对端打开的流按顺序编号
+    struct dgram_rx_ *dg; //收到第一个datagram时创建
+};
+
+typedef struct srv_stream_
+{
+    quic_srv_conn *sc;
+    int id;
+    frame_rx rx;
+} srv_stream;
+
+typedef struct server_shard_
+{
+    client_ctx_t cctx; //收发包、定时器都和客户端共用
+    quic_server_t *srv;
+    int idx;
+    struct lsquic_engine_settings setting;
+    struct lsquic_engine_api api;
+    struct sockaddr_in local;
+    unsigned long long seed; //生成CID的随机数状态
+    quic_server_stats st;    //引擎线程写，其他线程读到的是近似值
+    unsigned long long dg_latency; //ns
+} server_shard;
+
+struct quic_server_
+{
+    quic_server_cfg cfg;
+    contrl_ctx_t ctrl; //只用runing和udp_offload，client_process_conns靠runing判断是否还要加定时器
+    sev_pool *pool;
+    int count;
+    unsigned char tag;
+    server_shard *shards;
+};
+
+//转给其他引擎的包
+typedef struct steer_pkt_
+{
+    server_shard *sh;
+    struct sockaddr_storage peer;
+    int ecn;
+    size_t len;
+    unsigned char data[];
+} steer_pkt;
+
+static unsigned long long shard_rand(server_shard *sh)
+{
+    //xorshift64*
+    sh->seed ^= sh->seed >> 12;
+    sh->seed ^= sh->seed << 25;
+    sh->seed ^= sh->seed >> 27;
+    return sh->seed * 2685821657736338717ULL;
+}
+
+static void server_gen_scid(void *ctx, lsquic_conn_t *conn, lsquic_cid_t *cid, unsigned len)
+{
+    server_shard *sh = ctx;
+    for (unsigned i = 0; i < len; i += 8)
+    {
+        unsigned long long r = shard_rand(sh);
+        memcpy(cid->idbuf + i, &r, len - i < 8 ? len - i : 8);
+    }
+    cid->idbuf[0] = (uint8_t)sh->idx;
+    cid->idbuf[1] = sh->srv->tag;
+    cid->len = len;
+}
+
+static void steer_in(void *arg)
+{
+    steer_pkt *p = arg;
+    server_shard *sh = p->sh;
+    (void)lsquic_engine_packet_in(sh->cctx.engine, p->data, p->len, (struct sockaddr *)&sh->local,
+                                  (struct sockaddr *)&p->peer, (void *)&sh->cctx, p->ecn);
+    free(p);
+    client_process_conns(&sh->cctx);
+}
+
+//短包头的目的CID是本服务生成的、又不属于这个引擎时转过去，返回1表示已经转走
+static int server_steer(server_shard *sh, unsigned char *buf, size_t len, struct sockaddr_storage *peer, int ecn)
+{
+    quic_server_t *srv = sh->srv;
+    sh->st.packets++;
+    //长包头(握手阶段)的目的CID可能是客户端自己生成的，不能按它转
+    if (srv->count < 2 || (buf[0] & 0x80) || len < 1 + sh->setting.es_scid_len || buf[2] != srv->tag)
+    {
+        return 0;
+    }
+    int idx = buf[1];
+    if (idx == sh->idx || idx >= srv->count)
+    {
+        return 0;
+    }
+
+    steer_pkt *p = malloc(sizeof(steer_pkt) + len);
+    p->sh = &srv->shards[idx];
+    p->peer = *peer;
+    p->ecn = ecn;
+    p->len = len;
+    memcpy(p->data, buf, len);
+    if (sev_post(p->sh->cctx.eb, steer_in, p) != 0)
+    {
+        free(p);
+        return 0;
+    }
+    sh->st.steered++;
+    return 1;
+}
+
+//////////////// datagram接收：每个流一个按帧号排序的窗口 ////////////////
+//帧按帧号顺序交付，队头的帧没收齐时后面收齐的帧等着；队头的帧(或者队头之后最早到的帧)过了时限就丢掉队头，跳到下一帧
+
+#define DGRAM_WINDOW 64 /*每个流最多同时在拼的帧数，必须是2的幂*/
+
+typedef struct dg_frame_
+{
+    int used;
+    unsigned int seq;
+    int chunks;
+    int groups; //校验分组数
+    int fec;
+    unsigned int len;
+    int have;   //收到的数据分片
+    unsigned char *buf; //数据分片、校验分片各占DGRAM_CHUNK，最后是收到的标记
+    int cls;
+    unsigned long long deadline;
+} dg_frame;
+
+typedef struct dg_track_
+{
+    int started;
+    unsigned int next; //下一个该交付的帧号
+    int count;
+    unsigned long long first; //窗口里最早的时限，count为0时无效
+    dg_frame win[DGRAM_WINDOW];
+} dg_track;
+
+typedef struct dgram_rx_
+{
+    dg_track tracks[QUIC_MAX_STREAM];
+    sev_timer_id timer;
+    unsigned long long timer_at;
+} dgram_rx;
+
+static unsigned int get_be32(const unsigned char *p)
+{
+    return frame_len(p);
+}
+
+static unsigned char *dg_bits(dg_frame *f)
+{
+    return f->buf + (size_t)(f->chunks + f->groups) * DGRAM_CHUNK;
+}
+
+static int dg_has(dg_frame *f, int idx)
+{
+    return dg_bits(f)[idx >> 3] & (1 << (idx & 7));
+}
+
+static void dg_set(dg_frame *f, int idx)
+{
+    dg_bits(f)[idx >> 3] |= 1 << (idx & 7);
+}
+
+//时限是到达时间加固定延迟，按到达顺序递增，新帧不会比first早，只有释放掉最早的帧时才要重新扫一遍窗口
+static void dg_first_update(dg_track *t)
+{
+    t->first = ~0ULL;
+    for (int i = 0; t->count > 0 && i < DGRAM_WINDOW; i++)
+    {
+        if (t->win[i].used && t->win[i].deadline < t->first)
+        {
+            t->first = t->win[i].deadline;
+        }
+    }
+}
+
+static void dg_frame_free(server_shard *sh, dg_track *t, dg_frame *f)
+{
+    frame_buf_put(&sh->cctx.fpool, f->buf, f->cls);
+    f->buf = NULL;
+    f->used = 0;
+    t->count--;
+    if (f->deadline == t->first)
+    {
+        dg_first_update(t);
+    }
+}
+
+//组里只丢了一个数据分片并且校验分片到了，用异或补回来
+static void dg_recover(server_shard *sh, dg_frame *f, int group)
+{
+    int first = group * f->fec;
+    int end = first + f->fec < f->chunks ? first + f->fec : f->chunks;
+    int miss = -1;
+    if (!dg_has(f, f->chunks + group))
+    {
+        return;
+    }
+    for (int i = first; i < end; i++)
+    {
+        if (!dg_has(f, i))
+        {
+            if (miss >= 0)
+            {
+                return;
+            }
+            miss = i;
+        }
+    }
+    if (miss < 0)
+    {
+        return;
+    }
+
+    unsigned char *dst = f->buf + (size_t)miss * DGRAM_CHUNK;
+    memcpy(dst, f->buf + (size_t)(f->chunks + group) * DGRAM_CHUNK, DGRAM_CHUNK);
+    for (int i = first; i < end; i++)
+    {
+        unsigned char *src = f->buf + (size_t)i * DGRAM_CHUNK;
+        for (int k = 0; i != miss && k < DGRAM_CHUNK; k++)
+        {
+            dst[k] ^= src[k];
+        }
+    }
+    dg_set(f, miss);
+    f->have++;
+    sh->st.dg_recovered++;
+}
+
+static void dg_deliver(server_shard *sh, quic_srv_conn *sc, int stream, dg_frame *f)
+{
+    quic_server_cfg *cfg = &sh->srv->cfg;
+    on_srv_data fn = cfg->fn_dgram ? cfg->fn_dgram : cfg->fn_frame ? cfg->fn_frame : cfg->fn_data;
+    sh->st.dg_frames++;
+    if (fn)
+    {
+        fn(cfg->cb_param, sc, stream, f->buf, (int)f->len);
+    }
+}
+
+//交付或者丢掉队头，force为1时不管时限(窗口不够用了)
+static int dg_pop_head(server_shard *sh, quic_srv_conn *sc, int stream, dg_track *t, unsigned long long now, int force)
+{
+    dg_frame *f = &t->win[t->next & (DGRAM_WINDOW - 1)];
+    int here = f->used && f->seq == t->next;
+    if (here && f->have == f->chunks)
+    {
+        dg_deliver(sh, sc, stream, f);
+        dg_frame_free(sh, t, f);
+        t->next++;
+        return 1;
+    }
+
+    if (!force)
+    {
+        //用窗口里最早的时限(队头在也一样)，队头之前发的帧不会比它晚到；和dg_schedule定的定时器一致，
+        //否则后面的帧先到时定时器到期了却丢不掉队头，会一直空转到队头自己的时限
+        if (now < t->first)
+        {
+            return 0;
+        }
+    }
+
+    if (here)
+    {
+        dg_frame_free(sh, t, f);
+    }
+    sh->st.dg_lost++;
+    t->next++;
+    return 1;
+}
+
+static void dg_timer_cb(void *arg);
+
+//按所有窗口里最早的时限定一个定时器，每个窗口的最早时限是增量维护的，不用扫窗口
+static void dg_schedule(server_shard *sh, quic_srv_conn *sc, unsigned long long now)
+{
+    dgram_rx *rx = sc->dg;
+    unsigned long long at = ~0ULL;
+    for (int s = 0; s < QUIC_MAX_STREAM; s++)
+    {
+        dg_track *t = &rx->tracks[s];
+        if (t->count > 0 && t->first < at)
+        {
+            at = t->first;
+        }
+    }
+
+    if (rx->timer && rx->timer_at == at)
+    {
+        return;
+    }
+    if (rx->timer)
+    {
+        cancel_timer(sh->cctx.eb, rx->timer);
+        rx->timer = 0;
+    }
+    if (at != ~0ULL)
+    {
+        unsigned long long us = at > now ? (at - now + 999) / 1000 : 0;
+        struct timeval tv = {(long)(us / 1000000), (long)(us % 1000000)};
+        rx->timer = set_timer(sh->cctx.eb, dg_timer_cb, 0, sc, &tv);
+        rx->timer_at = at;
+    }
 }
-void client_process_conns(client_ctx_t *cctx);
 
-#define CTL_SZ 64
-static void client_read_net_data(int fd, int what, void *arg)
+static void dg_flush(server_shard *sh, quic_srv_conn *sc, unsigned long long now)
 {
-    client_ctx_t *cctx = arg;
-
-    ssize_t nread;
-    struct sockaddr_storage peer_sas;
-    unsigned char buf[4096];
-    unsigned char ctl_buf[CTL_SZ];
-    struct iovec vec[1] = {{buf, sizeof(buf)}};
-
-    struct msghdr msg = {
-        .msg_name = &peer_sas,
-        .msg_namelen = sizeof(peer_sas),
-        .msg_iov = vec,
-        .msg_iovlen = 1,
-        .msg_control = ctl_buf,
-        .msg_controllen = sizeof(ctl_buf),
-    };
-    nread = recvmsg(fd, &msg, 0);
-    if (-1 == nread)
+    for (int s = 0; s < QUIC_MAX_STREAM; s++)
     {
-        return;
+        dg_track *t = &sc->dg->tracks[s];
+        while (t->count > 0 && dg_pop_head(sh, sc, s, t, now, 0))
+            ;
     }
-
-    int ecn = get_ecn(&msg);
-    ecn = ecn < 0 ? 0 : ecn;
-
-    (void)lsquic_engine_packet_in(cctx->engine, buf, nread,
-                                  (struct sockaddr *)cctx->local_addr,
-                                  (struct sockaddr *)&peer_sas,
-                                  (void *)cctx, ecn);
-
-    client_process_conns(cctx);
+    dg_schedule(sh, sc, now);
 }
 
-int is_stop(contrl_ctx_t *ctrl_ctx)
+static void dg_timer_cb(void *arg)
 {
-    return !ctrl_ctx->runing;
+    quic_srv_conn *sc = arg;
+    server_shard *sh = sc->shard;
+    sc->dg->timer = 0;
+    dg_flush(sh, sc, sev_now(sh->cctx.eb));
 }
 
-void client_process_conns(client_ctx_t *cctx)
+static void dgram_rx_free(server_shard *sh, quic_srv_conn *sc)
 {
-    lsquic_engine_t *engine = cctx->engine;
-    cus_evt *timer = cctx->timer;
-
-    int diff;
-    struct timeval timeout;
-
-    lsquic_engine_process_conns(engine);
-
-    if (lsquic_engine_earliest_adv_tick(engine, &diff))
+    dgram_rx *rx = sc->dg;
+    if (!rx)
     {
-        if (diff < 0 || (unsigned)diff < cctx->eng_cfg->es_clock_granularity)
-        {
-            timeout.tv_sec = 0;
-            timeout.tv_usec = cctx->eng_cfg->es_clock_granularity;
-        }
-        else
+        return;
+    }
+    if (rx->timer)
+    {
+        cancel_timer(sh->cctx.eb, rx->timer);
+    }
+    for (int s = 0; s < QUIC_MAX_STREAM; s++)
+    {
+        for (int i = 0; i < DGRAM_WINDOW; i++)
         {
-            timeout.tv_sec = (unsigned)diff / 1000000;
-            timeout.tv_usec = (unsigned)diff % 1000000;
+            if (rx->tracks[s].win[i].used)
+            {
+                dg_frame_free(sh, &rx->tracks[s], &rx->tracks[s].win[i]);
+            }
         }
-        if (!is_stop(cctx->ctrl_ctx))
-            add_cus_event(cctx->eb, timer, &timeout);
     }
+    free(rx);
+    sc->dg = NULL;
 }
 
-static void timer_handler(int fd, int event, int is_overtime, void *arg)
+//lsquic_engine_packet_in里调用
+static void server_on_datagram(lsquic_conn_t *conn, const void *data, size_t len)
 {
-    client_ctx_t *cctx = arg;
-    if (!is_stop(cctx->ctrl_ctx))
-        client_process_conns(cctx);
-}
+    quic_srv_conn *sc = (quic_srv_conn *)lsquic_conn_get_ctx(conn);
+    const unsigned char *p = data;
+    if (!sc || len < DGRAM_HDR || p[9] >= QUIC_MAX_STREAM)
+    {
+        return;
+    }
+    server_shard *sh = sc->shard;
+    unsigned int seq = get_be32(p);
+    int idx = get_be16(p + 4);
+    int chunks = get_be16(p + 6);
+    int fec = p[10];
+    unsigned int flen = get_be32(p + 12);
+    int stream = p[9];
+    size_t n = len - DGRAM_HDR;
+    int expect = flen ? (int)((flen + DGRAM_CHUNK - 1) / DGRAM_CHUNK) : 1;
+    int groups = fec ? (chunks + fec - 1) / fec : 0;
+    if (chunks != expect || flen > sh->srv->cfg.max_frame || idx >= chunks + groups || n > DGRAM_CHUNK)
+    {
+        return;
+    }
 
-static void contrl_func(int fd, int event, int is_overtime, void *arg)
-{
-    client_ctx_t *ctx = arg;
-    contrl_ctx_t *ctrl_ctx = ctx->ctrl_ctx;
+    if (!sc->dg)
+    {
+        sc->dg = calloc(1, sizeof(dgram_rx));
+    }
+    dg_track *t = &sc->dg->tracks[stream];
+    unsigned long long now = sev_now(sh->cctx.eb);
+    if (!t->started)
+    {
+        t->started = 1;
+        t->next = seq;
+    }
 
-    pthread_mutex_lock(&ctrl_ctx->mutex);
-    switch (ctrl_ctx->cmd)
+    int d = (int)(seq - t->next);
+    if (d < 0)
+    {
+        return;//已经交付或者跳过的帧
+    }
+    //窗口放不下就把队头挤出去，跳得太远(发送端重来了)直接跳过去
+    while (d >= DGRAM_WINDOW && t->count > 0)
+    {
+        dg_pop_head(sh, sc, stream, t, now, 1);
+        d--;
+    }
+    if (d >= DGRAM_WINDOW)
     {
-    case START:
-        ctrl_ctx->status = STATUS_RUNING;
-        ctrl_ctx->runing = 1;
-        break;
+        sh->st.dg_lost += d - DGRAM_WINDOW + 1;
+        t->next = seq - DGRAM_WINDOW + 1;
+    }
 
-    case CONNECT:
-        if (ctrl_ctx->status != STATUS_CONNECTED)
+    dg_frame *f = &t->win[seq & (DGRAM_WINDOW - 1)];
+    if (!f->used)
+    {
+        size_t area = (size_t)(chunks + groups) * DGRAM_CHUNK;
+        f->buf = frame_buf_get(&sh->cctx.fpool, area + (chunks + groups + 7) / 8, &f->cls);
+        memset(f->buf + area, 0, (chunks + groups + 7) / 8);
+        //最后一个数据分片不满，补0后异或才对得上
+        size_t tail = flen - (size_t)(chunks - 1) * DGRAM_CHUNK;
+        memset(f->buf + (size_t)(chunks - 1) * DGRAM_CHUNK + tail, 0, DGRAM_CHUNK - tail);
+        f->used = 1;
+        f->seq = seq;
+        f->chunks = chunks;
+        f->groups = groups;
+        f->fec = fec;
+        f->len = flen;
+        f->have = 0;
+        f->deadline = now + sh->dg_latency;
+        if (t->count == 0 || f->deadline < t->first)
         {
-            ctrl_ctx->conn = lsquic_engine_connect(ctx->engine, N_LSQVER, (struct sockaddr *)ctx->local_addr, (struct sockaddr *)&ctrl_ctx->peer,
-                                                   0, 0, 0, 0, 0, 0, 0, 0);
-            client_process_conns(ctx);
-            QUIC_LOG("connect to quic_sever\n");
+            t->first = f->deadline;
         }
-        break;
+        t->count++;
+    }
+    else if (f->chunks != chunks || f->len != flen || f->fec != fec)
+    {
+        return;
+    }
 
-    case CLOSE:
-        if (ctrl_ctx->conn)
+    if (f->have < f->chunks && !dg_has(f, idx))
+    {
+        unsigned char *dst = f->buf + (size_t)idx * DGRAM_CHUNK;
+        memcpy(dst, p + DGRAM_HDR, n);
+        dg_set(f, idx);
+        if (idx < chunks)
         {
-            lsquic_conn_close(ctrl_ctx->conn);
-            ctrl_ctx->conn = 0;
-            QUIC_LOG("connect close\n");
+            f->have++;
         }
         else
         {
-            ctrl_ctx->status = STATUS_CLOSE;
+            memset(dst + n, 0, DGRAM_CHUNK - n);
+        }
+        if (fec && f->have < f->chunks)
+        {
+            dg_recover(sh, f, idx < chunks ? idx / fec : idx - chunks);
         }
-
-        break;
-
-    case STOP:
-        /* sev_stop(ctx->eb); */
-        break;
-
-    default:
-        break;
     }
 
-    ctrl_ctx->cmd = NONE;
-    pthread_mutex_unlock(&ctrl_ctx->mutex);
+    dg_flush(sh, sc, now);
 }
 
-static void make_addr(struct sockaddr_in *addr, char *ip, int port)
+static lsquic_conn_ctx_t *server_on_new_conn(void *stream_if_ctx, lsquic_conn_t *conn)
 {
-    addr->sin_family = AF_INET;
-    addr->sin_port = htons(port);
-    addr->sin_addr.s_addr = ip == 0 ? INADDR_ANY : inet_addr(ip);
+    server_shard *sh = stream_if_ctx;
+    quic_server_t *srv = sh->srv;
+
+    quic_srv_conn *sc = calloc(1, sizeof(quic_srv_conn));
+    sc->conn = conn;
+    sc->shard = sh;
+    sh->st.conns++;
+    sh->st.active++;
+    if (srv->cfg.fn_conn)
+    {
+        srv->cfg.fn_conn(srv->cfg.cb_param, sc, QUIC_SRV_CONN_NEW);
+    }
+    return (lsquic_conn_ctx_t *)sc;
 }
 
-int make_udp_sock(struct sockaddr_in *local_addr)
+static void server_on_conn_closed(lsquic_conn_t *conn)
 {
-    int res = 0;
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-
-    int flags = fcntl(sockfd, F_GETFL, 0);
-    flags |= O_NONBLOCK;
-    res = fcntl(sockfd, F_SETFL, flags);
-    if (res < 0)
+    quic_srv_conn *sc = (quic_srv_conn *)lsquic_conn_get_ctx(conn);
+    if (!sc)
     {
-        close(sockfd);
-        return -1;
+        return;
     }
-
-    res = bind(sockfd, (const struct sockaddr *)local_addr, sizeof(struct sockaddr_in));
-    if (res < 0)
+    quic_server_t *srv = sc->shard->srv;
+    if (srv->cfg.fn_conn)
     {
-        close(sockfd);
-        return -1;
+        srv->cfg.fn_conn(srv->cfg.cb_param, sc, QUIC_SRV_CONN_CLOSED);
     }
-    return sockfd;
+    sc->shard->st.active--;
+    dgram_rx_free(sc->shard, sc);
+    lsquic_conn_set_ctx(conn, NULL);
+    free(sc);
 }
 
-int make_client_ctx(contrl_ctx_t *ctrl_ctx, client_ctx_t *ctx, int sock, struct sockaddr_in *local_addr, struct lsquic_engine_settings *setting, struct lsquic_engine_api *engine_api)
+static lsquic_stream_ctx_t *server_on_new_stream(void *stream_if_ctx, lsquic_stream_t *stream)
 {
-    ctx->fd = sock;
-
-    ctx->eb = sev_new_base();
-
-    ctx->ev_net = new_io_event(sock, SEV_IO_READABLE, 1, client_read_net_data, (void *)ctx);
-    add_io_event(ctx->eb, ctx->ev_net);
-
-    ctx->contrl = new_cus_event(1, 0, 1, contrl_func, ctx);
-    add_cus_event(ctx->eb, ctx->contrl, 0);
-
-    ctx->timer = new_cus_event(2, 0, 0, timer_handler, ctx);
-
-    lsquic_engine_init_settings(setting, 0);
-
-    ctx->engine = lsquic_engine_new(0, engine_api);
-    ctx->eng_cfg = setting;
+    quic_srv_conn *sc = (quic_srv_conn *)lsquic_conn_get_ctx(lsquic_stream_conn(stream));
+    if (!sc)
+    {
+        lsquic_stream_close(stream);
+        return NULL;
+    }
 
-    ctx->local_addr = local_addr;
+    srv_stream *ss = calloc(1, sizeof(srv_stream));
+    ss->sc = sc;
+    ss->id = sc->next_stream++;
+    lsquic_stream_wantread(stream, 1);
+    return (lsquic_stream_ctx_t *)ss;
+}
 
-    ctx->stream_count = MAX_STREAM_COUNT;
-    for (int i = 0; i < ctx->stream_count; i++)
+static void server_deliver(recv_ctx *rc, const unsigned char *data, size_t len)
+{
+    srv_stream *ss = rc->arg;
+    quic_server_cfg *cfg = &ss->sc->shard->srv->cfg;
+    on_srv_data fn = cfg->fn_frame ? cfg->fn_frame : cfg->fn_data;
+    if (fn)
     {
-        ctx->queue[i] = &data_queue[i];
+        fn(cfg->cb_param, ss->sc, ss->id, (void *)data, (int)len);
     }
+}
 
-    ctx->ctrl_ctx = ctrl_ctx;
+//lsquic的数据块直接回调，对端发完(FIN)时回调一次data为空、len为0
+static void server_on_read(lsquic_stream_t *stream, lsquic_stream_ctx_t *st_h)
+{
+    srv_stream *ss = (srv_stream *)st_h;
+    server_shard *sh = ss->sc->shard;
+    quic_server_cfg *cfg = &sh->srv->cfg;
+
+    recv_ctx rc = {
+        .fp = &sh->cctx.fpool,
+        .rx = cfg->fn_frame ? &ss->rx : NULL,
+        .max = cfg->max_frame,
+        .deliver = server_deliver,
+        .arg = ss,
+    };
+    int ret = stream_recv(stream, &rc);
+    sh->st.bytes += rc.bytes;
+    if (ret == 0)
+    {
+        server_deliver(&rc, NULL, 0);
+    }
+    if (ret <= 0)
+    {
+        lsquic_stream_close(stream);
+    }
 }
 
-void loop(client_ctx_t *ctx)
+static void server_on_write(lsquic_stream_t *stream, lsquic_stream_ctx_t *st_h)
 {
-    sev_loop(ctx->eb);
+    lsquic_stream_wantwrite(stream, 0);//服务端只收
 }
 
-void clean_client_ctx(client_ctx_t *ctx)
+static void server_on_close(lsquic_stream_t *stream, lsquic_stream_ctx_t *st_h)
 {
-    lsquic_engine_destroy(ctx->engine);
-    free_cus_event(ctx->timer);
-    free_io_event(ctx->ev_net);
-    sev_free_base(ctx->eb);
-    close(ctx->fd);
+    srv_stream *ss = (srv_stream *)st_h;
+    if (ss)
+    {
+        frame_rx_reset(&ss->sc->shard->cctx.fpool, &ss->rx);
+        free(ss);
+    }
 }
 
-static void *quic_thread(void *args)
+const struct lsquic_stream_if server_stream_if = {
+    .on_new_conn = server_on_new_conn,
+    .on_conn_closed = server_on_conn_closed,
+    .on_new_stream = server_on_new_stream,
+    .on_read = server_on_read,
+    .on_write = server_on_write,
+    .on_close = server_on_close,
+    .on_datagram = server_on_datagram,
+};
+
+static int make_reuseport_sock(struct sockaddr_in *local_addr)
 {
-    contrl_ctx_t *ctrl_ctx = (contrl_ctx_t *)args;
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+    {
+        return -1;
+    }
 
-    int fd = 0;
-    client_ctx_t ctx = {0};
-    struct sockaddr_in local;
-    struct lsquic_engine_settings setting;
+    int on = 1;
+    int rcvbuf = SRV_RCVBUF;
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));//很多连接同时发时默认的接收缓冲区很快就满了
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+        bind(sockfd, (const struct sockaddr *)local_addr, sizeof(struct sockaddr_in)) < 0)
+    {
+        QUIC_LOG("bind %d failed: %s", ntohs(local_addr->sin_port), strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
 
-    struct sockaddr_in *local_addr = &local;
-    make_addr(local_addr, 0, 0);
-    fd = make_udp_sock(local_addr);
+static int make_server_shard(quic_server_t *srv, int idx)
+{
+    server_shard *sh = &srv->shards[idx];
+    sh->srv = srv;
+    sh->idx = idx;
+    sh->dg_latency = (unsigned long long)(srv->cfg.dgram_latency > 0 ? srv->cfg.dgram_latency : QUIC_DGRAM_LATENCY) * 1000000ULL;
+    sh->seed = ((unsigned long long)time(NULL) << 20) ^ ((unsigned long long)getpid() << 8) ^ (idx + 1) ^ (unsigned long long)(uintptr_t)sh;
+
+    make_addr(&sh->local, srv->cfg.ip, srv->cfg.port);
+    int fd = make_reuseport_sock(&sh->local);
+    if (fd < 0)
+    {
+        return -1;
+    }
 
-    struct lsquic_engine_api engine_api = {
-        .ea_settings = &setting,
-        .ea_packets_out = send_packets_out,
-        .ea_packets_out_ctx = (void *)(uintptr_t)fd,
-        .ea_stream_if = &client_echo_stream_if,
-        .ea_stream_if_ctx = &ctx,
-    };
+    sh->api.ea_settings = &sh->setting;
+    sh->api.ea_packets_out = send_packets_out;
+    sh->api.ea_packets_out_ctx = &sh->cctx;
+    sh->api.ea_stream_if = &server_stream_if;
+    sh->api.ea_stream_if_ctx = sh;
+    sh->api.ea_generate_scid = server_gen_scid;
+    sh->api.ea_gen_scid_ctx = sh;
 
-    for (int i = 0; i < MAX_STREAM_COUNT; i++)
+    sh->cctx.shard = sh;
+    if (make_engine_ctx(&srv->ctrl, &sh->cctx, sev_pool_base(srv->pool, idx), fd, LSENG_SERVER, &sh->local, &sh->setting, &sh->api) != 0)
     {
-        initQueue(&data_queue[i]);
+        QUIC_LOG("create server engine %d failed", idx);
+        return -1;
     }
+    return 0;
+}
 
-    make_client_ctx(ctrl_ctx, &ctx, fd, &local, &setting, &engine_api);
-    QUIC_LOG("start loop");
-    loop(&ctx);
-    ctrl_ctx->runing = 0;
-    clean_client_ctx(&ctx);
+//在引擎线程里开始等待定时器
+static void server_shard_start(void *arg)
+{
+    client_process_conns(&((server_shard *)arg)->cctx);
 }
 
-static int wait_status(contrl_ctx_t *ctrl_ctx, int status, int overtime/*ms*/)
+static void free_server(quic_server_t *srv)
 {
-    struct timeval tv, tv_cur;
-    gettimeofday(&tv, NULL);
-    tv.tv_sec += overtime / 1000;
-    tv.tv_usec += (overtime % 1000) * 1000;
-    while (ctrl_ctx->status != status)
+    srv->ctrl.runing = 0;
+    sev_pool_stop(srv->pool);
+    for (int i = 0; i < srv->count; i++)
     {
-        gettimeofday(&tv_cur, NULL);
-        if (tm_compare(&tv, &tv_cur))
+        //引擎销毁时还在的连接会回调fn_conn(CLOSED)，这时是在调用quic_server_stop的线程里
+        if (srv->shards[i].cctx.engine)
         {
-            QUIC_LOG("wait status %d overtime",status);
-            return 0;
+            clean_engine_ctx(&srv->shards[i].cctx);
         }
     }
-    return 1;
-}
-
-QUIC_API void quic_setting(contrl_ctx_t *ctrl_ctx, on_data fn_data, data_parse fn_parse, data_free fn_free, data_remake fn_remake, void* param)
-{
-    QUIC_TRACE;
-    ctrl_ctx->fn_data = fn_data;
-    ctrl_ctx->fn_parse = fn_parse;
-    ctrl_ctx->fn_free = fn_free;
-    ctrl_ctx->fn_remake = fn_remake;
-    ctrl_ctx->cb_param = param;
+    sev_free_pool(srv->pool);
+    free(srv->shards);
+    free(srv);
 }
 
-// QUIC_API void quic_setting(contrl_ctx_t *ctrl_ctx, on_data fn_data, on_send fn_send, on_close fn_close, on_connect fn_connect, void* param)
-// {
-//     QUIC_TRACE;
-//     ctrl_ctx->fn_data = fn_data;
-//     ctrl_ctx->fn_send = fn_send;
-//     ctrl_ctx->fn_close = fn_close;
-//     ctrl_ctx->fn_connect = fn_connect;
-//     ctrl_ctx->cb_param = param;
-// }
-
-QUIC_API int quic_run(contrl_ctx_t *ctrl_ctx)
+//启动服务端，每个引擎一个线程，失败返回NULL
+QUIC_API quic_server_t *quic_server_run(quic_server_cfg *cfg)
 {
     QUIC_TRACE;
-    if (ctrl_ctx->runing)
+    int engines = cfg->engines > 0 ? cfg->engines : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    engines = engines < 1 ? 1 : engines;
+    engines = engines > QUIC_SERVER_MAX_ENGINE ? QUIC_SERVER_MAX_ENGINE : engines;
+
+    quic_server_t *srv = calloc(1, sizeof(quic_server_t));
+    srv->cfg = *cfg;
+    srv->cfg.max_frame = cfg->max_frame ? cfg->max_frame : QUIC_FRAME_MAX;
+    srv->ctrl.runing = 1;
+    srv->ctrl.udp_offload = cfg->udp_offload;
+    srv->ctrl.datagram = 1;//客户端有datagram流时才会用
+    srv->pool = sev_new_pool(engines, cfg->pin);
+    srv->count = engines;
+    srv->shards = calloc(engines, sizeof(server_shard));
+
+    for (int i = 0; i < engines; i++)
     {
-        return 1;
+        if (make_server_shard(srv, i) != 0)
+        {
+            free_server(srv);
+            return NULL;
+        }
     }
+    srv->tag = (unsigned char)(shard_rand(&srv->shards[0]) >> 56);
 
-    pthread_t thread1;
-    ctrl_ctx->cmd = START;
-    if (pthread_create(&thread1, NULL, quic_thread, (void *)ctrl_ctx))
+    for (int i = 0; i < engines; i++)
     {
-        return 0;
+        sev_post(srv->shards[i].cctx.eb, server_shard_start, &srv->shards[i]);
     }
-
-    if (!wait_status(ctrl_ctx, STATUS_RUNING, 2000))
+    if (sev_pool_start(srv->pool) != 0)
     {
-        return 0;
+        free_server(srv);
+        return NULL;
     }
+    QUIC_LOG("server listen %s:%d engines %d", cfg->ip ? cfg->ip : "*", cfg->port, engines);
+    return srv;
+}
 
+//停止所有引擎并释放，不能在回调里调用
+QUIC_API void quic_server_stop(quic_server_t *srv)
+{
     QUIC_TRACE;
-    return 1;
+    free_server(srv);
 }
 
-QUIC_API int quic_connect(contrl_ctx_t *ctrl_ctx, char *ip, int port)
+QUIC_API int quic_server_engines(quic_server_t *srv)
 {
-    QUIC_TRACE;
-    if (STATUS_CONNECTED == quic_status(ctrl_ctx))
+    return srv->count;
+}
+
+//engine为-1时取所有引擎的总和
+QUIC_API int quic_server_get_stats(quic_server_t *srv, int engine, quic_server_stats *st)
+{
+    if (engine >= srv->count)
     {
-        return 1;
+        return -1;
     }
-
-    pthread_mutex_lock(&ctrl_ctx->mutex);
-    make_addr((struct sockaddr_in *)&ctrl_ctx->peer, ip, port);
-    ctrl_ctx->cmd = CONNECT;
-    pthread_mutex_unlock(&ctrl_ctx->mutex);
-    if (!wait_status(ctrl_ctx, STATUS_CONNECTED, 1000))
+    memset(st, 0, sizeof(*st));
+    for (int i = 0; i < srv->count; i++)
     {
-        return 0;
+        if (engine >= 0 && i != engine)
+        {
+            continue;
+        }
+        quic_server_stats *s = &srv->shards[i].st;
+        st->conns += s->conns;
+        st->active += s->active;
+        st->bytes += s->bytes;
+        st->packets += s->packets;
+        st->steered += s->steered;
+        st->dg_frames += s->dg_frames;
+        st->dg_lost += s->dg_lost;
+        st->dg_recovered += s->dg_recovered;
     }
-
-    QUIC_TRACE;
-    return 1;
+    return 0;
 }
 
-QUIC_API int quic_close(contrl_ctx_t *ctrl_ctx)
+QUIC_API int quic_srv_conn_engine(quic_srv_conn *conn)
 {
-    QUIC_TRACE;
-
-    pthread_mutex_lock(&ctrl_ctx->mutex);
-    ctrl_ctx->cmd = CLOSE;
-    pthread_mutex_unlock(&ctrl_ctx->mutex);
-
-    if (!wait_status(ctrl_ctx, STATUS_CLOSE, 1000))
-    {
-        return 0;
-    }
+    return conn->shard->idx;
+}
 
-    QUIC_TRACE;
-    return 1;
+QUIC_API void quic_srv_conn_set_ctx(quic_srv_conn *conn, void *ctx)
+{
+    conn->ctx = ctx;
 }
 
-QUIC_API int quic_status(contrl_ctx_t *ctrl_ctx)
+QUIC_API void *quic_srv_conn_get_ctx(quic_srv_conn *conn)
 {
-    return ctrl_ctx->status;
+    return conn->ctx;
 }
 
-QUIC_API int quic_push_data(int index, void *data)
+//只能在回调里(连接所在的引擎线程)调用
+QUIC_API void quic_srv_conn_close(quic_srv_conn *conn)
 {
-    queue *que = &data_queue[index];
-    
-    int ret = enqueue(que, (void *)data);
-    if (!ret)
-    {
-        // QUIC_LOG("push data failed");
-    }
-    return ret;
+    lsquic_conn_close(conn->conn);
 }
 
 // QUIC_API void quic_set_delay(contrl_ctx_t *ctrl_ctx, struct timeval *delay)
@@ -859,23 +2956,6 @@ void free_frm(void *item)
     free(frm);
 }
 
-static void QuicRemakeFrame(void* item, int len)
-{
-    if (!item)
-    {
-        return;
-    }
-    frame *frm = (frame *)item;
-
-    void *remain = malloc(len);
-    memcpy(remain, frm->data + (frm->len - len), len);
-    if (frm->data)
-        free(frm->data);
-
-    frm->data = remain;
-    frm->len = len;    
-}
-
 typedef struct test_ctx_
 {
     sev_base *eb;
@@ -917,7 +2997,7 @@ static void data_cb(int fd, int event, int is_overtime, void *arg)
 {
     test_ctx *tctx = (test_ctx *)arg;
 
-    for (int i = 0; i < MAX_STREAM_COUNT; i++)
+    for (int i = 0; i < 2; i++)
     {
         for (int k = 0; k < 3; k++)
         {
@@ -925,7 +3005,7 @@ static void data_cb(int fd, int event, int is_overtime, void *arg)
             frm->data = calloc(1, 1024);
             frm->len = 1024;
 
-            if (!quic_push_data(i, (void *)frm))
+            if (!quic_push_data(tctx->ctrl_ctx, 0, i, (void *)frm))
             {
                 free_frm((void *)frm);
             }
@@ -955,13 +3035,17 @@ int main(int argc, char *argv[])
     contrl_ctx_t ctrl_ctx = {0};
     contrl_ctx_t *pctrl = &ctrl_ctx;
 
+    //0号流放音频优先发，1号流放视频
+    quic_stream_cfg cfg[2] = {{.priority = 1, .weight = 1}, {.priority = 8, .weight = 4}};
+    quic_set_streams(pctrl, 2, cfg);
+    quic_setting(pctrl, on_recv, parse_frm, free_frm, 0, 0);
     quic_run(pctrl);
-    quic_setting(pctrl, on_recv, parse_frm, free_frm, QuicRemakeFrame, 0);
 
     sev_base *base = sev_new_base();
 
     test_ctx test = {.ctrl_ctx = pctrl, .eb = base,.peer_ip = serverip,.peer_port = serverport };
     io_evt *ev_std = new_io_event(STDIN_FILENO, SEV_IO_READABLE, 1, stdin_cb, (void *)&test);
+    sev_io_set_priority(ev_std, SEV_PRI_CONTROL);//控制命令不能被大量数据发送拖住
     add_io_event(base, ev_std);
 
     cus_evt *ev_data = new_cus_event(1, 0, 0, data_cb, (void *)&test);
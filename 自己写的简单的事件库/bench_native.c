@@ -0,0 +1,474 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "simple_event.h"
+#include "simple_event_macro.h"
+
+//压测：客户端开N个tcp连接，按帧率和GOP发关键帧/普通帧，帧头里带发送时间
+//服务端按连接统计吞吐、单向延迟分位数和丢帧数
+//单向延迟用CLOCK_REALTIME，跨机器测试时两边要先对时
+
+#define BENCH_MAGIC 0x424e4348
+#define STAT_INTERVAL 2 /*s*/
+#define MAX_FRAME (4 * 1024 * 1024)
+
+typedef struct frame_hdr_
+{
+    unsigned int magic;
+    unsigned int len;     //整帧长度，包括帧头
+    unsigned int conn_id;
+    unsigned int seq;     //每帧加1，被客户端丢掉的帧也占一个序号
+    unsigned long long send_ns;
+    unsigned int key;     //是否是关键帧
+    unsigned int pad;
+} frame_hdr;
+
+static unsigned long long realtime_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void make_addr(struct sockaddr_in *addr, char *ip, int port)
+{
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    addr->sin_addr.s_addr = ip == 0 ? INADDR_ANY : inet_addr(ip);
+}
+
+/* ****************  server  ***************** */
+
+typedef struct bench_conn_ bench_conn;
+
+//每个reactor一份，只在自己的线程里改
+typedef struct reactor_ctx_
+{
+    int index;
+    sev_base *base;
+    int listen_fd;
+    bench_conn *conns;
+} reactor_ctx;
+
+struct bench_conn_
+{
+    reactor_ctx *rctx;
+    sev_conn *conn;
+    bench_conn *prev;
+    bench_conn *next;
+
+    frame_hdr hdr;       //正在收的帧
+    unsigned int skip;   //当前帧还没收到的负载字节数
+    int has_hdr;
+    unsigned int next_seq;
+
+    //本统计周期
+    long long bytes;
+    long long frames;
+    long long drops;
+    sev_hist lat; //单向延迟(ns)，整帧收完时记
+
+    //整个连接
+    unsigned long long start_ns;
+    long long total_bytes;
+    long long total_frames;
+    long long total_drops;
+    sev_hist total_lat;
+};
+
+static void print_conn(bench_conn *bc, const char *tag, long long bytes, long long frames, long long drops, sev_hist *lat, double secs)
+{
+    LOG("%s conn %u: %.2f Mbit/s frames %lld drops %lld lat(us) p50 %llu p99 %llu p999 %llu max %llu", tag, bc->hdr.conn_id,
+        bytes * 8 / secs / 1e6, frames, drops, sev_hist_percentile(lat, 50) / 1000, sev_hist_percentile(lat, 99) / 1000,
+        sev_hist_percentile(lat, 99.9) / 1000, lat->max / 1000);
+}
+
+static void on_stat_timer(void *arg)
+{
+    reactor_ctx *rctx = (reactor_ctx *)arg;
+    long long bytes = 0, frames = 0, drops = 0;
+    sev_hist all = {0};
+    for (bench_conn *bc = rctx->conns; bc; bc = bc->next)
+    {
+        print_conn(bc, "   ", bc->bytes, bc->frames, bc->drops, &bc->lat, STAT_INTERVAL);
+        bytes += bc->bytes;
+        frames += bc->frames;
+        drops += bc->drops;
+        all.count += bc->lat.count;
+        all.sum += bc->lat.sum;
+        all.max = bc->lat.max > all.max ? bc->lat.max : all.max;
+        for (int i = 0; i < SEV_HIST_BUCKETS; i++)
+        {
+            all.buckets[i] += bc->lat.buckets[i];
+        }
+        bc->bytes = bc->frames = bc->drops = 0;
+        memset(&bc->lat, 0, sizeof(sev_hist));
+    }
+    if (rctx->conns)
+    {
+        LOG("reactor %d: %.2f Mbit/s frames %lld drops %lld lat(us) p50 %llu p99 %llu p999 %llu", rctx->index,
+            bytes * 8 / (double)STAT_INTERVAL / 1e6, frames, drops, sev_hist_percentile(&all, 50) / 1000,
+            sev_hist_percentile(&all, 99) / 1000, sev_hist_percentile(&all, 99.9) / 1000);
+    }
+
+    struct timeval tv = {.tv_sec = STAT_INTERVAL, .tv_usec = 0};
+    set_timer(rctx->base, on_stat_timer, 0, rctx, &tv);
+}
+
+static void frame_done(bench_conn *bc)
+{
+    unsigned long long now = realtime_ns();
+    unsigned long long lat = now > bc->hdr.send_ns ? now - bc->hdr.send_ns : 0;
+    sev_hist_add(&bc->lat, lat);
+    sev_hist_add(&bc->total_lat, lat);
+    bc->frames++;
+    bc->total_frames++;
+}
+
+static void on_bench_event(sev_conn *conn, int what, void *arg);
+
+//先取帧头，负载只计数不拷贝
+static void on_bench_data(sev_conn *conn, void *arg)
+{
+    bench_conn *bc = (bench_conn *)arg;
+    size_t len = sev_buf_len(&conn->input);
+    bc->bytes += len;
+    bc->total_bytes += len;
+
+    while (sev_buf_len(&conn->input))
+    {
+        if (!bc->has_hdr)
+        {
+            if (sev_buf_len(&conn->input) < sizeof(frame_hdr))
+            {
+                break;
+            }
+            sev_buf_remove(&conn->input, &bc->hdr, sizeof(frame_hdr));
+            if (bc->hdr.magic != BENCH_MAGIC || bc->hdr.len < sizeof(frame_hdr) || bc->hdr.len > MAX_FRAME)
+            {
+                LOG("bad frame header, close conn");
+                on_bench_event(conn, SEV_CONN_ERROR, bc);
+                return;
+            }
+            //序号跳过的就是客户端丢掉的帧
+            if (bc->total_frames && bc->hdr.seq > bc->next_seq)
+            {
+                bc->drops += bc->hdr.seq - bc->next_seq;
+                bc->total_drops += bc->hdr.seq - bc->next_seq;
+            }
+            bc->next_seq = bc->hdr.seq + 1;
+            bc->has_hdr = 1;
+            bc->skip = bc->hdr.len - sizeof(frame_hdr);
+        }
+
+        size_t n = sev_buf_len(&conn->input);
+        n = n < bc->skip ? n : bc->skip;
+        sev_buf_drain(&conn->input, n);
+        bc->skip -= n;
+        if (bc->skip)
+        {
+            break;
+        }
+        bc->has_hdr = 0;
+        frame_done(bc);
+    }
+}
+
+static void on_bench_event(sev_conn *conn, int what, void *arg)
+{
+    bench_conn *bc = (bench_conn *)arg;
+    reactor_ctx *rctx = bc->rctx;
+    double secs = (realtime_ns() - bc->start_ns) / 1e9;
+    print_conn(bc, "end", bc->total_bytes, bc->total_frames, bc->total_drops, &bc->total_lat, secs > 0 ? secs : 1);
+
+    bc->prev ? (bc->prev->next = bc->next) : (rctx->conns = bc->next);
+    bc->next ? (bc->next->prev = bc->prev) : 0;
+    free(bc);
+    sev_conn_free(conn);
+}
+
+static void on_accept(int fd, int what, void *arg)
+{
+    reactor_ctx *rctx = (reactor_ctx *)arg;
+    if (!(what & SEV_IO_READABLE))
+    {
+        return;
+    }
+    int conn_fd = accept(fd, NULL, NULL);
+    if (conn_fd < 0)
+    {
+        return;
+    }
+
+    bench_conn *bc = (bench_conn *)calloc(1, sizeof(bench_conn));
+    bc->rctx = rctx;
+    bc->start_ns = realtime_ns();
+    bc->conn = sev_conn_new(rctx->base, conn_fd, 1);
+    if (!bc->conn)
+    {
+        close(conn_fd);
+        free(bc);
+        return;
+    }
+    sev_conn_set_cb(bc->conn, on_bench_data, 0, on_bench_event, bc);
+
+    bc->next = rctx->conns;
+    rctx->conns ? (rctx->conns->prev = bc) : 0;
+    rctx->conns = bc;
+}
+
+static int init_reactor(reactor_ctx *rctx, int index, sev_base *base, int port)
+{
+    rctx->index = index;
+    rctx->base = base;
+
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int on = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+    struct sockaddr_in local;
+    make_addr(&local, 0, port);
+    if (bind(sockfd, (struct sockaddr *)&local, sizeof(local)) != 0 || listen(sockfd, 1024) != 0)
+    {
+        LOG("reactor %d listen on %d failed", index, port);
+        close(sockfd);
+        return -1;
+    }
+    rctx->listen_fd = sockfd;
+
+    sev_io_event *ev = new_io_event(sockfd, SEV_IO_READABLE | SEV_IO_ERROR, 1, on_accept, rctx);
+    add_io_event(base, ev);
+
+    struct timeval tv = {.tv_sec = STAT_INTERVAL, .tv_usec = 0};
+    set_timer(base, on_stat_timer, 0, rctx, &tv);
+    return 0;
+}
+
+//关掉前n个reactor的监听socket，释放pool(连同里面的base)和reactor上下文
+static void free_reactors(sev_pool *pool, reactor_ctx *rctxs, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        close(rctxs[i].listen_fd);
+    }
+    free(rctxs);
+    sev_free_pool(pool);
+}
+
+static int run_server(int port, int reactors)
+{
+    sev_pool *pool = sev_new_pool(reactors, 1);
+    reactor_ctx *rctxs = (reactor_ctx *)calloc(pool->count, sizeof(reactor_ctx));
+    for (int i = 0; i < pool->count; i++)
+    {
+        if (init_reactor(&rctxs[i], i, sev_pool_base(pool, i), port) != 0)
+        {
+            free_reactors(pool, rctxs, i);
+            return 1;
+        }
+    }
+    LOG("bench server: %d reactors on port %d", pool->count, port);
+
+    sev_pool_start(pool);
+    sev_pool_wait(pool);
+    free_reactors(pool, rctxs, pool->count);
+    return 0;
+}
+
+/* ****************  client  ***************** */
+
+typedef struct bench_profile_
+{
+    int conns;
+    int fps;
+    int gop;        //每gop帧一个关键帧
+    int key_size;   //关键帧字节数
+    int frame_size; //普通帧字节数
+    int seconds;
+    int write_high; //连接输出缓冲区超过这么多字节就丢帧
+} bench_profile;
+
+typedef struct client_conn_
+{
+    sev_conn *conn;
+    unsigned int id;
+    unsigned int seq;
+    int blocked; //输出缓冲区超过了高水位，等write_cb
+    long long sent_frames;
+    long long drops;
+} client_conn;
+
+typedef struct client_ctx_
+{
+    sev_base *base;
+    bench_profile prof;
+    client_conn *conns;
+    long long ticks;
+    long long end_tick;
+    struct timeval interval;
+} client_ctx;
+
+static char zero_payload[MAX_FRAME];
+
+static void on_client_writable(sev_conn *conn, void *arg)
+{
+    ((client_conn *)arg)->blocked = 0;
+}
+
+static void on_client_event(sev_conn *conn, int what, void *arg)
+{
+    client_conn *cc = (client_conn *)arg;
+    LOG("conn %u closed by peer (%d)", cc->id, what);
+    sev_conn_free(conn);
+    cc->conn = NULL;
+}
+
+//每个连接的GOP错开，关键帧不会同时发
+static void send_frame(client_ctx *ctx, client_conn *cc)
+{
+    bench_profile *prof = &ctx->prof;
+    frame_hdr hdr = {0};
+    hdr.magic = BENCH_MAGIC;
+    hdr.conn_id = cc->id;
+    hdr.seq = cc->seq++;
+    hdr.key = (ctx->ticks + cc->id) % prof->gop == 0;
+    hdr.len = sizeof(frame_hdr) + (hdr.key ? prof->key_size : prof->frame_size);
+
+    if (!cc->conn)
+    {
+        return;
+    }
+    if (cc->blocked)
+    {
+        cc->drops++;
+        return;
+    }
+
+    hdr.send_ns = realtime_ns();
+    sev_conn_write(cc->conn, &hdr, sizeof(hdr));
+    int ret = sev_conn_write_ref(cc->conn, zero_payload, hdr.len - sizeof(frame_hdr), NULL, NULL);
+    cc->sent_frames++;
+    if (ret == 1)
+    {
+        cc->blocked = 1;
+    }
+}
+
+static void on_tick(void *arg)
+{
+    client_ctx *ctx = (client_ctx *)arg;
+    for (int i = 0; i < ctx->prof.conns; i++)
+    {
+        send_frame(ctx, &ctx->conns[i]);
+    }
+    ctx->ticks++;
+    if (ctx->ticks >= ctx->end_tick)
+    {
+        sev_stop(ctx->base);
+        return;
+    }
+    set_timer(ctx->base, on_tick, 0, ctx, &ctx->interval);
+}
+
+static int connect_to(char *ip, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in peer;
+    make_addr(&peer, ip, port);
+    if (connect(fd, (struct sockaddr *)&peer, sizeof(peer)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+static int run_client(char *ip, int port, bench_profile *prof)
+{
+    client_ctx ctx = {0};
+    ctx.base = sev_new_base();
+    ctx.prof = *prof;
+    ctx.conns = (client_conn *)calloc(prof->conns, sizeof(client_conn));
+    ctx.end_tick = (long long)prof->fps * prof->seconds;
+    ctx.interval.tv_sec = 0;
+    ctx.interval.tv_usec = 1000000 / prof->fps;
+
+    for (int i = 0; i < prof->conns; i++)
+    {
+        client_conn *cc = &ctx.conns[i];
+        cc->id = i;
+        int fd = connect_to(ip, port);
+        if (fd < 0)
+        {
+            LOG("connect %s:%d failed", ip, port);
+            return 1;
+        }
+        cc->conn = sev_conn_new(ctx.base, fd, 1);
+        sev_conn_set_cb(cc->conn, 0, on_client_writable, on_client_event, cc);
+        sev_conn_set_watermark(cc->conn, 0, 0, prof->write_high);
+    }
+    LOG("bench client: %d conns, %d fps, gop %d, key %d bytes, frame %d bytes, %d s", prof->conns, prof->fps, prof->gop,
+        prof->key_size, prof->frame_size, prof->seconds);
+
+    set_timer(ctx.base, on_tick, 0, &ctx, &ctx.interval);
+    sev_loop(ctx.base);
+
+    long long sent = 0, drops = 0;
+    for (int i = 0; i < prof->conns; i++)
+    {
+        sent += ctx.conns[i].sent_frames;
+        drops += ctx.conns[i].drops;
+        if (ctx.conns[i].conn)
+        {
+            sev_conn_free(ctx.conns[i].conn);
+        }
+    }
+    LOG("bench client done: sent %lld frames, dropped %lld", sent, drops);
+
+    free(ctx.conns);
+    sev_free_base(ctx.base);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 3 && 0 == strcmp(argv[1], "server"))
+    {
+        return run_server(atoi(argv[2]), argc >= 4 ? atoi(argv[3]) : 1);
+    }
+    if (argc >= 4 && 0 == strcmp(argv[1], "client"))
+    {
+        bench_profile prof = {.conns = 1, .fps = 15, .gop = 30, .key_size = 110000, .frame_size = 200, .seconds = 10,
+                              .write_high = 1024 * 1024};
+        int *opts[] = {&prof.conns, &prof.fps, &prof.gop, &prof.key_size, &prof.frame_size, &prof.seconds, &prof.write_high};
+        for (int i = 4; i < argc && i - 4 < (int)(sizeof(opts) / sizeof(opts[0])); i++)
+        {
+            *opts[i - 4] = atoi(argv[i]);
+        }
+        if (prof.conns <= 0 || prof.fps <= 0 || prof.gop <= 0 || prof.key_size + sizeof(frame_hdr) > MAX_FRAME ||
+            prof.frame_size + sizeof(frame_hdr) > MAX_FRAME)
+        {
+            fprintf(stderr, "bad profile\n");
+            return 1;
+        }
+        return run_client(argv[2], atoi(argv[3]), &prof);
+    }
+
+    fprintf(stderr, "Usage: %s server <port> [reactors]\n", argv[0]);
+    fprintf(stderr, "       %s client <ip> <port> [conns fps gop key_size frame_size seconds write_high]\n", argv[0]);
+    fprintf(stderr, "  defaults: 1 conn, 15 fps, gop 30, key 110000 bytes, frame 200 bytes, 10 s, write_high 1MB\n");
+    return 1;
+}
@@ -3,144 +3,632 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/eventfd.h>
 
 #include "simple_event_macro.h"
 #include "simple_event.h"
+#include "simple_event_stats.h"
 
 extern void _make_list(sev_base *base);
 extern void _clear_list(sev_base *base);
 
 extern int _add_io_event(void *ls, sev_io_event *ev);
 extern sev_io_event *_get_io_event(void *ls, int fd);
+extern void _detach_io_event(void *ls, int fd);
 extern void _set_io_event_remove(void *ls, int fd, int free);
-extern void _remove_io_event(void *ls, int (*epoll_remove_cb)(sev_base *base, int fd), sev_base *base);
+extern void _remove_io_event(void *ls, int (*epoll_remove_cb)(sev_base *base, int fd), void (*free_cb)(sev_io_event *ev), sev_base *base);
+
+extern sev_io_event *_pool_get_io(sev_base *base);
+extern void _pool_put_io(sev_base *base, sev_io_event *ev);
+extern sev_custom_event *_pool_get_cus(sev_base *base);
+extern void _pool_put_cus(sev_base *base, sev_custom_event *ev);
 
 extern int _add_cus_event(void *ls, sev_custom_event *ev);
 extern void _remove_cus_event(void *ls, int event_id);
-extern int _cus_event_loop(sev_base *base);
+extern int _cus_event_loop(sev_base *base, int pri);
+extern long long _cus_event_next_timeout(void *ls, unsigned long long now, long long poll_interval);
 
-extern int _add_timer(void* ls, timer_param_free_callback tcb, timer_param_free_callback free_cb, void *param, struct timeval *overtime);
+extern sev_timer_id _add_timer(void* ls, unsigned long long now, timer_callback tcb, timer_param_free_callback free_cb, void *param, struct timeval *overtime);
+extern int _cancel_timer(void* ls, sev_timer_id id);
+extern long long _timer_next_timeout(void* ls, unsigned long long now);
 extern int _timer_loop(sev_base *base);
 
+extern void _uring_flush(sev_base *base);
+extern int _uring_process(sev_base *base);
+extern void _uring_free(sev_base *base);
+extern void _co_free(sev_base *base);
+
+//sev_post的队列节点，Vyukov的侵入式MPSC队列
+typedef struct post_node_
+{
+    struct post_node_ *next;
+    post_callback fn;
+    void *arg;
+} post_node;
+
+static void _post_queue_init(sev_base *base)
+{
+    post_node *stub = (post_node *)calloc(1, sizeof(post_node));
+    base->post_stub = stub;
+    base->post_head = stub;
+    base->post_tail = stub;
+}
+
+static void _post_queue_push(sev_base *base, post_node *node)
+{
+    node->next = NULL;
+    post_node *prev = (post_node *)__atomic_exchange_n((post_node **)&base->post_head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+//只在loop线程调用。返回NULL表示队列空，或者有生产者入队到一半(它入队完会再唤醒loop)
+static post_node *_post_queue_pop(sev_base *base, post_node *stub)
+{
+    post_node *tail = (post_node *)base->post_tail;
+    post_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == stub)
+    {
+        if (!next)
+        {
+            return NULL;
+        }
+        base->post_tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next)
+    {
+        base->post_tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n((post_node **)&base->post_head, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    _post_queue_push(base, stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next)
+    {
+        base->post_tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static int _post_queue_empty(sev_base *base)
+{
+    return __atomic_load_n((post_node **)&base->post_head, __ATOMIC_ACQUIRE) == base->post_tail;
+}
+
+#define MAX_POST_PER_LOOP 1024
+//执行投递过来的回调，每轮最多执行MAX_POST_PER_LOOP个，剩下的下一轮不阻塞继续执行
+static void _post_queue_run(sev_base *base, post_node *stub)
+{
+    for (int i = 0; i < MAX_POST_PER_LOOP; i++)
+    {
+        post_node *node = _post_queue_pop(base, stub);
+        if (!node)
+        {
+            break;
+        }
+        STATS_CALL(base, SEV_STATS_POST, node->fn, node->fn(node->arg));
+        free(node);
+    }
+}
+
+static void _post_queue_clear(sev_base *base, post_node *stub)
+{
+    post_node *node;
+    while ((node = _post_queue_pop(base, stub)) != NULL)
+    {
+        free(node);
+    }
+    free(stub);
+    base->post_stub = base->post_head = base->post_tail = NULL;
+}
+
+//定义SEV_CLOCK_COARSE时用CLOCK_MONOTONIC_COARSE，更便宜但精度只有一个tick(1~4ms)
+#ifdef SEV_CLOCK_COARSE
+#define SEV_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define SEV_CLOCK CLOCK_MONOTONIC
+#endif
+
+static unsigned long long _clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(SEV_CLOCK, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void _update_now(sev_base *base)
+{
+    base->now = _clock_ns();
+}
+
+//当前的单调时钟(ns)。loop线程里返回这一轮缓存的时间，loop没在跑时(比如启动前加事件)现取
+unsigned long long sev_now(sev_base *base)
+{
+    return __atomic_load_n(&base->in_loop, __ATOMIC_ACQUIRE) ? base->now : _clock_ns();
+}
+
+#define SEV_BATCH_MIN 16   /*epoll_wait一次最少取多少个事件*/
+#define SEV_BATCH_MAX 1024 /*最多取多少个，每次取满就翻倍，取得很少就减半*/
+
+typedef struct ready_queue_
+{
+    sev_io_event *head;
+    sev_io_event *tail;
+} ready_queue;
+
+//每类事件每轮最多执行max_count个、最多执行max_ns，0表示不限制
+typedef struct sev_budget_
+{
+    int max_count;
+    unsigned long long max_ns;
+    int count;
+    unsigned long long start;
+} sev_budget;
+
+typedef struct sev_sched_
+{
+    ready_queue ready[SEV_PRI_COUNT];
+    sev_budget budget[SEV_PRI_COUNT];
+    int pending; //就绪队列里的事件数，不为0时epoll_wait不阻塞
+    int uring_ready; //io_uring有完成事件还没处理，不为0时epoll_wait也不阻塞
+    int batch;
+    struct epoll_event events[SEV_BATCH_MAX];
+} sev_sched;
+
+static sev_sched *_sched_new()
+{
+    sev_sched *sched = (sev_sched *)calloc(1, sizeof(sev_sched));
+    sched->batch = 64;
+    //io默认每轮最多跑10ms，后台事件每轮最多32个/2ms，控制命令和定时器不限
+    sched->budget[SEV_PRI_IO].max_ns = 10 * 1000000ULL;
+    sched->budget[SEV_PRI_BACKGROUND].max_count = 32;
+    sched->budget[SEV_PRI_BACKGROUND].max_ns = 2 * 1000000ULL;
+    return sched;
+}
+
+static void _ready_push(sev_sched *sched, sev_io_event *ev, int status)
+{
+    if (ev->ready)
+    {
+        ev->ready |= status;//还没来得及执行又就绪了一次，合并
+        return;
+    }
+    int pri = ev->priority;
+    ready_queue *q = &sched->ready[pri];
+    ev->ready = status;
+    ev->ready_pri = pri;
+    ev->ready_next = NULL;
+    ev->ready_prev = q->tail;
+    q->tail ? (q->tail->ready_next = ev) : (q->head = ev);
+    q->tail = ev;
+    sched->pending++;
+}
+
+static void _ready_unlink(sev_sched *sched, sev_io_event *ev)
+{
+    ready_queue *q = &sched->ready[ev->ready_pri];
+    ev->ready_prev ? (ev->ready_prev->ready_next = ev->ready_next) : (q->head = ev->ready_next);
+    ev->ready_next ? (ev->ready_next->ready_prev = ev->ready_prev) : (q->tail = ev->ready_prev);
+    ev->ready_prev = ev->ready_next = NULL;
+    ev->ready = 0;
+    sched->pending--;
+}
+
+static void _budget_begin(sev_sched *sched, int pri)
+{
+    sev_budget *b = &sched->budget[pri];
+    b->count = 0;
+    b->start = b->max_ns ? _clock_ns() : 0;
+}
+
+//每执行一个事件前调用，这一类这一轮的预算用完了返回0。至少会执行一个，避免饿死
+int _budget_take(sev_base *base, int pri)
+{
+    sev_budget *b = &((sev_sched *)base->sched)->budget[pri];
+    if (b->count && b->max_count && b->count >= b->max_count)
+    {
+        return 0;
+    }
+    if (b->count && b->max_ns && _clock_ns() - b->start >= b->max_ns)
+    {
+        return 0;
+    }
+    b->count++;
+    return 1;
+}
+
+//设置某一类事件每轮的预算，0表示不限制
+int sev_set_budget(sev_base *base, int pri, int max_count, int max_us)
+{
+    if (pri < 0 || pri >= SEV_PRI_COUNT)
+    {
+        return -1;
+    }
+    sev_budget *b = &((sev_sched *)base->sched)->budget[pri];
+    b->max_count = max_count > 0 ? max_count : 0;
+    b->max_ns = max_us > 0 ? max_us * 1000ULL : 0;
+    return 0;
+}
+
+//已经在就绪队列里的事件这次还按原来的优先级执行
+void sev_io_set_priority(sev_io_event *ev, int pri)
+{
+    ev->priority = pri >= 0 && pri < SEV_PRI_COUNT ? pri : SEV_PRI_IO;
+}
+
+void sev_cus_set_priority(sev_custom_event *ev, int pri)
+{
+    ev->priority = pri >= 0 && pri < SEV_PRI_COUNT ? pri : SEV_PRI_IO;
+}
+
 sev_base *sev_new_base()
 {
     sev_base *base = (sev_base *)calloc(1, sizeof(sev_base));
     base->epoll_fd = epoll_create1(0);
 
+    base->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event wev = {.events = EPOLLIN, .data.ptr = &base->wake_fd};//data.ptr指向wake_fd本身，和io事件区分
+    epoll_ctl(base->epoll_fd, EPOLL_CTL_ADD, base->wake_fd, &wev);
+
+    _post_queue_init(base);
     _make_list(base);
+    base->sched = _sched_new();
     return base;
 }
 void sev_free_base(sev_base *base)
 {
+    _uring_free(base);
+    _co_free(base);
+    free(base->stats);
     close(base->epoll_fd);
+    close(base->wake_fd);
+    _post_queue_clear(base, (post_node *)base->post_stub);
     _clear_list(base);
+    free(base->sched);
+    free(base);
+}
+
+//当前线程正在跑的loop。loop线程里new出来的事件从这个base的节点池里取，不走malloc
+static __thread sev_base *_cur_base;
+//每个线程一份，用它的地址区分线程
+static __thread char _thread_token;
+
+static void _put_io_cb(void *arg)
+{
+    sev_io_event *ev = (sev_io_event *)arg;
+    _pool_put_io(ev->owner, ev);
+}
+
+static void _put_cus_cb(void *arg)
+{
+    sev_custom_event *ev = (sev_custom_event *)arg;
+    _pool_put_cus(ev->owner, ev);
+}
+
+//节点要还给所属的base：在跑它的loop的线程里(loop退出以后也算)直接放回池里，其他线程一律投递过去。
+//不看loop在不在跑，否则loop正好退出时，两个线程可能同时操作节点池
+static int _release_to_owner(sev_base *owner, post_callback put, void *ev)
+{
+    if (owner != _cur_base && __atomic_load_n(&owner->loop_thread, __ATOMIC_ACQUIRE) != (void *)&_thread_token)
+    {
+        return sev_post(owner, put, ev);
+    }
+    put(ev);
+    return 0;
 }
 
 sev_custom_event *new_cus_event(int id, int event, int persist, cus_event_handler hd, void *ctx)
 {
-    sev_custom_event *ev = (sev_custom_event *)calloc(1, sizeof(sev_custom_event));
+    sev_custom_event *ev = _cur_base ? _pool_get_cus(_cur_base) : (sev_custom_event *)calloc(1, sizeof(sev_custom_event));
     ev->event_id = id;
     ev->listen = event;
     ev->handler = hd;
     ev->persist = persist;
     ev->ctx = ctx;
+    ev->priority = SEV_PRI_IO;
 
     return ev;
 }
 
 void free_cus_event(sev_custom_event *ev)
 {
-    memset(ev, 0, sizeof(sev_custom_event));
-    free(ev);
+    if (!ev->owner)
+    {
+        memset(ev, 0, sizeof(sev_custom_event));
+        free(ev);
+        return;
+    }
+    if (ev->pooled)
+    {
+        LOG("cus event already freed. id = %d", ev->event_id);
+        return;
+    }
+    _release_to_owner(ev->owner, _put_cus_cb, ev);
 }
 
 int add_cus_event(sev_base *base, sev_custom_event *ev, struct timeval *overtime)
 {
+    if (ev->pooled)
+    {
+        LOG("cus event is freed. id = %d", ev->event_id);
+        return -1;
+    }
     if (overtime)
     {
         memcpy(&ev->_overtime, overtime, sizeof(struct timeval));
         ev->overtime = &ev->_overtime;
-        gettimeofday(&ev->start, NULL);
+        ev->start = sev_now(base);
     }
     else
     {
         memset(&ev->_overtime, 0, sizeof(struct timeval));
-        memset(&ev->start, 0, sizeof(struct timeval));
+        ev->start = 0;
         ev->overtime = 0;
     }
+    ev->base = base;
     return _add_cus_event(base->cus_event_list, ev);
 }
 
+//可以在其他线程调用，会唤醒事件所在的loop
 int active_cus_event(sev_custom_event *ev, int event)
 {
-    ev->status |= event;
+    if (ev->pooled)
+    {
+        return -1;
+    }
+    __atomic_fetch_or(&ev->status, event, __ATOMIC_RELEASE);
+    if (ev->base)
+    {
+        sev_wakeup(ev->base);
+    }
+    return 0;
+}
+
+//唤醒阻塞在epoll_wait中的loop，线程安全。loop读走eventfd之前多次调用只写一次
+void sev_wakeup(sev_base *base)
+{
+    if (__atomic_exchange_n(&base->wake_pending, 1, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+    eventfd_write(base->wake_fd, 1);
+}
+
+//在base所在的loop线程里执行fn(arg)，可以在任意线程调用，按投递顺序执行
+int sev_post(sev_base *base, post_callback fn, void *arg)
+{
+    if (!base || !fn)
+    {
+        return -1;
+    }
+    post_node *node = (post_node *)malloc(sizeof(post_node));
+    if (!node)
+    {
+        return -1;
+    }
+    node->fn = fn;
+    node->arg = arg;
+
+    _post_queue_push(base, node);
+    sev_wakeup(base);
     return 0;
 }
 
+static void _drain_wakeup(sev_base *base)
+{
+    eventfd_t val;
+    eventfd_read(base->wake_fd, &val);
+    //先读走再清标志，清标志之后的唤醒一定会重新写eventfd
+    __atomic_store_n(&base->wake_pending, 0, __ATOMIC_RELEASE);
+}
+
 int remove_cus_event(sev_base *base, int event_id, int free)
 {
     _remove_cus_event(base->cus_event_list, event_id);
     return 0;
 }
 
-int _io_event_loop(sev_base *base);
+int _io_event_loop(sev_base *base, int timeout);
+
+#define POLL_INTERVAL 1 /*ms，没有超时时间的自定义事件按这个间隔轮询*/
+//epoll_wait阻塞到最近的定时器或自定义事件超时，都没有就一直阻塞直到有io或被唤醒
+static int _loop_timeout(sev_base *base)
+{
+    sev_sched *sched = (sev_sched *)base->sched;
+    if (!_post_queue_empty(base) || sched->pending || sched->uring_ready)
+    {
+        return 0;
+    }
+
+    _update_now(base);//这一轮跑了多久不一定，按现在的时间算要等多久，定时器才不会晚醒
+    long long next = _timer_next_timeout(base->timer_list, base->now);
+    long long cus_next = _cus_event_next_timeout(base->cus_event_list, base->now, POLL_INTERVAL * 1000000LL);
+    if (next < 0 || (cus_next >= 0 && cus_next < next))
+    {
+        next = cus_next;
+    }
+    if (next < 0)
+    {
+        return -1;
+    }
+
+    long long ms = (next + 999999) / 1000000;//向上取整，避免还没到期就醒来空转
+    return ms > 0x7fffffff ? 0x7fffffff : (int)ms;
+}
+
+//执行某一优先级就绪的io事件，预算用完了剩下的留到下一轮
+static void _io_ready_run(sev_base *base, int pri)
+{
+    sev_sched *sched = (sev_sched *)base->sched;
+    ready_queue *q = &sched->ready[pri];
+    while (q->head && _budget_take(base, pri))
+    {
+        sev_io_event *ev = q->head;
+        int status = ev->ready;
+        _ready_unlink(sched, ev);
+        if (ev->remove)
+        {
+            continue;
+        }
+        if (!ev->persist)
+        {
+            remove_io_event(base, ev->fd, 0);
+        }
+        STATS_CALL(base, SEV_STATS_IO, ev->handler, ev->handler(ev->fd, status, ev->ctx));
+    }
+}
+
+//控制命令 > 定时器 > io > 后台，每类里先跑自定义事件再跑就绪的io事件，io这一类最后处理io_uring的完成事件
+static void _run_by_priority(sev_base *base)
+{
+    sev_sched *sched = (sev_sched *)base->sched;
+    for (int pri = 0; pri < SEV_PRI_COUNT; pri++)
+    {
+        _budget_begin(sched, pri);
+        if (pri == SEV_PRI_TIMER)
+        {
+            _timer_loop(base);
+        }
+        _cus_event_loop(base, pri);
+        _io_ready_run(base, pri);
+        if (pri == SEV_PRI_IO && sched->uring_ready)
+        {
+            sched->uring_ready = _uring_process(base);
+        }
+    }
+}
+
 void sev_loop(sev_base *base)
 {
+    _cur_base = base;
+    __atomic_store_n(&base->loop_thread, (void *)&_thread_token, __ATOMIC_RELEASE);
+    __atomic_store_n(&base->in_loop, 1, __ATOMIC_RELEASE);
     while (!base->stop)
     {
-        _timer_loop(base);
-        _cus_event_loop(base);
-        _io_event_loop(base);
+        _update_now(base);
+        STATS_TURN(base);
+        _post_queue_run(base, (post_node *)base->post_stub);
+        _run_by_priority(base);
+        if (base->uring)
+        {
+            _uring_flush(base);//这一轮回调里提交的io_uring操作一次提交
+        }
+        _io_event_loop(base, _loop_timeout(base));
     }
+    __atomic_store_n(&base->in_loop, 0, __ATOMIC_RELEASE);
+    _cur_base = NULL;
 }
 void sev_stop(sev_base *base)
 {
     base->stop = 1;
+    sev_wakeup(base);
 }
 
+static uint32_t _io_listen(int event, int persist)
+{
+    uint32_t listen = 0;
+    event &SEV_IO_READABLE ? listen |= EPOLLIN : 0;
+    event &SEV_IO_WRITEABLE ? listen |= EPOLLOUT : 0;
+    event &SEV_IO_HANGUP ? listen |= EPOLLHUP : 0;
+    event &SEV_IO_ERROR ? listen |= EPOLLERR : 0;
+    event &SEV_IO_EDGE ? listen |= EPOLLET : 0;
+    persist == 0 ? listen |= EPOLLONESHOT : 0;
+    return listen;
+}
+
+//event里带SEV_IO_EDGE时是边沿触发，回调里要一直读/写到EAGAIN
 sev_io_event *new_io_event(int fd, int event, int persist, io_event_handler hd, void *ctx)
 {
-    sev_io_event *ev = (sev_io_event *)calloc(1, sizeof(sev_io_event));
+    sev_io_event *ev = _cur_base ? _pool_get_io(_cur_base) : (sev_io_event *)calloc(1, sizeof(sev_io_event));
     ev->persist = persist;
     ev->handler = hd;
     ev->ctx = ctx;
     ev->fd = fd;
+    ev->priority = SEV_PRI_IO;
 
-    int listen = 0;
-    event &SEV_IO_READABLE ? listen |= EPOLLIN : 0;
-    event &SEV_IO_WRITEABLE ? listen |= EPOLLOUT : 0;
-    event &SEV_IO_HANGUP ? listen |= EPOLLHUP : 0;
-    event &SEV_IO_ERROR ? listen |= EPOLLERR : 0;
-    persist == 0 ? listen |= EPOLLONESHOT : 0;
-    ev->event.events = listen;
-    ev->event.data.fd = fd;
+    ev->event.events = _io_listen(event, persist);
+    ev->event.data.ptr = ev;//就绪时直接拿到事件，不用再按fd查找
 
     return ev;
 }
 
+//修改已经加入的io事件关心的事件，比如只在有数据要发时才打开SEV_IO_WRITEABLE
+int mod_io_event(sev_base *base, sev_io_event *ev, int event)
+{
+    uint32_t listen = _io_listen(event, ev->persist);
+    if (listen == ev->event.events)
+    {
+        return 0;
+    }
+
+    ev->event.events = listen;
+    int res = epoll_ctl(base->epoll_fd, EPOLL_CTL_MOD, ev->fd, &ev->event);
+    if (res != 0)
+    {
+        LOG("epoll_ctl ERROR.");
+        return -1;
+    }
+    return 0;
+}
+
 void free_io_event(sev_io_event *ev)
 {
-    memset(ev, 0, sizeof(sev_io_event));
-    free(ev);
+    if (!ev->owner)
+    {
+        memset(ev, 0, sizeof(sev_io_event));
+        free(ev);
+        return;
+    }
+    if (ev->pooled)
+    {
+        LOG("io event already freed. fd = %d", ev->fd);
+        return;
+    }
+    _release_to_owner(ev->owner, _put_io_cb, ev);
 }
 
+int epoll_remove_cb(sev_base *base, int fd);
 int add_io_event(sev_base *base, sev_io_event *ev)
 {
-    int res = epoll_ctl(base->epoll_fd, EPOLL_CTL_ADD, ev->event.data.fd, &ev->event);
+    if (ev->pooled)
+    {
+        LOG("io event is freed. fd = %d", ev->fd);
+        return -1;
+    }
+    sev_io_event *old = _get_io_event(base->io_event_list, ev->fd);
+    if (old)
+    {
+        if (!old->remove)
+        {
+            LOG("io event is exist. fd = %d", ev->fd);
+            return -1;
+        }
+        //fd上还挂着一个等待删除的事件(比如关闭后fd被复用了)，先把它从epoll和槽位里摘掉
+        epoll_remove_cb(base, ev->fd);
+        _detach_io_event(base->io_event_list, ev->fd);
+    }
+
+    int res = epoll_ctl(base->epoll_fd, EPOLL_CTL_ADD, ev->fd, &ev->event);
     if (res != 0)
     {
         LOG("epoll_ctl ERROR.");
         return -1;
     }
     
-    _add_io_event(base->io_event_list, ev);
-    return 0;
+    return _add_io_event(base->io_event_list, ev);
 }
 
 int epoll_remove_cb(sev_base *base, int fd)
 {
     int res = epoll_ctl(base->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
-    if (res != 0)
+    if (res != 0 && errno != EBADF && errno != ENOENT)//fd已经close了，内核会自动从epoll里删掉
     {
         LOG("epoll_ctl ERROR.");
         // return -1;
@@ -150,24 +638,47 @@ int epoll_remove_cb(sev_base *base, int fd)
 
 int remove_io_event(sev_base *base, int fd, int free)
 {
+    //已经就绪还没执行的不再执行
+    sev_io_event *ev = _get_io_event(base->io_event_list, fd);
+    if (ev && ev->ready)
+    {
+        _ready_unlink((sev_sched *)base->sched, ev);
+    }
     //只对要删除的事件打个标记
     _set_io_event_remove(base->io_event_list, fd, free);
     return 0;
 }
 
-#define MAX_EVENTS 10
-int _io_event_loop(sev_base *base)
+//等io事件，就绪的事件按优先级放进就绪队列，下一轮再执行
+int _io_event_loop(sev_base *base, int timeout)
 {
-    _remove_io_event(base->io_event_list,epoll_remove_cb,base);//这里才是真正删除事件
+    sev_sched *sched = (sev_sched *)base->sched;
+    _remove_io_event(base->io_event_list,epoll_remove_cb,free_io_event,base);//这里才是真正删除事件
 
-    struct epoll_event events[MAX_EVENTS];
-    int nfds = epoll_wait(base->epoll_fd, events, MAX_EVENTS, 1/*1*/ /*无事件时阻塞1ms*/);
+    struct epoll_event *events = sched->events;
+    STATS_WAIT_BEGIN;
+    int nfds = epoll_wait(base->epoll_fd, events, sched->batch, timeout /*无事件时阻塞到最近的超时*/);
+    _update_now(base);//io回调里用sev_now拿到的是醒来之后的时间
+    STATS_WAIT_END(base, nfds);
     if (nfds == -1)
     {
-        LOG("epoll_wait ERROR.");
+        if (errno != EINTR)
+        {
+            LOG("epoll_wait ERROR.");
+        }
         return -1;
     }
 
+    //批大小自适应：取满了说明还有，下次多取；连续很空就缩小，少扫一些events数组
+    if (nfds == sched->batch && sched->batch < SEV_BATCH_MAX)
+    {
+        sched->batch *= 2;
+    }
+    else if (nfds * 8 < sched->batch && sched->batch > SEV_BATCH_MIN)
+    {
+        sched->batch /= 2;
+    }
+
     for (int i = 0; i < nfds; i++)
     {
         uint32_t eev = events[i].events;
@@ -178,23 +689,37 @@ int _io_event_loop(sev_base *base)
         eev & EPOLLHUP ? status |= SEV_IO_HANGUP : 0;
         eev & EPOLLERR ? status |= SEV_IO_ERROR : 0;
 
-        int fd = events[i].data.fd;
-        sev_io_event *ev = _get_io_event(base->io_event_list, fd);
-
-        if (!ev->persist)
+        if (events[i].data.ptr == &base->wake_fd)
+        {
+            _drain_wakeup(base);
+            continue;
+        }
+        if (base->uring && events[i].data.ptr == base->uring)
         {
-            remove_io_event(base, fd, 0);
+            sched->uring_ready = 1;//完成事件放到io这一类里按预算处理
+            continue;
         }
-        if (ev)
+
+        sev_io_event *ev = (sev_io_event *)events[i].data.ptr;
+        if (ev->remove)
         {
-            ev->handler(fd, status, ev->ctx);
+            continue;//已经被删除了，事件要到下一轮才会真正释放
         }
+        _ready_push(sched, ev, status);
     }
 
     return 0;
 }
 
-int set_timer(sev_base *base, timer_callback tcb, timer_param_free_callback free_cb, void *param, struct timeval *overtime)
+//返回定时器句柄，失败返回0
+//到期时间从现取的时钟算，不用这一轮缓存的now，否则一轮里靠后设的定时器会提前触发(最多一轮的耗时)
+sev_timer_id set_timer(sev_base *base, timer_callback tcb, timer_param_free_callback free_cb, void *param, struct timeval *overtime)
+{
+    return _add_timer(base->timer_list, _clock_ns(), tcb,free_cb,param,overtime);
+}
+
+//取消一个还没触发的定时器，会调用free_cb释放参数。句柄已失效(触发过或取消过)返回-1
+int cancel_timer(sev_base *base, sev_timer_id id)
 {
-    return _add_timer(base->timer_list, tcb,free_cb,param,overtime);
+    return _cancel_timer(base->timer_list, id);
 }
@@ -2,18 +2,39 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 
 typedef void (*cus_event_handler)(int fd, int event, int is_overtime, void *ctx);
 typedef void (*io_event_handler)(int fd, int event, void *ctx);
 typedef void (*timer_callback)(void *ctx);
 typedef void (*timer_param_free_callback)(void *ctx);
+typedef void (*post_callback)(void *arg);
+typedef void (*uring_callback)(int fd, int res, void *ctx); //res是系统调用的返回值，失败时是-errno
+typedef void (*sev_co_fn)(void *arg);
+
+//定时器句柄，高32位是代数，低32位是槽位，0表示无效
+typedef unsigned long long sev_timer_id;
 
 typedef struct sev_base_
 {
     int epoll_fd;
+    int wake_fd;      //eventfd，其他线程用来唤醒阻塞在epoll_wait里的loop
+    int wake_pending; //已经写过wake_fd还没被loop读走，避免重复写
+    void *post_head;  //sev_post的多生产者单消费者无锁队列，生产者从head入队
+    void *post_tail;  //loop线程从tail出队
+    void *post_stub;
     void *cus_event_list;
     void *io_event_list;
     void *timer_list;
+    void *event_pool; //io事件和自定义事件的节点池
+    void *uring;      //sev_uring_enable打开的io_uring，为空时只用epoll
+    void *stats;      //loop统计，只有定义了SEV_STATS才会分配
+    void *sched;      //按优先级排队的就绪io事件、每类事件每轮的预算、epoll_wait的批大小
+    void *co;         //协程调度：空闲栈池、活着的协程、fd上等待的协程
+    unsigned long long now; //缓存的单调时钟(ns)，每轮loop开始和epoll_wait返回后各取一次
+    int in_loop;            //loop在跑的时候sev_now直接返回缓存的时间，其他线程也会读，用原子操作
+    void *loop_thread;      //跑这个loop的线程(它的一个线程局部变量的地址)，别的线程释放的节点要投递回来
     int stop;
 } sev_base;
 
@@ -26,8 +47,132 @@ typedef struct sev_io_event_
     int persist;
     int remove;
     int free;
+
+    struct sev_base_ *owner; //从哪个base的节点池里分配的，为空表示是calloc出来的
+    unsigned int gen;        //每次回收加1，可以用来判断手里的旧指针是否已经失效
+    int pooled;              //已经回收到池里
+
+    int priority;            //SEV_PRIORITY，默认SEV_PRI_IO
+    int ready;               //已就绪还没执行的SEV_IO_*，非0表示在就绪队列里
+    int ready_pri;           //在哪个优先级的就绪队列里
+    struct sev_io_event_ *ready_prev;
+    struct sev_io_event_ *ready_next;
 } sev_io_event;
 
+//reactor池，每个sev_base跑在自己的线程上
+typedef struct sev_pool_
+{
+    int count;
+    int pin;      //是否把第i个reactor线程绑到第i个cpu
+    int running;
+    unsigned int next;
+    sev_base **bases;
+    void *threads;
+} sev_pool;
+
+//loop统计，编译时定义SEV_STATS才会记录
+//直方图按2的幂分段，每段再线性分SEV_HIST_SUB格，单位ns
+#define SEV_HIST_SUB 4
+#define SEV_HIST_BUCKETS (63 * SEV_HIST_SUB)
+#define SEV_STATS_HANDLERS 32 //按回调函数分别统计的个数上限
+
+enum SEV_STATS_KIND
+{
+    SEV_STATS_IO = 0,
+    SEV_STATS_CUS,
+    SEV_STATS_TIMER,
+    SEV_STATS_POST,
+    SEV_STATS_URING,
+    SEV_STATS_KINDS,
+};
+
+typedef struct sev_hist_
+{
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned int buckets[SEV_HIST_BUCKETS];
+} sev_hist;
+
+typedef struct sev_handler_stats_
+{
+    void *fn; //回调函数地址
+    int kind; //SEV_STATS_KIND
+    sev_hist lat;
+} sev_handler_stats;
+
+typedef struct sev_stats_
+{
+    unsigned long long loops;
+    unsigned long long wait_ns; //阻塞在epoll_wait里的时间
+    unsigned long long busy_ns; //其余时间
+    sev_hist kind_lat[SEV_STATS_KINDS];
+    sev_hist timer_late;  //定时器实际执行比预定时间晚多少
+    sev_hist ready_batch; //每次epoll_wait返回的fd数
+    int handler_count;
+    sev_handler_stats handlers[SEV_STATS_HANDLERS];
+} sev_stats;
+
+//链式缓冲区，由多个块组成。追加引用块时不拷贝数据，块发完后回调释放
+typedef void (*sev_buf_free_cb)(void *data, void *arg);
+typedef struct sev_buf_
+{
+    void *head;
+    void *tail;
+    void *spare;  //缓存一个用完的块，读数据时不用每次malloc
+    size_t len;   //所有块里未读的字节数
+} sev_buf;
+
+struct sev_conn_;
+typedef void (*conn_data_cb)(struct sev_conn_ *conn, void *ctx);
+typedef void (*conn_event_cb)(struct sev_conn_ *conn, int what, void *ctx); //what是SEV_CONN_EOF或SEV_CONN_ERROR
+
+enum SEV_CONN_EVENT
+{
+    SEV_CONN_EOF = 0x1,   //对端关闭
+    SEV_CONN_ERROR = 0x2, //读写出错，errno里是错误码
+};
+
+//带收发缓冲区的tcp连接，只在所属base的loop线程里使用
+//输出缓冲区有数据时才关心可写；输入缓冲区达到read_high时停止读(反压)
+typedef struct sev_conn_
+{
+    sev_base *base;
+    sev_io_event *ev;
+    int fd;
+    int events;       //当前向epoll注册的SEV_IO_*，没变化时不调epoll_ctl
+    int reading;      //sev_conn_enable_read打开的读
+    int close_fd;     //释放时关闭fd
+    int in_cb;        //正在执行回调，回调里释放要推迟到回调返回后
+    int freed;
+    int over_high;    //输出缓冲区超过过write_high，降下来时通知写方
+    int edge;         //边沿触发，可读时一直读到读空或者read_high
+
+    sev_buf input;
+    sev_buf output;
+    size_t read_low;   //输入达到这么多字节才回调read_cb，0表示有数据就回调
+    size_t read_high;  //输入达到这么多字节就停止读，0表示不限制
+    size_t write_high; //输出超过这么多字节sev_conn_write返回1，降下来后回调write_cb，0表示发空时回调
+    size_t read_size;  //每次读给出的空间，一次读满就翻倍，直到read_max
+    size_t read_max;
+
+    conn_data_cb read_cb;
+    conn_data_cb write_cb;
+    conn_event_cb event_cb;
+    void *ctx;
+} sev_conn;
+
+//事件优先级，每轮loop按这个顺序执行，定时器固定是SEV_PRI_TIMER，sev_post的回调在所有类之前
+//每类可以设每轮的个数/时间预算，超出的留到下一轮，保证高优先级的事件不会被大量io拖住
+enum SEV_PRIORITY
+{
+    SEV_PRI_CONTROL = 0, //控制命令
+    SEV_PRI_TIMER,
+    SEV_PRI_IO,
+    SEV_PRI_BACKGROUND,
+    SEV_PRI_COUNT,
+};
+
 enum CUSTOM_EVENT
 {
     CUSTOM_STATUS1 = 0X1,
@@ -41,6 +186,7 @@ enum SEV_IO_EVENT
     SEV_IO_WRITEABLE = 0x2,
     SEV_IO_HANGUP = 0x4,
     SEV_IO_ERROR = 0x8,
+    SEV_IO_EDGE = 0x10, //边沿触发(EPOLLET)
 };
 
 typedef struct sev_custom_event_
@@ -53,17 +199,29 @@ typedef struct sev_custom_event_
     struct timeval *overtime;
     struct timeval _overtime;
 
-    struct timeval start;
+    unsigned long long start; //开始计时的单调时钟(ns)，超时或触发后重置
 
     int remove;
+    int registered; //是否在base的自定义事件数组里
 
     cus_event_handler handler;
+    struct sev_base_ *base; //add_cus_event时记录，active_cus_event用它唤醒loop
+
+    struct sev_base_ *owner; //同sev_io_event
+    unsigned int gen;
+    int pooled;
+
+    int priority; //SEV_PRIORITY，默认SEV_PRI_IO
 } sev_custom_event;
 
 sev_base *sev_new_base();
+//释放base上的所有资源和base本身，要在loop退出以后调用
 void sev_free_base(sev_base *base);
 void sev_loop(sev_base *base);
 void sev_stop(sev_base *base);
+void sev_wakeup(sev_base *base);
+int sev_post(sev_base *base, post_callback fn, void *arg);
+unsigned long long sev_now(sev_base *base);
 
 sev_custom_event *new_cus_event(int id, int event, int persist, cus_event_handler hd, void *ctx);
 int add_cus_event(sev_base *base, sev_custom_event *ev, struct timeval *overtime);
@@ -73,8 +231,66 @@ void free_cus_event(sev_custom_event *ev);
 
 sev_io_event *new_io_event(int fd, int event, int persist, io_event_handler hd, void *ctx);
 int add_io_event(sev_base *base, sev_io_event *ev);
+int mod_io_event(sev_base *base, sev_io_event *ev, int event);
 int remove_io_event(sev_base *base, int fd, int free);
 void free_io_event(sev_io_event *ev);
 
-int set_timer(sev_base *base, timer_callback tcb, timer_param_free_callback free_cb, void *param, struct timeval *overtime);
+void sev_io_set_priority(sev_io_event *ev, int pri);
+void sev_cus_set_priority(sev_custom_event *ev, int pri);
+int sev_set_budget(sev_base *base, int pri, int max_count, int max_us);
+
+sev_timer_id set_timer(sev_base *base, timer_callback tcb, timer_param_free_callback free_cb, void *param, struct timeval *overtime);
+int cancel_timer(sev_base *base, sev_timer_id id);
+
+//io_uring，编译时定义SEV_HAVE_URING才可用。操作在loop线程里提交，回调也在loop线程
+int sev_uring_enable(sev_base *base, unsigned int entries);
+int sev_uring_register_buffers(sev_base *base, struct iovec *iov, unsigned int n);
+int sev_uring_read(sev_base *base, int fd, void *buf, unsigned int len, uring_callback cb, void *ctx);
+int sev_uring_write(sev_base *base, int fd, const void *buf, unsigned int len, uring_callback cb, void *ctx);
+int sev_uring_read_fixed(sev_base *base, int fd, void *buf, unsigned int len, int buf_index, uring_callback cb, void *ctx);
+int sev_uring_write_fixed(sev_base *base, int fd, const void *buf, unsigned int len, int buf_index, uring_callback cb, void *ctx);
+int sev_uring_recvmsg(sev_base *base, int fd, struct msghdr *msg, int flags, uring_callback cb, void *ctx);
+int sev_uring_sendmsg(sev_base *base, int fd, const struct msghdr *msg, int flags, uring_callback cb, void *ctx);
+
+size_t sev_buf_len(sev_buf *buf);
+int sev_buf_add(sev_buf *buf, const void *data, size_t len);
+int sev_buf_add_ref(sev_buf *buf, const void *data, size_t len, sev_buf_free_cb free_cb, void *arg);
+int sev_buf_peek(sev_buf *buf, struct iovec *iov, int max);
+size_t sev_buf_remove(sev_buf *buf, void *data, size_t len);
+void sev_buf_drain(sev_buf *buf, size_t len);
+void sev_buf_clear(sev_buf *buf);
+
+sev_conn *sev_conn_new(sev_base *base, int fd, int close_fd);
+void sev_conn_free(sev_conn *conn);
+void sev_conn_set_cb(sev_conn *conn, conn_data_cb read_cb, conn_data_cb write_cb, conn_event_cb event_cb, void *ctx);
+void sev_conn_set_watermark(sev_conn *conn, size_t read_low, size_t read_high, size_t write_high);
+void sev_conn_enable_read(sev_conn *conn, int enable);
+void sev_conn_set_edge(sev_conn *conn, int enable);
+void sev_conn_set_read_size(sev_conn *conn, size_t read_size, size_t read_max);
+int sev_conn_write(sev_conn *conn, const void *data, size_t len);
+int sev_conn_write_ref(sev_conn *conn, const void *data, size_t len, sev_buf_free_cb free_cb, void *arg);
+
+//协程，跑在base的loop线程里，读写等不到时挂起、就绪后恢复，不阻塞线程
+typedef struct sev_co_ sev_co;
+
+int sev_co_spawn(sev_base *base, sev_co_fn fn, void *arg, size_t stack_size);
+sev_co *sev_co_self();
+ssize_t sev_co_read(int fd, void *buf, size_t len, int timeout_ms);
+ssize_t sev_co_write(int fd, const void *buf, size_t len, int timeout_ms);
+int sev_co_sleep(int ms);
+int sev_co_close(int fd);
+
+int sev_get_stats(sev_base *base, sev_stats *st);
+void sev_reset_stats(sev_base *base);
+void sev_dump_stats(sev_base *base);
+int sev_stats_dump_every(sev_base *base, int ms);
+void sev_hist_add(sev_hist *h, unsigned long long v);
+unsigned long long sev_hist_percentile(const sev_hist *h, double p);
 
+sev_pool *sev_new_pool(int count, int pin);
+int sev_pool_start(sev_pool *pool);
+sev_base *sev_pool_base(sev_pool *pool, int index);
+sev_base *sev_pool_next(sev_pool *pool);
+void sev_pool_wait(sev_pool *pool);
+void sev_pool_stop(sev_pool *pool);
+void sev_free_pool(sev_pool *pool);
@@ -1,27 +1,101 @@
-#include <map>
-#include <list>
+#include <vector>
+#include <algorithm>
+#include <time.h>
 #include "simple_event_macro.h"
 #include "simple_event.h"
+#include "simple_event_stats.h"
 
 using namespace std;
 
-typedef map<int, sev_custom_event *> cus_ev_list;
-typedef map<int, sev_io_event *> io_ev_list;
-typedef map<int, sev_custom_event *>::iterator cus_ev_itor;
-typedef map<int, sev_io_event *>::iterator io_ev_itor;
+//数组里记下加入时节点的代数。回调里释放了又马上new出来的事件可能拿到同一个节点，
+//旧的那一项代数对不上，直接跳过，压缩时去掉
+typedef struct cus_entry_{
+    sev_custom_event *ev;
+    unsigned int gen;
+}cus_entry;
+
+static inline bool _cus_entry_stale(const cus_entry &e)
+{
+    return e.ev->gen != e.gen;
+}
+
+//自定义事件放在连续数组里，按加入顺序执行。删除只打标记，下一轮开始时原地压缩
+typedef struct cus_ev_list_{
+    vector<cus_entry> events;
+    int removed;//打了删除标记还没压缩掉的个数
+}cus_ev_list;
+
+//io事件按fd下标直接索引，epoll_event.data.ptr直接指向事件本身
+//删除的事件先放进pending_remove，下一轮开始时统一从epoll里摘除
+typedef struct io_ev_list_{
+    vector<sev_io_event *> slots;
+    vector<sev_io_event *> pending_remove;
+}io_ev_list;
 
 typedef struct timer_{
-    struct timeval *overtime;
-    struct timeval _overtime;
-    struct timeval start;
+    unsigned long long deadline;//单调时钟的到期时间(ns)
+    int heap_idx;//在堆中的下标
+    unsigned int slot;//在slots中的下标，和gen一起组成对外的句柄
 
     void* param;
     timer_callback tcb;
     timer_param_free_callback free_cb;
 }timer;
 
-typedef list<timer*> timer_list;
-typedef list<timer*>::iterator timer_itor;
+#define SLAB_NODES 64 /*节点池每次向系统申请的节点数*/
+
+//定长节点池，节点按slab成批申请，回收的节点挂在free_nodes里复用，base释放时才整体还给系统
+//free_nodes的容量随slab一起预留，稳定以后取还节点都不会再分配内存
+template <typename T>
+struct node_pool
+{
+    vector<T *> slabs;
+    vector<T *> free_nodes;
+
+    T *get()
+    {
+        if (free_nodes.empty())
+        {
+            T *slab = (T *)calloc(SLAB_NODES, sizeof(T));
+            slabs.push_back(slab);
+            free_nodes.reserve(slabs.size() * SLAB_NODES);
+            for (int i = SLAB_NODES - 1; i >= 0; i--)
+            {
+                free_nodes.push_back(&slab[i]);
+            }
+        }
+        T *n = free_nodes.back();
+        free_nodes.pop_back();
+        return n;
+    }
+    void put(T *n)
+    {
+        free_nodes.push_back(n);
+    }
+    ~node_pool()
+    {
+        for (size_t i = 0; i < slabs.size(); i++)
+        {
+            free(slabs[i]);
+        }
+    }
+};
+
+//以到期时间为key的二叉小顶堆，插入/取消都是O(log n)
+//slots+gens用来把对外的句柄映射回定时器节点，定时器释放后gen自增，旧句柄自然失效
+typedef struct timer_heap_{
+    vector<timer*> heap;
+    vector<timer*> slots;
+    vector<unsigned int> gens;
+    vector<unsigned int> free_slots;
+    node_pool<timer> pool;
+}timer_heap;
+
+//io事件和自定义事件的节点池，每个base一份
+typedef struct event_pool_{
+    node_pool<sev_io_event> io;
+    node_pool<sev_custom_event> cus;
+}event_pool;
 
 extern "C"
 {
@@ -30,15 +104,25 @@ extern "C"
 
     int _add_io_event(void *ls, sev_io_event *ev);
     sev_io_event *_get_io_event(void *ls, int fd);
+    void _detach_io_event(void *ls, int fd);
     void _set_io_event_remove(void *ls, int fd, int free);
-    void _remove_io_event(void *ls, int (*epoll_remove_cb)(sev_base *base, int fd), sev_base *base);
+    void _remove_io_event(void *ls, int (*epoll_remove_cb)(sev_base *base, int fd), void (*free_cb)(sev_io_event *ev), sev_base *base);
+
+    sev_io_event *_pool_get_io(sev_base *base);
+    void _pool_put_io(sev_base *base, sev_io_event *ev);
+    sev_custom_event *_pool_get_cus(sev_base *base);
+    void _pool_put_cus(sev_base *base, sev_custom_event *ev);
 
     int _add_cus_event(void *ls, sev_custom_event *ev);
     void _remove_cus_event(void *ls, int event_id);
-    int _cus_event_loop(sev_base *base);
+    int _cus_event_loop(sev_base *base, int pri);
+    long long _cus_event_next_timeout(void *ls, unsigned long long now, long long poll_interval);
 
-    int _add_timer(void* ls, timer_callback tcb, timer_param_free_callback free_cb, void *param, struct timeval *overtime);
+    sev_timer_id _add_timer(void* ls, unsigned long long now, timer_callback tcb, timer_param_free_callback free_cb, void *param, struct timeval *overtime);
+    int _cancel_timer(void* ls, sev_timer_id id);
+    long long _timer_next_timeout(void* ls, unsigned long long now);
     int _timer_loop(sev_base *base);
+    int _budget_take(sev_base *base, int pri);
 
 }
 
@@ -51,7 +135,8 @@ void _make_list(sev_base *base)
 
     base->cus_event_list = (void *)new cus_ev_list;
     base->io_event_list = (void *)new io_ev_list;
-    base->timer_list  =(void*)new timer_list;
+    base->timer_list  =(void*)new timer_heap;
+    base->event_pool = (void *)new event_pool;
 }
 
 void _del_all_cus_event(void *ls);
@@ -70,24 +155,91 @@ void _clear_list(sev_base *base)
 
     delete (cus_ev_list *)base->cus_event_list;
     delete (io_ev_list *)base->io_event_list;
-    delete (timer_list *)base->timer_list;
+    delete (timer_heap *)base->timer_list;
+    delete (event_pool *)base->event_pool;
 
     base->cus_event_list = 0;
     base->io_event_list = 0;
     base->timer_list = 0;
+    base->event_pool = 0;
+}
+
+//从池里取出的节点除了owner和gen都清零
+sev_io_event *_pool_get_io(sev_base *base)
+{
+    sev_io_event *ev = ((event_pool *)base->event_pool)->io.get();
+    unsigned int gen = ev->gen;
+    memset(ev, 0, sizeof(sev_io_event));
+    ev->owner = base;
+    ev->gen = gen;
+    return ev;
+}
+
+//回收时gen加1，持有旧指针的人比较gen就知道事件已经被回收或复用了
+void _pool_put_io(sev_base *base, sev_io_event *ev)
+{
+    ev->gen++;
+    ev->pooled = 1;
+    ev->handler = nullptr;
+    ((event_pool *)base->event_pool)->io.put(ev);
+}
+
+sev_custom_event *_pool_get_cus(sev_base *base)
+{
+    sev_custom_event *ev = ((event_pool *)base->event_pool)->cus.get();
+    unsigned int gen = ev->gen;
+    memset(ev, 0, sizeof(sev_custom_event));
+    ev->owner = base;
+    ev->gen = gen;
+    return ev;
+}
+
+static void _mark_cus_event_remove(cus_ev_list *ev_list, sev_custom_event *ev);
+
+void _pool_put_cus(sev_base *base, sev_custom_event *ev)
+{
+    //还挂在这个base上就先打删除标记，让数组里旧的那一项在下一次压缩时去掉
+    if (ev->registered && ev->base == base)
+    {
+        _mark_cus_event_remove((cus_ev_list *)base->cus_event_list, ev);
+    }
+    ev->gen++;
+    ev->pooled = 1;
+    ev->handler = nullptr;
+    ((event_pool *)base->event_pool)->cus.put(ev);
 }
 
 int _add_cus_event(void *ls, sev_custom_event *ev)
 {
     cus_ev_list *ev_list = (cus_ev_list *)ls;
-    ev->remove = 0;//移除标志复位
-    if (ev_list == nullptr || ev_list->find(ev->event_id) != ev_list->end())
+    if (ev_list == nullptr)
     {
-        // LOG("list is null or ev is exist ev_list = 0x%p", ev_list);
         return -1;
     }
+    if (ev->registered)
+    {
+        //还在数组里，刚打了删除标记的撤销删除就相当于重新挂上；没打标记的是重复添加
+        if (!ev->remove)
+        {
+            return -1;
+        }
+        ev->remove = 0;
+        ev_list->removed--;
+        return 0;
+    }
+    for (size_t i = 0; i < ev_list->events.size(); i++)
+    {
+        sev_custom_event *e = ev_list->events[i].ev;
+        if (!_cus_entry_stale(ev_list->events[i]) && e->event_id == ev->event_id && !e->remove)
+        {
+            // LOG("ev is exist ev_list = 0x%p", ev_list);
+            return -1;
+        }
+    }
 
-    ev_list->insert(make_pair(ev->event_id, ev));
+    ev->remove = 0;
+    ev->registered = 1;
+    ev_list->events.push_back({ev, ev->gen});
 
     return 0;
 }
@@ -99,210 +251,412 @@ void _remove_cus_event(void *ls, int event_id)
         return;
     }
 
-    cus_ev_itor it = ev_list->find(event_id);
-    if (it != ev_list->end())
+    for (size_t i = 0; i < ev_list->events.size(); i++)
     {
-        it->second->remove = 1;
+        sev_custom_event *ev = ev_list->events[i].ev;
+        if (!_cus_entry_stale(ev_list->events[i]) && ev->event_id == event_id && !ev->remove)
+        {
+            ev->remove = 1;
+            ev_list->removed++;
+            return;
+        }
+    }
+}
+static void _mark_cus_event_remove(cus_ev_list *ev_list, sev_custom_event *ev)
+{
+    if (!ev->remove)
+    {
+        ev->remove = 1;
+        ev_list->removed++;
     }
 }
 void _del_all_cus_event(void *ls)
 {
     cus_ev_list *ev_list = (cus_ev_list *)ls;
-    ev_list->clear();
+    //数组里的事件这时候可能已经被调用者释放了，不能再碰
+    ev_list->events.clear();
+    ev_list->removed = 0;
+}
+
+static unsigned long long _tv_ns(struct timeval *tv)
+{
+    return (unsigned long long)tv->tv_sec * 1000000000ULL + (unsigned long long)tv->tv_usec * 1000ULL;
 }
 
-int _is_overtime(struct timeval *start, struct timeval *end, struct timeval *overtime)
+//从start开始过了overtime算超时，用的都是loop缓存的单调时钟，不受系统时间跳变影响
+static int _is_overtime(unsigned long long start, unsigned long long now, struct timeval *overtime)
 {
-    if ((end->tv_sec - start->tv_sec) > overtime->tv_sec)
+    return now > start && now - start > _tv_ns(overtime);
+}
+
+static bool _cus_event_removed(const cus_entry &e)
+{
+    if (_cus_entry_stale(e))
     {
-        return 1;
+        return true;//节点已经回收或者换了主人，不能再改它的标记
     }
-    if ((end->tv_sec - start->tv_sec) == overtime->tv_sec &&
-        (end->tv_usec - start->tv_usec) > overtime->tv_usec)
+    sev_custom_event *ev = e.ev;
+    if (ev->remove)
     {
-        return 1;
+        ev->remove = 0;//移除标志重置为0，因为事件是可以复用的
+        ev->registered = 0;
+        return true;
     }
-
-    return 0;
+    return false;
 }
 
-int _cus_event_loop(sev_base *base)
+//只执行优先级为pri的事件，预算用完了剩下的(状态还在)留到下一轮
+int _cus_event_loop(sev_base *base, int pri)
 {
     cus_ev_list *ev_list = (cus_ev_list *)base->cus_event_list;
-    // INTERVAL_LOG(2000,"cus event size = %ld", ev_list->size());
-    for (cus_ev_itor it = ev_list->begin(); it != ev_list->end();)
+    unsigned long long now = base->now;
+    // INTERVAL_LOG(2000,"cus event size = %ld", ev_list->events.size());
+    if (ev_list->removed)
     {
-        sev_custom_event *ev = it->second;
+        vector<cus_entry> &evs = ev_list->events;
+        evs.erase(remove_if(evs.begin(), evs.end(), _cus_event_removed), evs.end());
+        ev_list->removed = 0;
+    }
 
-        if (ev->remove)
+    //回调里新加的事件追加在数组末尾，本轮不执行；删除只打标记，所以不用拷贝整个数组
+    size_t count = ev_list->events.size();
+    for (size_t i = 0; i < count; ++i)
+    {
+        sev_custom_event *ev = ev_list->events[i].ev;
+        if (_cus_entry_stale(ev_list->events[i]) || ev->remove || ev->priority != pri)
         {
-            it = ev_list->erase(it);
-            ev->remove = 0;//移除标志重置为0，因为事件是可以复用的
             continue;
         }
-        else {++it;}
-    }
-
-    cus_ev_list ev_list_copy = *ev_list;
-    cus_ev_list* pev_list_copy = &ev_list_copy;
-
-    for (cus_ev_itor it = pev_list_copy->begin(); it != pev_list_copy->end(); ++it)
-    {
-        sev_custom_event *ev = it->second;
-        int trigger = ev->status & ev->listen;
-        struct timeval cur;
-        gettimeofday(&cur, NULL);
+        int trigger = __atomic_load_n(&ev->status, __ATOMIC_ACQUIRE) & ev->listen;
 
-        int is_overtime = ev->overtime == NULL ? 1 : _is_overtime(&ev->start, &cur, ev->overtime);
-        if (trigger || is_overtime) // 超时或者触发
+        int is_overtime = ev->overtime == NULL ? 1 : _is_overtime(ev->start, now, ev->overtime);
+        if ((trigger || is_overtime) && _budget_take(base, pri)) // 超时或者触发
         {
-            ev->start = cur; // 已经 超时或者触发，重置超时计时
-            ev->status = 0;  // 状态清零
+            ev->start = now; // 已经 超时或者触发，重置超时计时
+            //状态清零，其他线程可能同时在active_cus_event，用原子交换保证不丢状态
+            trigger = __atomic_exchange_n(&ev->status, 0, __ATOMIC_ACQ_REL) & ev->listen;
 
             if (!ev->persist) // 不是一个常驻的事件
             {
                 // LOG("rm cus ev");
-                _remove_cus_event(ev_list,ev->event_id);
+                _mark_cus_event_remove(ev_list, ev);
             }
-            ev->handler(ev->event_id, trigger, is_overtime, ev->ctx);
+            STATS_CALL(base, SEV_STATS_CUS, ev->handler, ev->handler(ev->event_id, trigger, is_overtime, ev->ctx));
         }
     }
     return 0;
 }
 
+//所有自定义事件里最近的一个超时还有多少ns，没有需要等待的事件返回-1
+//已经被激活的事件返回0；没有超时时间的事件每轮都要执行，按poll_interval轮询
+long long _cus_event_next_timeout(void *ls, unsigned long long now, long long poll_interval)
+{
+    cus_ev_list *ev_list = (cus_ev_list *)ls;
+    long long next = -1;
+
+    for (size_t i = 0; i < ev_list->events.size(); ++i)
+    {
+        sev_custom_event *ev = ev_list->events[i].ev;
+        if (_cus_entry_stale(ev_list->events[i]) || ev->remove)
+        {
+            continue;
+        }
+        if (__atomic_load_n(&ev->status, __ATOMIC_ACQUIRE) & ev->listen)
+        {
+            return 0;
+        }
+
+        long long remain = poll_interval;
+        if (ev->overtime)
+        {
+            long long elapsed = now > ev->start ? (long long)(now - ev->start) : 0;
+            long long total = (long long)_tv_ns(ev->overtime);
+            remain = total >= elapsed ? total - elapsed + 1 : 0;//超时判断是严格大于，多等1ns
+        }
+        if (next < 0 || remain < next)
+        {
+            next = remain;
+        }
+    }
+    return next;
+}
 
 int _add_io_event(void *ls, sev_io_event *ev)
 {
     io_ev_list *ev_list = (io_ev_list *)ls;
-    ev->remove = 0;//移除标志复位
-    if (ev_list == nullptr || ev_list->find(ev->fd) != ev_list->end())
+    if (ev_list == nullptr || ev->fd < 0)
     {
-        LOG("list is null or ev is exist. ev_list = 0x%p", ls);
+        LOG("list is null or fd is invalid. ev_list = 0x%p", ls);
+        return -1;
+    }
+    if ((size_t)ev->fd >= ev_list->slots.size())
+    {
+        ev_list->slots.resize(ev->fd + 1 > 64 ? (ev->fd + 1) * 2 : 64, nullptr);
+    }
+    if (ev_list->slots[ev->fd] != nullptr)
+    {
+        LOG("ev is exist. fd = %d", ev->fd);
         return -1;
     }
 
-    ev_list->insert(make_pair(ev->fd, ev));
+    ev->remove = 0;//移除标志复位
+    ev_list->slots[ev->fd] = ev;
 
     return 0;
 }
 sev_io_event *_get_io_event(void *ls, int fd)
 {
     io_ev_list *ev_list = (io_ev_list *)ls;
-    if (!ev_list)
+    if (!ev_list || fd < 0 || (size_t)fd >= ev_list->slots.size())
     {
         return nullptr;
     }
-    io_ev_itor it = ev_list->find(fd);
-    if (it != ev_list->end())
+
+    return ev_list->slots[fd];
+}
+
+//把fd对应的槽位立即腾出来(调用者已经从epoll中删除)，事件本身还在pending_remove里等统一释放
+void _detach_io_event(void *ls, int fd)
+{
+    io_ev_list *ev_list = (io_ev_list *)ls;
+    if (_get_io_event(ls, fd))
     {
-        return it->second;
+        ev_list->slots[fd] = nullptr;
     }
-
-    return nullptr;
 }
 
-void _remove_io_event(void *ls, int (*epoll_remove_cb)(sev_base *base, int fd), sev_base *base)
+void _remove_io_event(void *ls, int (*epoll_remove_cb)(sev_base *base, int fd), void (*free_cb)(sev_io_event *ev), sev_base *base)
 {
     io_ev_list *ev_list = (io_ev_list *)ls;
-    // INTERVAL_LOG(2000,"io event size = %ld", ev_list->size());
-    for (io_ev_itor it = ev_list->begin(); it != ev_list->end(); )
+    // INTERVAL_LOG(2000,"io event pending remove = %ld", ev_list->pending_remove.size());
+    for (size_t i = 0; i < ev_list->pending_remove.size(); i++)
     {
-        sev_io_event *ev = it->second;
-        if (ev->remove)
+        sev_io_event *ev = ev_list->pending_remove[i];
+        if (!ev->remove)
+        {
+            continue;//删除之后又被重新加回来了
+        }
+
+        if (ev_list->slots[ev->fd] == ev)
         {
             epoll_remove_cb(base, ev->fd);
-            it = ev_list->erase(it);
-            ev->remove = 0;//移除标志重置为0，因为事件是可以复用的
-            if (ev->free)
-            {
-                free(ev);
-            }
+            ev_list->slots[ev->fd] = nullptr;
         }
-        else
+        ev->remove = 0;//移除标志重置为0，因为事件是可以复用的
+        if (ev->free)
         {
-            ++it;
+            free_cb(ev);
         }
     }
+    ev_list->pending_remove.clear();//clear不释放容量，稳定后不再分配内存
 }
 
 void _set_io_event_remove(void *ls, int fd, int free)
 {
-    io_ev_list *ev_list = (io_ev_list *)ls;
-    if (!ev_list)
+    sev_io_event *ev = _get_io_event(ls, fd);
+    if (!ev)
     {
         return;
     }
-    io_ev_itor it = ev_list->find(fd);
-    if (it != ev_list->end())
+
+    ev->free = free;
+    if (!ev->remove)
     {
-        it->second->remove = 1;
-        it->second->free = free;
+        ev->remove = 1;
+        ((io_ev_list *)ls)->pending_remove.push_back(ev);
     }
 }
 void _del_all_io_event(void *ls)
 {
     io_ev_list *ev_list = (io_ev_list *)ls;
-    ev_list->clear();
+    ev_list->slots.clear();
+    ev_list->pending_remove.clear();
 }
 
-int _add_timer(void* ls, timer_callback tcb, timer_param_free_callback free_cb, void *param, struct timeval *overtime)
+static void _heap_swap(timer_heap *th, int a, int b)
 {
-    timer_list *tm_list = (timer_list *)ls;
+    timer *t = th->heap[a];
+    th->heap[a] = th->heap[b];
+    th->heap[b] = t;
+    th->heap[a]->heap_idx = a;
+    th->heap[b]->heap_idx = b;
+}
 
-    timer *tm = (timer *)calloc(1, sizeof(timer));
+static void _heap_up(timer_heap *th, int i)
+{
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (th->heap[parent]->deadline <= th->heap[i]->deadline)
+        {
+            break;
+        }
+        _heap_swap(th, i, parent);
+        i = parent;
+    }
+}
+
+static void _heap_down(timer_heap *th, int i)
+{
+    int n = (int)th->heap.size();
+    while (1)
+    {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < n && th->heap[l]->deadline < th->heap[min]->deadline)
+        {
+            min = l;
+        }
+        if (r < n && th->heap[r]->deadline < th->heap[min]->deadline)
+        {
+            min = r;
+        }
+        if (min == i)
+        {
+            break;
+        }
+        _heap_swap(th, i, min);
+        i = min;
+    }
+}
+
+//从堆中摘除并归还slot，不释放节点
+static void _heap_remove(timer_heap *th, timer *tm)
+{
+    int i = tm->heap_idx;
+    int last = (int)th->heap.size() - 1;
+    if (i != last)
+    {
+        _heap_swap(th, i, last);
+    }
+    th->heap.pop_back();
+    if (i != last)
+    {
+        _heap_down(th, i);
+        _heap_up(th, i);
+    }
+
+    th->slots[tm->slot] = nullptr;
+    th->gens[tm->slot]++;//旧句柄失效
+    th->free_slots.push_back(tm->slot);
+}
+
+static timer *_timer_from_id(timer_heap *th, sev_timer_id id)
+{
+    unsigned int slot = (unsigned int)(id & 0xffffffff);
+    unsigned int gen = (unsigned int)(id >> 32);
+    if (slot >= th->slots.size() || th->gens[slot] != gen)
+    {
+        return nullptr;
+    }
+    return th->slots[slot];
+}
+
+sev_timer_id _add_timer(void* ls, unsigned long long now, timer_callback tcb, timer_param_free_callback free_cb, void *param, struct timeval *overtime)
+{
+    timer_heap *th = (timer_heap *)ls;
+    if (!th || !overtime)
+    {
+        return 0;
+    }
+
+    timer *tm = th->pool.get();
+    memset(tm, 0, sizeof(timer));
     tm->tcb = tcb;
     tm->free_cb = free_cb;
     tm->param = param;
+    tm->deadline = now + _tv_ns(overtime);
 
-    memcpy(&tm->_overtime, overtime, sizeof(struct timeval));
-    tm->overtime = &tm->_overtime;
-    gettimeofday(&tm->start, NULL);
+    if (th->free_slots.empty())
+    {
+        tm->slot = (unsigned int)th->slots.size();
+        th->slots.push_back(tm);
+        th->gens.push_back(1);//gen从1开始，保证句柄不为0
+    }
+    else
+    {
+        tm->slot = th->free_slots.back();
+        th->free_slots.pop_back();
+        th->slots[tm->slot] = tm;
+    }
+
+    tm->heap_idx = (int)th->heap.size();
+    th->heap.push_back(tm);
+    _heap_up(th, tm->heap_idx);
 
-    tm_list->push_back(tm);
+    return ((sev_timer_id)th->gens[tm->slot] << 32) | tm->slot;
+}
+
+int _cancel_timer(void* ls, sev_timer_id id)
+{
+    timer_heap *th = (timer_heap *)ls;
+    timer *tm = th ? _timer_from_id(th, id) : nullptr;
+    if (!tm)
+    {
+        return -1;//已经触发过或者已经取消了
+    }
 
+    _heap_remove(th, tm);
+    if (tm->free_cb)
+    {
+        tm->free_cb(tm->param);
+    }
+    th->pool.put(tm);
     return 0;
 }
 
-int _timer_loop(sev_base *base)
+//距离最近一个定时器到期还有多少ns，没有定时器返回-1
+long long _timer_next_timeout(void* ls, unsigned long long now)
 {
-    timer_list* tm_list = (timer_list *)base->timer_list;
-    // INTERVAL_LOG(3000, "timer_size %d",tm_list->size());
-    for (timer_itor it = tm_list->begin(); it != tm_list->end();)
+    timer_heap *th = (timer_heap *)ls;
+    if (!th || th->heap.empty())
     {
-        timer* tm = *it;
+        return -1;
+    }
 
-        struct timeval cur;
-        gettimeofday(&cur, NULL);
+    unsigned long long deadline = th->heap[0]->deadline;
+    return deadline > now ? (long long)(deadline - now) : 0;
+}
+
+int _timer_loop(sev_base *base)
+{
+    timer_heap *th = (timer_heap *)base->timer_list;
+    // INTERVAL_LOG(3000, "timer_size %d",th->heap.size());
+    unsigned long long now = base->now;
+    //回调里新加的定时器到期时间不会早于now，所以本轮不会再被触发
+    while (!th->heap.empty() && th->heap[0]->deadline < now && _budget_take(base, SEV_PRI_TIMER))
+    {
+        timer* tm = th->heap[0];
+        _heap_remove(th, tm);
+        STATS_TIMER_LATE(base, now - tm->deadline);
 
-        int is_overtime = _is_overtime(&tm->start, &cur, tm->overtime);
-        if (is_overtime)
+        if (tm->tcb)
         {
-            if (tm->tcb)
-            {
-                tm->tcb(tm->param);
-            }
-            if (tm->free_cb)
-            {
-                tm->free_cb(tm->param);
-            }
-            
-            it = tm_list->erase(it);
-            free(tm);
+            STATS_CALL(base, SEV_STATS_TIMER, tm->tcb, tm->tcb(tm->param));
+        }
+        if (tm->free_cb)
+        {
+            tm->free_cb(tm->param);
         }
-        else {++it;}
+        th->pool.put(tm);
     }
     return 0;
 }
 
 void _del_all_timer(void *ls)
 {
-    timer_list* tm_list = (timer_list *)ls;
-    for (timer_itor it = tm_list->begin(); it != tm_list->end();++it)
+    timer_heap *th = (timer_heap *)ls;
+    for (size_t i = 0; i < th->heap.size(); ++i)
     {
-        timer* tm = *it;
-        tm->free_cb(tm->param);
-        free(tm);
+        timer* tm = th->heap[i];
+        if (tm->free_cb)
+        {
+            tm->free_cb(tm->param);
+        }
+        th->pool.put(tm);
     }
 
-    tm_list->clear();
-}
\ No newline at end of file
+    th->heap.clear();
+    th->slots.clear();
+    th->gens.clear();
+    th->free_slots.clear();
+}
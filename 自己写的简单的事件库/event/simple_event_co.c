@@ -0,0 +1,489 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "simple_event_macro.h"
+#include "simple_event.h"
+
+//协程：每个连接的逻辑可以顺序地写，读写等不到时挂起，fd就绪/超时后由loop恢复
+//所有协程都在base的loop线程里跑，只在loop的原生栈上(io/定时器/post回调里)恢复，不会嵌套
+//fd第一次被sev_co_read/sev_co_write用到时设成非阻塞并注册一个边沿触发的常驻io事件，sev_co_close时删除
+//读写总是先直接调系统调用，EAGAIN了才挂起，数据来得快时不用进epoll
+
+#define CO_STACK_SIZE (64 * 1024) //默认栈大小，只有这个大小的栈会回收到池里
+#define CO_STACK_POOL 256         //池里最多留多少个空闲栈
+
+#define CO_WAKE_TIMEOUT 0x100 //和SEV_IO_*一起放在wake里
+#define CO_WAKE_CLOSED 0x200
+
+struct sev_co_
+{
+    ucontext_t ctx;
+    sev_base *base;
+    sev_co_fn fn;
+    void *arg;
+    void *mem;        //mmap出来的整块内存，最低一页是保护页，sev_co放在最高处
+    size_t mem_size;
+    int pooled;       //默认大小的栈，结束后回收到池里
+    int done;
+    int wake;         //被什么唤醒的
+    sev_timer_id timer;
+    int wait_fd;      //挂在哪个fd上，-1表示没有
+    int wait_write;
+    struct sev_co_ *prev; //活着的协程链表，free_base时回收
+    struct sev_co_ *next;
+    struct sev_co_ *free_next;
+};
+
+//fd上等待的协程，读写各一个。分配之后直到free_base才释放，回调里拿着的指针不会失效
+typedef struct co_fd_
+{
+    sev_io_event *ev;
+    sev_co *reader;
+    sev_co *writer;
+} co_fd;
+
+typedef struct co_sched_
+{
+    ucontext_t main;
+    sev_co *live;
+    sev_co *free_stacks;
+    int free_count;
+    co_fd **fds;
+    int fd_cap;
+} co_sched;
+
+//spawn可能在其他线程调用，真正的创建post到loop线程里做
+typedef struct co_start_
+{
+    sev_base *base;
+    sev_co_fn fn;
+    void *arg;
+    size_t stack_size;
+} co_start;
+
+static __thread sev_co *_co_cur;
+
+static co_sched *_co_sched(sev_base *base)
+{
+    if (!base->co)
+    {
+        base->co = calloc(1, sizeof(co_sched));
+    }
+    return (co_sched *)base->co;
+}
+
+static sev_co *_co_alloc(co_sched *sched, size_t stack_size)
+{
+    if (stack_size == CO_STACK_SIZE && sched->free_stacks)
+    {
+        sev_co *co = sched->free_stacks;
+        sched->free_stacks = co->free_next;
+        sched->free_count--;
+        return co;
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = (stack_size + sizeof(sev_co) + page - 1) / page * page + page;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        LOG("co stack mmap ERROR. size = %zu", size);
+        return NULL;
+    }
+    mprotect(mem, page, PROT_NONE);//栈溢出时直接段错误，不会踩到别的内存
+
+    sev_co *co = (sev_co *)((char *)mem + size - sizeof(sev_co));
+    co->mem = mem;
+    co->mem_size = size;
+    co->pooled = stack_size == CO_STACK_SIZE;
+    return co;
+}
+
+static void _co_release(co_sched *sched, sev_co *co)
+{
+    if (co->pooled && sched->free_count < CO_STACK_POOL)
+    {
+        co->free_next = sched->free_stacks;
+        sched->free_stacks = co;
+        sched->free_count++;
+        return;
+    }
+    munmap(co->mem, co->mem_size);
+}
+
+static void _co_unlink(co_sched *sched, sev_co *co)
+{
+    co->prev ? (co->prev->next = co->next) : (sched->live = co->next);
+    co->next ? (co->next->prev = co->prev) : 0;
+}
+
+static void _co_entry()
+{
+    sev_co *co = _co_cur;
+    co->fn(co->arg);
+    co->done = 1;
+    setcontext(&_co_sched(co->base)->main);
+}
+
+//切到协程里跑，直到它挂起或结束。只能在loop的原生栈上调用
+static void _co_resume(sev_co *co, int wake)
+{
+    co_sched *sched = _co_sched(co->base);
+    co->wake = wake;
+    _co_cur = co;
+    swapcontext(&sched->main, &co->ctx);
+    _co_cur = NULL;
+
+    if (co->done)
+    {
+        _co_unlink(sched, co);
+        _co_release(sched, co);
+    }
+}
+
+//挂起当前协程，回到loop，返回唤醒原因
+static int _co_park()
+{
+    sev_co *co = _co_cur;
+    swapcontext(&co->ctx, &_co_sched(co->base)->main);
+    return co->wake;
+}
+
+static void _co_start_cb(void *arg)
+{
+    co_start *st = (co_start *)arg;
+    co_sched *sched = _co_sched(st->base);
+    sev_co *co = _co_alloc(sched, st->stack_size);
+    if (!co)
+    {
+        free(st);
+        return;
+    }
+
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = (char *)co->mem + sysconf(_SC_PAGESIZE);
+    co->ctx.uc_stack.ss_size = (char *)co - (char *)co->ctx.uc_stack.ss_sp;
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, _co_entry, 0);
+
+    co->base = st->base;
+    co->fn = st->fn;
+    co->arg = st->arg;
+    co->done = 0;
+    co->timer = 0;
+    co->wait_fd = -1;
+    co->prev = NULL;
+    co->next = sched->live;
+    sched->live ? (sched->live->prev = co) : 0;
+    sched->live = co;
+    free(st);
+
+    _co_resume(co, 0);
+}
+
+//创建一个协程，在base的下一轮loop开始时运行。stack_size为0用默认的64K，可以在任何线程调用
+int sev_co_spawn(sev_base *base, sev_co_fn fn, void *arg, size_t stack_size)
+{
+    co_start *st = (co_start *)malloc(sizeof(co_start));
+    st->base = base;
+    st->fn = fn;
+    st->arg = arg;
+    st->stack_size = stack_size ? stack_size : CO_STACK_SIZE;
+    if (sev_post(base, _co_start_cb, st) != 0)
+    {
+        free(st);
+        return -1;
+    }
+    return 0;
+}
+
+//当前正在跑的协程，不在协程里返回NULL
+sev_co *sev_co_self()
+{
+    return _co_cur;
+}
+
+static void _co_timer_cb(void *arg)
+{
+    sev_co *co = (sev_co *)arg;
+    co->timer = 0;
+    if (co->wait_fd >= 0)
+    {
+        co_fd *cf = _co_sched(co->base)->fds[co->wait_fd];
+        co->wait_write ? (cf->writer = NULL) : (cf->reader = NULL);
+        co->wait_fd = -1;
+    }
+    _co_resume(co, CO_WAKE_TIMEOUT);
+}
+
+static void _co_wake(sev_co *co, int status)
+{
+    co->wait_fd = -1;
+    if (co->timer)
+    {
+        cancel_timer(co->base, co->timer);
+        co->timer = 0;
+    }
+    _co_resume(co, status);
+}
+
+static void _co_io_cb(int fd, int status, void *ctx)
+{
+    co_fd *cf = (co_fd *)ctx;
+    if (cf->reader && (status & (SEV_IO_READABLE | SEV_IO_HANGUP | SEV_IO_ERROR)))
+    {
+        sev_co *co = cf->reader;
+        cf->reader = NULL;
+        _co_wake(co, status);
+    }
+    //读的协程可能已经把fd关了，cf还在，writer会在关的时候被清掉
+    if (cf->writer && (status & (SEV_IO_WRITEABLE | SEV_IO_HANGUP | SEV_IO_ERROR)))
+    {
+        sev_co *co = cf->writer;
+        cf->writer = NULL;
+        _co_wake(co, status);
+    }
+}
+
+static co_fd *_co_fd(co_sched *sched, sev_base *base, int fd)
+{
+    if (fd >= sched->fd_cap)
+    {
+        int cap = fd + 1 > 64 ? (fd + 1) * 2 : 64;
+        sched->fds = (co_fd **)realloc(sched->fds, cap * sizeof(co_fd *));
+        memset(sched->fds + sched->fd_cap, 0, (cap - sched->fd_cap) * sizeof(co_fd *));
+        sched->fd_cap = cap;
+    }
+    co_fd *cf = sched->fds[fd];
+    if (!cf)
+    {
+        cf = sched->fds[fd] = (co_fd *)calloc(1, sizeof(co_fd));
+    }
+    if (!cf->ev)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        sev_io_event *ev = new_io_event(fd, SEV_IO_READABLE | SEV_IO_WRITEABLE | SEV_IO_EDGE | SEV_IO_ERROR | SEV_IO_HANGUP, 1, _co_io_cb, cf);
+        if (add_io_event(base, ev) != 0)
+        {
+            free_io_event(ev);
+            errno = EEXIST;
+            return NULL;
+        }
+        cf->ev = ev;
+    }
+    return cf;
+}
+
+//在fd上等可读/可写，返回0就绪，-1超时(ETIMEDOUT)或者fd被关了(EBADF)
+static int _co_wait(co_fd *cf, int fd, int write, int timeout_ms)
+{
+    sev_co *co = _co_cur;
+    if (write ? cf->writer : cf->reader)
+    {
+        LOG("fd %d already has a %s coroutine", fd, write ? "writing" : "reading");
+        errno = EBUSY;
+        return -1;
+    }
+    if (timeout_ms == 0)
+    {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    write ? (cf->writer = co) : (cf->reader = co);
+    co->wait_fd = fd;
+    co->wait_write = write;
+    if (timeout_ms > 0)
+    {
+        struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        co->timer = set_timer(co->base, _co_timer_cb, 0, co, &tv);
+    }
+
+    int wake = _co_park();
+    if (wake & CO_WAKE_TIMEOUT)
+    {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (wake & CO_WAKE_CLOSED)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    return 0;
+}
+
+//不在协程里返回NULL；否则返回fd的等待记录，第一次用到时把fd设成非阻塞并注册io事件
+static co_fd *_co_enter(const char *fn, int fd)
+{
+    if (!_co_cur)
+    {
+        LOG("%s must be called in a coroutine", fn);
+        errno = EPERM;
+        return NULL;
+    }
+    return _co_fd(_co_sched(_co_cur->base), _co_cur->base, fd);
+}
+
+//和read一样：返回读到的字节数，0是对端关闭，-1出错或超时(errno为ETIMEDOUT)。timeout_ms<0一直等
+ssize_t sev_co_read(int fd, void *buf, size_t len, int timeout_ms)
+{
+    co_fd *cf = _co_enter(__func__, fd);
+    if (!cf)
+    {
+        return -1;
+    }
+    while (1)
+    {
+        ssize_t n = read(fd, buf, len);
+        if (n >= 0)
+        {
+            return n;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            return -1;
+        }
+        if (_co_wait(cf, fd, 0, timeout_ms) != 0)
+        {
+            return -1;
+        }
+    }
+}
+
+static ssize_t _co_send(int fd, const void *buf, size_t len)
+{
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOTSOCK)
+    {
+        n = write(fd, buf, len);//管道等非socket的fd
+    }
+    return n;
+}
+
+//写完len个字节才返回len，-1出错或超时(errno为ETIMEDOUT，已经写出去的部分不会撤回)
+ssize_t sev_co_write(int fd, const void *buf, size_t len, int timeout_ms)
+{
+    co_fd *cf = _co_enter(__func__, fd);
+    if (!cf)
+    {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = _co_send(fd, (const char *)buf + done, len - done);
+        if (n >= 0)
+        {
+            done += n;
+            continue;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            return -1;
+        }
+        if (_co_wait(cf, fd, 1, timeout_ms) != 0)
+        {
+            return -1;
+        }
+    }
+    return (ssize_t)len;
+}
+
+//挂起ms毫秒，期间loop照常跑别的事件
+int sev_co_sleep(int ms)
+{
+    if (!_co_cur)
+    {
+        LOG("%s must be called in a coroutine", __func__);
+        errno = EPERM;
+        return -1;
+    }
+    sev_co *co = _co_cur;
+    struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+    co->timer = set_timer(co->base, _co_timer_cb, 0, co, &tv);
+    if (!co->timer)
+    {
+        return -1;
+    }
+    _co_park();
+    return 0;
+}
+
+static void _co_closed_cb(void *arg)
+{
+    _co_resume((sev_co *)arg, CO_WAKE_CLOSED);
+}
+
+//删除fd的io事件并关闭fd，在这个fd上等着的其他协程返回-1(EBADF)。要在协程里调用，否则只是close
+int sev_co_close(int fd)
+{
+    sev_base *base = _co_cur ? _co_cur->base : NULL;
+    co_sched *sched = base ? _co_sched(base) : NULL;
+    co_fd *cf = sched && fd >= 0 && fd < sched->fd_cap ? sched->fds[fd] : NULL;
+    if (cf && cf->ev)
+    {
+        remove_io_event(base, fd, 1);
+        cf->ev = NULL;
+        sev_co *waiters[2] = {cf->reader, cf->writer};
+        cf->reader = cf->writer = NULL;
+        for (int i = 0; i < 2; i++)
+        {
+            if (waiters[i])
+            {
+                waiters[i]->wait_fd = -1;
+                if (waiters[i]->timer)
+                {
+                    cancel_timer(base, waiters[i]->timer);
+                    waiters[i]->timer = 0;
+                }
+                sev_post(base, _co_closed_cb, waiters[i]);//不能在协程里直接切到另一个协程
+            }
+        }
+    }
+    return close(fd);
+}
+
+//sev_free_base时调用，还挂着的协程直接丢掉(栈上的资源不会被释放)
+void _co_free(sev_base *base)
+{
+    co_sched *sched = (co_sched *)base->co;
+    if (!sched)
+    {
+        return;
+    }
+    while (sched->live)
+    {
+        sev_co *co = sched->live;
+        sched->live = co->next;
+        munmap(co->mem, co->mem_size);
+    }
+    while (sched->free_stacks)
+    {
+        sev_co *co = sched->free_stacks;
+        sched->free_stacks = co->free_next;
+        munmap(co->mem, co->mem_size);
+    }
+    for (int i = 0; i < sched->fd_cap; i++)
+    {
+        free(sched->fds[i]);
+    }
+    free(sched->fds);
+    free(sched);
+    base->co = NULL;
+}
@@ -0,0 +1,626 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "simple_event_macro.h"
+#include "simple_event.h"
+
+//sev_buf：链式缓冲区。sev_conn：在sev_io_event上加收发缓冲区、水位和反压
+//输出缓冲区有数据时才关心可写，写空了就关掉，不会每轮都被可写唤醒
+
+#define CHUNK_SIZE (16 * 1024)
+#define MAX_WRITE_IOV 64
+#define MAX_READ_PER_EVENT 16 //水平触发时一次可读事件最多读几次，避免一个连接占住loop
+
+typedef struct buf_chunk_
+{
+    struct buf_chunk_ *next;
+    char *data;
+    size_t off; //第一个未读字节
+    size_t len; //有效数据的结尾
+    size_t cap; //0表示引用块，不能再往里追加
+    sev_buf_free_cb free_cb;
+    void *arg;
+    char mem[];
+} buf_chunk;
+
+static buf_chunk *_chunk_new(sev_buf *buf, size_t cap)
+{
+    buf_chunk *c;
+    if (cap <= CHUNK_SIZE && buf->spare)
+    {
+        c = (buf_chunk *)buf->spare;
+        buf->spare = NULL;
+    }
+    else
+    {
+        cap = cap < CHUNK_SIZE ? CHUNK_SIZE : cap;
+        c = (buf_chunk *)malloc(sizeof(buf_chunk) + cap);
+        if (!c)
+        {
+            return NULL;
+        }
+        c->cap = cap;
+    }
+    c->next = NULL;
+    c->data = c->mem;
+    c->off = c->len = 0;
+    c->free_cb = NULL;
+    c->arg = NULL;
+    return c;
+}
+
+static void _chunk_free(sev_buf *buf, buf_chunk *c)
+{
+    if (!c->cap)
+    {
+        if (c->free_cb)
+        {
+            c->free_cb(c->data, c->arg);
+        }
+        free(c);
+        return;
+    }
+    //留一个标准大小的块下次用
+    if (c->cap == CHUNK_SIZE && !buf->spare)
+    {
+        buf->spare = c;
+        return;
+    }
+    free(c);
+}
+
+static void _chunk_link(sev_buf *buf, buf_chunk *c)
+{
+    if (buf->tail)
+    {
+        ((buf_chunk *)buf->tail)->next = c;
+    }
+    else
+    {
+        buf->head = c;
+    }
+    buf->tail = c;
+    buf->len += c->len - c->off;
+}
+
+size_t sev_buf_len(sev_buf *buf)
+{
+    return buf->len;
+}
+
+//拷贝追加，先填满最后一块的剩余空间
+int sev_buf_add(sev_buf *buf, const void *data, size_t len)
+{
+    const char *p = (const char *)data;
+    buf_chunk *tail = (buf_chunk *)buf->tail;
+    if (tail && tail->cap > tail->len)
+    {
+        size_t n = tail->cap - tail->len < len ? tail->cap - tail->len : len;
+        memcpy(tail->data + tail->len, p, n);
+        tail->len += n;
+        buf->len += n;
+        p += n;
+        len -= n;
+    }
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    buf_chunk *c = _chunk_new(buf, len);
+    if (!c)
+    {
+        return -1;
+    }
+    memcpy(c->data, p, len);
+    c->len = len;
+    _chunk_link(buf, c);
+    return 0;
+}
+
+//不拷贝，直接引用data，数据发完或缓冲区清空时调用free_cb(data, arg)
+int sev_buf_add_ref(sev_buf *buf, const void *data, size_t len, sev_buf_free_cb free_cb, void *arg)
+{
+    buf_chunk *c = (buf_chunk *)malloc(sizeof(buf_chunk));
+    if (!c)
+    {
+        return -1;
+    }
+    c->next = NULL;
+    c->data = (char *)data;
+    c->off = 0;
+    c->len = len;
+    c->cap = 0;
+    c->free_cb = free_cb;
+    c->arg = arg;
+    _chunk_link(buf, c);
+    return 0;
+}
+
+//取队头最多max段数据的位置，不出队，返回段数
+int sev_buf_peek(sev_buf *buf, struct iovec *iov, int max)
+{
+    int n = 0;
+    for (buf_chunk *c = (buf_chunk *)buf->head; c && n < max; c = c->next)
+    {
+        if (c->len == c->off)
+        {
+            continue;
+        }
+        iov[n].iov_base = c->data + c->off;
+        iov[n].iov_len = c->len - c->off;
+        n++;
+    }
+    return n;
+}
+
+//丢掉队头len个字节，用完的块释放
+void sev_buf_drain(sev_buf *buf, size_t len)
+{
+    len = len < buf->len ? len : buf->len;
+    buf->len -= len;
+    while (buf->head)
+    {
+        buf_chunk *c = (buf_chunk *)buf->head;
+        size_t n = c->len - c->off;
+        if (len < n)
+        {
+            c->off += len;
+            return;
+        }
+        len -= n;
+        //最后一块还能追加，读空了只重置
+        if (c == buf->tail && c->cap)
+        {
+            c->off = c->len = 0;
+            return;
+        }
+        buf->head = c->next;
+        if (!buf->head)
+        {
+            buf->tail = NULL;
+        }
+        _chunk_free(buf, c);
+    }
+}
+
+//拷贝出最多len个字节并出队，返回拷贝的字节数
+size_t sev_buf_remove(sev_buf *buf, void *data, size_t len)
+{
+    char *p = (char *)data;
+    size_t done = 0;
+    for (buf_chunk *c = (buf_chunk *)buf->head; c && done < len; c = c->next)
+    {
+        size_t n = c->len - c->off;
+        n = n < len - done ? n : len - done;
+        memcpy(p + done, c->data + c->off, n);
+        done += n;
+    }
+    sev_buf_drain(buf, done);
+    return done;
+}
+
+void sev_buf_clear(sev_buf *buf)
+{
+    buf_chunk *c = (buf_chunk *)buf->head;
+    while (c)
+    {
+        buf_chunk *next = c->next;
+        if (c->cap)
+        {
+            free(c);
+        }
+        else
+        {
+            _chunk_free(buf, c);
+        }
+        c = next;
+    }
+    free(buf->spare);
+    memset(buf, 0, sizeof(sev_buf));
+}
+
+//读到最后一块的剩余空间里，不够size时再加一个size大小的新块，新块没用上就释放(标准大小的留着下次用)
+static ssize_t _buf_read(sev_buf *buf, int fd, size_t size, size_t *want)
+{
+    struct iovec iov[2];
+    int cnt = 0;
+    buf_chunk *tail = (buf_chunk *)buf->tail;
+    if (tail && tail->cap > tail->len)
+    {
+        iov[cnt].iov_base = tail->data + tail->len;
+        iov[cnt].iov_len = tail->cap - tail->len;
+        cnt++;
+    }
+    int in_tail = cnt;
+    buf_chunk *c = NULL;
+    if (cnt == 0 || iov[0].iov_len < size)
+    {
+        c = _chunk_new(buf, size);
+        if (!c)
+        {
+            return -1;
+        }
+        iov[cnt].iov_base = c->data;
+        iov[cnt].iov_len = c->cap;
+        cnt++;
+    }
+
+    *want = iov[0].iov_len + (cnt > 1 ? iov[1].iov_len : 0);
+    ssize_t ret = readv(fd, iov, cnt);
+    if (ret <= 0)
+    {
+        if (c)
+        {
+            _chunk_free(buf, c);
+        }
+        return ret;
+    }
+
+    size_t left = (size_t)ret;
+    if (in_tail)
+    {
+        size_t n = iov[0].iov_len < left ? iov[0].iov_len : left;
+        tail->len += n;
+        buf->len += n;
+        left -= n;
+    }
+    if (c && left)
+    {
+        c->len = left;
+        _chunk_link(buf, c);
+    }
+    else if (c)
+    {
+        _chunk_free(buf, c);
+    }
+    return ret;
+}
+
+static void _conn_destroy(sev_conn *conn)
+{
+    remove_io_event(conn->base, conn->fd, 1);
+    if (conn->close_fd)
+    {
+        close(conn->fd);
+    }
+    sev_buf_clear(&conn->input);
+    sev_buf_clear(&conn->output);
+    free(conn);
+}
+
+//按缓冲区状态算出要关心的事件，有变化才调epoll_ctl
+static void _conn_update(sev_conn *conn)
+{
+    int events = SEV_IO_ERROR | (conn->edge ? SEV_IO_EDGE : 0);
+    if (conn->reading && (!conn->read_high || conn->input.len < conn->read_high))
+    {
+        events |= SEV_IO_READABLE;
+    }
+    if (conn->output.len)
+    {
+        events |= SEV_IO_WRITEABLE;
+    }
+    if (events != conn->events)
+    {
+        conn->events = events;
+        mod_io_event(conn->base, conn->ev, events);
+    }
+}
+
+//把输出缓冲区尽量写到socket，返回-1表示出错
+static int _conn_flush(sev_conn *conn)
+{
+    while (conn->output.len)
+    {
+        struct iovec iov[MAX_WRITE_IOV];
+        int cnt = sev_buf_peek(&conn->output, iov, MAX_WRITE_IOV);
+        size_t want = 0;
+        for (int i = 0; i < cnt; i++)
+        {
+            want += iov[i].iov_len;
+        }
+
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        ssize_t ret = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        sev_buf_drain(&conn->output, ret);
+        if ((size_t)ret < want)
+        {
+            break;//socket发送缓冲区满了
+        }
+    }
+    return 0;
+}
+
+static void _conn_event(sev_conn *conn, int what)
+{
+    if (conn->event_cb)
+    {
+        conn->event_cb(conn, what, conn->ctx);
+    }
+    else
+    {
+        sev_conn_free(conn);
+    }
+}
+
+//返回1表示连接在回调里被释放了
+//每一轮最多读MAX_READ_PER_EVENT次再回调read_cb。边沿触发时没读空不会再有新的事件，要一轮一轮读到读空；
+//停在read_high并且上层没取走数据时会关掉可读，恢复读时EPOLL_CTL_MOD会重新报告
+static int _conn_do_read(sev_conn *conn)
+{
+    int drained;
+    do
+    {
+        drained = 0;
+        for (int i = 0; i < MAX_READ_PER_EVENT; i++)
+        {
+            if (conn->read_high && conn->input.len >= conn->read_high)
+            {
+                break;
+            }
+            size_t want = 0;
+            ssize_t ret = _buf_read(&conn->input, conn->fd, conn->read_size, &want);
+            if (ret == 0)
+            {
+                //先把剩下的数据交给上层再通知关闭
+                if (conn->input.len && conn->read_cb)
+                {
+                    conn->read_cb(conn, conn->ctx);
+                }
+                if (!conn->freed)
+                {
+                    _conn_event(conn, SEV_CONN_EOF);
+                }
+                if (!conn->freed)
+                {
+                    //对端只关了写方向，这边不再读，还可以继续发
+                    conn->reading = 0;
+                    _conn_update(conn);
+                }
+                return 1;
+            }
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    drained = 1;
+                    break;
+                }
+                _conn_event(conn, SEV_CONN_ERROR);
+                return 1;
+            }
+            if ((size_t)ret < want)
+            {
+                //内核缓冲区已经读空。边沿触发时对端可能已经关了，关闭不会再来新的事件，要读到EAGAIN或者0
+                if (!conn->edge)
+                {
+                    drained = 1;
+                    break;
+                }
+                continue;
+            }
+            //给的空间被读满，说明还有数据，下次一次多读一些
+            if (conn->read_size < conn->read_max)
+            {
+                conn->read_size = conn->read_size * 2 < conn->read_max ? conn->read_size * 2 : conn->read_max;
+            }
+        }
+
+        if (conn->input.len && conn->input.len >= conn->read_low && conn->read_cb)
+        {
+            conn->read_cb(conn, conn->ctx);
+        }
+        if (conn->freed)
+        {
+            return 1;
+        }
+    } while (conn->edge && !drained && conn->reading && (!conn->read_high || conn->input.len < conn->read_high));
+    return 0;
+}
+
+//返回1表示连接在回调里被释放了
+static int _conn_do_write(sev_conn *conn)
+{
+    if (_conn_flush(conn) != 0)
+    {
+        _conn_event(conn, SEV_CONN_ERROR);
+        return 1;
+    }
+
+    //降到高水位以下通知写方继续写；没设高水位时写空了通知
+    int notify = 0;
+    if (conn->write_high)
+    {
+        if (conn->over_high && conn->output.len < conn->write_high)
+        {
+            conn->over_high = 0;
+            notify = 1;
+        }
+    }
+    else
+    {
+        notify = conn->output.len == 0;
+    }
+    if (notify && conn->write_cb)
+    {
+        conn->write_cb(conn, conn->ctx);
+    }
+    return conn->freed;
+}
+
+static void _conn_handler(int fd, int what, void *arg)
+{
+    sev_conn *conn = (sev_conn *)arg;
+    conn->in_cb++;
+
+    if (what & SEV_IO_READABLE)
+    {
+        if (_conn_do_read(conn))
+        {
+            goto out;
+        }
+    }
+    if (what & SEV_IO_WRITEABLE)
+    {
+        if (_conn_do_write(conn))
+        {
+            goto out;
+        }
+    }
+    if ((what & (SEV_IO_ERROR | SEV_IO_HANGUP)) && !(what & SEV_IO_READABLE))
+    {
+        _conn_event(conn, what & SEV_IO_ERROR ? SEV_CONN_ERROR : SEV_CONN_EOF);
+        goto out;
+    }
+    _conn_update(conn);
+
+out:
+    conn->in_cb--;
+    if (conn->freed && !conn->in_cb)
+    {
+        _conn_destroy(conn);
+    }
+}
+
+//fd设成非阻塞，默认开始读。close_fd为1时sev_conn_free会关掉fd
+sev_conn *sev_conn_new(sev_base *base, int fd, int close_fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    sev_conn *conn = (sev_conn *)calloc(1, sizeof(sev_conn));
+    conn->base = base;
+    conn->fd = fd;
+    conn->close_fd = close_fd;
+    conn->reading = 1;
+    conn->events = SEV_IO_READABLE | SEV_IO_ERROR;
+    conn->read_size = CHUNK_SIZE;
+    conn->read_max = CHUNK_SIZE;
+
+    conn->ev = new_io_event(fd, conn->events, 1, _conn_handler, conn);
+    if (add_io_event(base, conn->ev) != 0)
+    {
+        free_io_event(conn->ev);
+        free(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+//可以在连接自己的回调里调用，回调返回后才真正释放。没发完的数据直接丢掉
+void sev_conn_free(sev_conn *conn)
+{
+    if (conn->freed)
+    {
+        return;
+    }
+    conn->freed = 1;
+    if (!conn->in_cb)
+    {
+        _conn_destroy(conn);
+    }
+}
+
+void sev_conn_set_cb(sev_conn *conn, conn_data_cb read_cb, conn_data_cb write_cb, conn_event_cb event_cb, void *ctx)
+{
+    conn->read_cb = read_cb;
+    conn->write_cb = write_cb;
+    conn->event_cb = event_cb;
+    conn->ctx = ctx;
+}
+
+void sev_conn_set_watermark(sev_conn *conn, size_t read_low, size_t read_high, size_t write_high)
+{
+    conn->read_low = read_low;
+    conn->read_high = read_high;
+    conn->write_high = write_high;
+    _conn_update(conn);
+}
+
+//打开或暂停读。在回调外面从input取走数据后也要调一次，低于read_high时才会恢复读
+void sev_conn_enable_read(sev_conn *conn, int enable)
+{
+    conn->reading = enable;
+    _conn_update(conn);
+}
+
+//边沿触发(EPOLLET)：一次可读事件一直读到读空，中间每MAX_READ_PER_EVENT次回调一次read_cb，适合少量大流量连接
+void sev_conn_set_edge(sev_conn *conn, int enable)
+{
+    conn->edge = enable;
+    _conn_update(conn);
+}
+
+//每次读至少给出read_size字节的空间，一次读满就翻倍，最多到read_max。默认都是CHUNK_SIZE
+void sev_conn_set_read_size(sev_conn *conn, size_t read_size, size_t read_max)
+{
+    conn->read_size = read_size ? read_size : CHUNK_SIZE;
+    conn->read_max = read_max > conn->read_size ? read_max : conn->read_size;
+}
+
+//输出缓冲区原来是空的就先直接写一次，写不完的才等可写
+static int _conn_after_append(sev_conn *conn, size_t before)
+{
+    if (before == 0 && _conn_flush(conn) != 0)
+    {
+        return -1;//错误等epoll报SEV_IO_ERROR时再通知
+    }
+    _conn_update(conn);
+    if (conn->write_high && conn->output.len >= conn->write_high)
+    {
+        conn->over_high = 1;
+        return 1;
+    }
+    return 0;
+}
+
+//返回0成功，1表示输出缓冲区超过了write_high，应该等write_cb再写，-1出错
+int sev_conn_write(sev_conn *conn, const void *data, size_t len)
+{
+    if (conn->freed)
+    {
+        return -1;
+    }
+    size_t before = conn->output.len;
+    if (sev_buf_add(&conn->output, data, len) != 0)
+    {
+        return -1;
+    }
+    return _conn_after_append(conn, before);
+}
+
+//不拷贝data，发完后调用free_cb(data, arg)，返回值同sev_conn_write
+int sev_conn_write_ref(sev_conn *conn, const void *data, size_t len, sev_buf_free_cb free_cb, void *arg)
+{
+    if (conn->freed)
+    {
+        return -1;
+    }
+    size_t before = conn->output.len;
+    if (sev_buf_add_ref(&conn->output, data, len, free_cb, arg) != 0)
+    {
+        return -1;
+    }
+    return _conn_after_append(conn, before);
+}
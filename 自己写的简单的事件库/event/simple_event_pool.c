@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "simple_event_macro.h"
+#include "simple_event.h"
+
+//多个sev_base各跑在一个线程上，线程可以绑到不同的cpu
+//连接要么每个reactor各自监听(SO_REUSEPORT)，要么由一个线程accept后用sev_pool_next轮询分给各个reactor
+
+typedef struct pool_thread_
+{
+    sev_pool *pool;
+    int index;
+    pthread_t tid;
+} pool_thread;
+
+sev_pool *sev_new_pool(int count, int pin)
+{
+    if (count <= 0)
+    {
+        count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        count = count > 0 ? count : 1;
+    }
+
+    sev_pool *pool = (sev_pool *)calloc(1, sizeof(sev_pool));
+    pool->count = count;
+    pool->pin = pin;
+    pool->bases = (sev_base **)calloc(count, sizeof(sev_base *));
+    pool->threads = calloc(count, sizeof(pool_thread));
+
+    for (int i = 0; i < count; i++)
+    {
+        pool->bases[i] = sev_new_base();
+    }
+    return pool;
+}
+
+static void *_pool_thread_func(void *arg)
+{
+    pool_thread *pt = (pool_thread *)arg;
+    sev_pool *pool = pt->pool;
+
+    if (pool->pin)
+    {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(pt->index % (ncpu > 0 ? ncpu : 1), &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        {
+            LOG("reactor %d pin cpu failed", pt->index);
+        }
+    }
+
+    sev_loop(pool->bases[pt->index]);
+    return NULL;
+}
+
+//启动所有reactor线程。启动前可以在主线程里往各个base上加事件
+int sev_pool_start(sev_pool *pool)
+{
+    pool_thread *pts = (pool_thread *)pool->threads;
+    for (int i = 0; i < pool->count; i++)
+    {
+        pts[i].pool = pool;
+        pts[i].index = i;
+        if (pthread_create(&pts[i].tid, NULL, _pool_thread_func, &pts[i]) != 0)
+        {
+            LOG("create reactor %d failed", i);
+            for (int k = 0; k < i; k++)
+            {
+                sev_stop(pool->bases[k]);
+                pthread_join(pts[k].tid, NULL);
+            }
+            return -1;
+        }
+    }
+    pool->running = 1;
+    return 0;
+}
+
+sev_base *sev_pool_base(sev_pool *pool, int index)
+{
+    if (index < 0 || index >= pool->count)
+    {
+        return NULL;
+    }
+    return pool->bases[index];
+}
+
+//轮询取下一个reactor，用于把accept到的连接分出去，线程安全
+sev_base *sev_pool_next(sev_pool *pool)
+{
+    unsigned int n = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    return pool->bases[n % pool->count];
+}
+
+//等所有reactor线程退出
+void sev_pool_wait(sev_pool *pool)
+{
+    pool_thread *pts = (pool_thread *)pool->threads;
+    if (!pool->running)
+    {
+        return;
+    }
+    for (int i = 0; i < pool->count; i++)
+    {
+        pthread_join(pts[i].tid, NULL);
+    }
+    pool->running = 0;
+}
+
+//通知所有reactor退出并等待，可以在任意线程调用(reactor线程自己除外)
+void sev_pool_stop(sev_pool *pool)
+{
+    for (int i = 0; i < pool->count; i++)
+    {
+        sev_stop(pool->bases[i]);
+    }
+    sev_pool_wait(pool);
+}
+
+void sev_free_pool(sev_pool *pool)
+{
+    sev_pool_stop(pool);
+    for (int i = 0; i < pool->count; i++)
+    {
+        sev_free_base(pool->bases[i]);//base本身也在里面释放
+    }
+    free(pool->bases);
+    free(pool->threads);
+    free(pool);
+}
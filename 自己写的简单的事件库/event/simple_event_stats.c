@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "simple_event_macro.h"
+#include "simple_event.h"
+#include "simple_event_stats.h"
+
+//loop的统计：各类回调和每个回调函数的耗时直方图、epoll_wait等待/忙碌时间、定时器延迟、每次就绪的fd数
+//编译时定义SEV_STATS才会统计，否则sev_get_stats返回-1
+
+//直方图按2的幂分段，每段再线性分4格(HDR风格，误差25%以内)
+//v<4时下标就是v，否则下标 = (最高位-1)*4 + 最高位下面两位
+static int _hist_index(unsigned long long v)
+{
+    if (v < SEV_HIST_SUB)
+    {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int sub = (int)((v >> (msb - 2)) & (SEV_HIST_SUB - 1));
+    return (msb - 1) * SEV_HIST_SUB + sub;
+}
+
+//下标对应的区间上界
+static unsigned long long _hist_upper(int idx)
+{
+    if (idx < SEV_HIST_SUB)
+    {
+        return (unsigned long long)idx;
+    }
+    int msb = idx / SEV_HIST_SUB + 1;
+    int sub = idx % SEV_HIST_SUB;
+    unsigned long long step = 1ULL << (msb - 2);
+    return ((unsigned long long)(SEV_HIST_SUB + sub) << (msb - 2)) + step - 1;
+}
+
+//记一个样本
+void sev_hist_add(sev_hist *h, unsigned long long v)
+{
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+    {
+        h->max = v;
+    }
+    h->buckets[_hist_index(v)]++;
+}
+
+//取第p个百分位(0~100)，返回所在区间的上界
+unsigned long long sev_hist_percentile(const sev_hist *h, double p)
+{
+    if (!h->count)
+    {
+        return 0;
+    }
+    unsigned long long target = (unsigned long long)(h->count * p / 100.0);
+    target = target ? target : 1;
+    unsigned long long acc = 0;
+    for (int i = 0; i < SEV_HIST_BUCKETS; i++)
+    {
+        acc += h->buckets[i];
+        if (acc >= target)
+        {
+            unsigned long long up = _hist_upper(i);
+            return up < h->max ? up : h->max;
+        }
+    }
+    return h->max;
+}
+
+#ifdef SEV_STATS
+
+typedef struct stats_ctx_
+{
+    sev_stats st;
+    unsigned long long turn_start; //上一轮开始的时间
+    unsigned long long turn_wait;  //上一轮里等待的时间
+    sev_timer_id dump_timer;
+    struct timeval dump_interval;
+} stats_ctx;
+
+unsigned long long _stats_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static stats_ctx *_stats(sev_base *base)
+{
+    if (!base->stats)
+    {
+        base->stats = calloc(1, sizeof(stats_ctx));
+    }
+    return (stats_ctx *)base->stats;
+}
+
+//按函数指针找统计项，开放寻址，表满了只记到种类里
+static sev_handler_stats *_find_handler(sev_stats *st, void *fn, int kind)
+{
+    unsigned int h = (unsigned int)(((unsigned long)fn >> 4) * 2654435761u) % SEV_STATS_HANDLERS;
+    for (int i = 0; i < SEV_STATS_HANDLERS; i++)
+    {
+        sev_handler_stats *hs = &st->handlers[(h + i) % SEV_STATS_HANDLERS];
+        if (hs->fn == fn)
+        {
+            return hs;
+        }
+        if (!hs->fn)
+        {
+            hs->fn = fn;
+            hs->kind = kind;
+            st->handler_count++;
+            return hs;
+        }
+    }
+    return NULL;
+}
+
+void _stats_handler(sev_base *base, int kind, void *fn, unsigned long long start)
+{
+    unsigned long long ns = _stats_clock() - start;
+    sev_stats *st = &_stats(base)->st;
+    sev_hist_add(&st->kind_lat[kind], ns);
+
+    sev_handler_stats *hs = _find_handler(st, fn, kind);
+    if (hs)
+    {
+        sev_hist_add(&hs->lat, ns);
+    }
+}
+
+void _stats_timer_late(sev_base *base, unsigned long long late)
+{
+    sev_hist_add(&_stats(base)->st.timer_late, late);
+}
+
+void _stats_wait(sev_base *base, unsigned long long before, int nfds)
+{
+    stats_ctx *sc = _stats(base);
+    unsigned long long wait = _stats_clock() - before;
+    sc->st.wait_ns += wait;
+    sc->turn_wait += wait;
+    sev_hist_add(&sc->st.ready_batch, nfds > 0 ? (unsigned long long)nfds : 0);
+}
+
+//每轮开始时调用，上一轮除了等待以外的时间都算忙碌
+void _stats_turn(sev_base *base)
+{
+    stats_ctx *sc = _stats(base);
+    unsigned long long now = _stats_clock();
+    if (sc->turn_start)
+    {
+        unsigned long long total = now - sc->turn_start;
+        sc->st.busy_ns += total > sc->turn_wait ? total - sc->turn_wait : 0;
+    }
+    sc->st.loops++;
+    sc->turn_start = now;
+    sc->turn_wait = 0;
+}
+
+//取统计快照。在其他线程调用时读到的是近似值
+int sev_get_stats(sev_base *base, sev_stats *st)
+{
+    memcpy(st, &_stats(base)->st, sizeof(sev_stats));
+    return 0;
+}
+
+void sev_reset_stats(sev_base *base)
+{
+    stats_ctx *sc = _stats(base);
+    memset(&sc->st, 0, sizeof(sev_stats));
+}
+
+static const char *kind_name[SEV_STATS_KINDS] = {"io", "cus", "timer", "post", "uring"};
+
+static void _dump_hist(const char *name, const sev_hist *h)
+{
+    if (!h->count)
+    {
+        return;
+    }
+    LOG("  %-12s count %llu avg %llu p50 %llu p99 %llu p999 %llu max %llu (ns)", name, h->count, h->sum / h->count,
+        sev_hist_percentile(h, 50), sev_hist_percentile(h, 99), sev_hist_percentile(h, 99.9), h->max);
+}
+
+void sev_dump_stats(sev_base *base)
+{
+    sev_stats st;
+    sev_get_stats(base, &st);
+
+    unsigned long long total = st.wait_ns + st.busy_ns;
+    LOG("[sev stats] loops %llu wait %llu ms busy %llu ms (%.1f%%)", st.loops, st.wait_ns / 1000000, st.busy_ns / 1000000,
+        total ? st.busy_ns * 100.0 / total : 0.0);
+    for (int i = 0; i < SEV_STATS_KINDS; i++)
+    {
+        _dump_hist(kind_name[i], &st.kind_lat[i]);
+    }
+    _dump_hist("timer late", &st.timer_late);
+    if (st.ready_batch.count)
+    {
+        LOG("  ready fds    avg %.2f max %llu", (double)st.ready_batch.sum / st.ready_batch.count, st.ready_batch.max);
+    }
+    for (int i = 0; i < SEV_STATS_HANDLERS; i++)
+    {
+        sev_handler_stats *hs = &st.handlers[i];
+        if (hs->fn && hs->lat.count)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "%s %p", kind_name[hs->kind], hs->fn);
+            _dump_hist(name, &hs->lat);
+        }
+    }
+}
+
+static void _dump_timer_cb(void *arg)
+{
+    sev_base *base = (sev_base *)arg;
+    stats_ctx *sc = _stats(base);
+    sev_dump_stats(base);
+    sc->dump_timer = set_timer(base, _dump_timer_cb, 0, base, &sc->dump_interval);
+}
+
+//每隔ms毫秒打印一次统计，ms<=0停止。在loop线程或loop启动前调用
+int sev_stats_dump_every(sev_base *base, int ms)
+{
+    stats_ctx *sc = _stats(base);
+    if (sc->dump_timer)
+    {
+        cancel_timer(base, sc->dump_timer);
+        sc->dump_timer = 0;
+    }
+    if (ms <= 0)
+    {
+        return 0;
+    }
+    sc->dump_interval.tv_sec = ms / 1000;
+    sc->dump_interval.tv_usec = (ms % 1000) * 1000;
+    sc->dump_timer = set_timer(base, _dump_timer_cb, 0, base, &sc->dump_interval);
+    return sc->dump_timer ? 0 : -1;
+}
+
+#else
+
+int sev_get_stats(sev_base *base, sev_stats *st)
+{
+    memset(st, 0, sizeof(sev_stats));
+    return -1;
+}
+void sev_reset_stats(sev_base *base) {}
+void sev_dump_stats(sev_base *base)
+{
+    LOG("stats not compiled in, define SEV_STATS");
+}
+int sev_stats_dump_every(sev_base *base, int ms)
+{
+    return -1;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef SIMPLE_EVENT_STATS_H
+#define SIMPLE_EVENT_STATS_H
+
+//库内部用的统计埋点，编译时定义SEV_STATS才生效，否则宏全部为空，没有任何开销
+//统计自己取CLOCK_MONOTONIC，不用base->now，定义了SEV_CLOCK_COARSE时也能量到微秒级的耗时
+
+#ifdef SEV_STATS
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    unsigned long long _stats_clock();
+    void _stats_handler(sev_base *base, int kind, void *fn, unsigned long long start);
+    void _stats_timer_late(sev_base *base, unsigned long long late);
+    void _stats_wait(sev_base *base, unsigned long long before, int nfds);
+    void _stats_turn(sev_base *base);
+#ifdef __cplusplus
+}
+#endif
+
+//回调前后各取一次时钟，记到对应种类和回调函数的直方图里
+#define STATS_CALL(base, kind, fn, call)                    \
+    {                                                       \
+        unsigned long long _st_start = _stats_clock();      \
+        call;                                               \
+        _stats_handler(base, kind, (void *)(fn), _st_start); \
+    }
+#define STATS_TIMER_LATE(base, late) _stats_timer_late(base, late)
+#define STATS_WAIT_BEGIN unsigned long long _st_wait = _stats_clock()
+#define STATS_WAIT_END(base, nfds) _stats_wait(base, _st_wait, nfds)
+#define STATS_TURN(base) _stats_turn(base)
+
+#else
+
+#define STATS_CALL(base, kind, fn, call) call
+#define STATS_TIMER_LATE(base, late)
+#define STATS_WAIT_BEGIN
+#define STATS_WAIT_END(base, nfds)
+#define STATS_TURN(base)
+
+#endif
+
+#endif
@@ -0,0 +1,434 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "simple_event_macro.h"
+#include "simple_event.h"
+#include "simple_event_stats.h"
+
+//io_uring后端，和epoll混用：
+//fd的就绪通知还是走epoll(new_io_event/add_io_event不变)，另外可以直接提交读写操作，完成后回调
+//一轮loop里提交的操作在epoll_wait前一次io_uring_enter提交，完成通知通过注册的eventfd进epoll
+//完成回调和epoll的io事件一样在io这一类里执行，共用io的预算
+//不依赖liburing，直接用系统调用。编译时定义SEV_HAVE_URING才有，否则这些接口都返回-1
+
+#ifdef SEV_HAVE_URING
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+extern int _budget_take(sev_base *base, int pri);
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+//一个已提交的操作，user_data指向它
+typedef struct uring_op_
+{
+    uring_callback cb;
+    void *ctx;
+    int fd;
+    struct uring_op_ *next; //空闲链表
+} uring_op;
+
+typedef struct sev_uring_
+{
+    int event_fd; //放第一个，epoll的data.ptr指向它
+    int ring_fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+
+    unsigned sqe_tail;  //下一个要填的sqe，填好的sqe在_uring_flush里才通过sq_tail发布给内核
+    unsigned to_submit; //已经填好还没提交的sqe
+    unsigned inflight;  //提交了还没完成的操作
+
+    //操作节点数等于cq的大小，在途的操作不会超过cq，cq不会溢出
+    uring_op *ops;
+    uring_op *free_ops;
+} sev_uring;
+
+static int _sys_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int _sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int _sys_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void _uring_destroy(sev_uring *ur)
+{
+    if (ur->sqes && ur->sqes != MAP_FAILED)
+    {
+        munmap(ur->sqes, ur->sqes_size);
+    }
+    if (ur->cq_ptr && ur->cq_ptr != MAP_FAILED && ur->cq_ptr != ur->sq_ptr)
+    {
+        munmap(ur->cq_ptr, ur->cq_size);
+    }
+    if (ur->sq_ptr && ur->sq_ptr != MAP_FAILED)
+    {
+        munmap(ur->sq_ptr, ur->sq_size);
+    }
+    if (ur->ring_fd >= 0)
+    {
+        close(ur->ring_fd);
+    }
+    if (ur->event_fd >= 0)
+    {
+        close(ur->event_fd);
+    }
+    free(ur->ops);
+    free(ur);
+}
+
+//给base打开io_uring，entries是提交队列的大小。内核不支持时返回-1，base继续只用epoll
+int sev_uring_enable(sev_base *base, unsigned int entries)
+{
+    if (base->uring)
+    {
+        return 0;
+    }
+
+    sev_uring *ur = (sev_uring *)calloc(1, sizeof(sev_uring));
+    ur->ring_fd = -1;
+    ur->event_fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ur->ring_fd = _sys_uring_setup(entries ? entries : 256, &p);
+    if (ur->ring_fd < 0)
+    {
+        LOG("io_uring_setup failed, errno = %d", errno);
+        _uring_destroy(ur);
+        return -1;
+    }
+
+    ur->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ur->sq_size = ur->cq_size = ur->sq_size > ur->cq_size ? ur->sq_size : ur->cq_size;
+    }
+
+    ur->sq_ptr = mmap(0, ur->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQ_RING);
+    if (ur->sq_ptr == MAP_FAILED)
+    {
+        LOG("mmap sq ring failed");
+        _uring_destroy(ur);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ur->cq_ptr = ur->sq_ptr;
+    }
+    else
+    {
+        ur->cq_ptr = mmap(0, ur->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_CQ_RING);
+        if (ur->cq_ptr == MAP_FAILED)
+        {
+            LOG("mmap cq ring failed");
+            _uring_destroy(ur);
+            return -1;
+        }
+    }
+    ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = (struct io_uring_sqe *)mmap(0, ur->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED)
+    {
+        LOG("mmap sqes failed");
+        _uring_destroy(ur);
+        return -1;
+    }
+
+    char *sq = (char *)ur->sq_ptr;
+    ur->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ur->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ur->sqe_tail = *ur->sq_tail;
+    ur->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ur->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ur->sq_entries = p.sq_entries;
+
+    char *cq = (char *)ur->cq_ptr;
+    ur->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ur->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ur->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    ur->ops = (uring_op *)calloc(p.cq_entries, sizeof(uring_op));
+    for (unsigned i = 0; i < p.cq_entries; i++)
+    {
+        ur->ops[i].next = i + 1 < p.cq_entries ? &ur->ops[i + 1] : NULL;
+    }
+    ur->free_ops = ur->ops;
+
+    //完成通知写到eventfd，eventfd放进epoll
+    ur->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ur->event_fd < 0 || _sys_uring_register(ur->ring_fd, IORING_REGISTER_EVENTFD, &ur->event_fd, 1) != 0)
+    {
+        LOG("io_uring register eventfd failed");
+        _uring_destroy(ur);
+        return -1;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = ur};
+    if (epoll_ctl(base->epoll_fd, EPOLL_CTL_ADD, ur->event_fd, &ev) != 0)
+    {
+        LOG("epoll_ctl ERROR.");
+        _uring_destroy(ur);
+        return -1;
+    }
+
+    base->uring = ur;
+    return 0;
+}
+
+//把这一轮填好的sqe一次提交给内核，loop在epoll_wait前调用，提交队列满时也会调用
+void _uring_flush(sev_base *base)
+{
+    sev_uring *ur = (sev_uring *)base->uring;
+    if (ur->to_submit)
+    {
+        //sqe都填完了才推进tail，内核看到tail时sqe的内容一定是完整的
+        __atomic_store_n(ur->sq_tail, ur->sqe_tail, __ATOMIC_RELEASE);
+    }
+    while (ur->to_submit)
+    {
+        int ret = _sys_uring_enter(ur->ring_fd, ur->to_submit, 0, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EBUSY)
+            {
+                LOG("io_uring_enter ERROR. errno = %d", errno);
+            }
+            break;//资源不够时留到下一轮再提交
+        }
+        ur->to_submit -= ret;
+        if (ret == 0)
+        {
+            break;
+        }
+    }
+}
+
+static struct io_uring_sqe *_uring_get_sqe(sev_base *base)
+{
+    sev_uring *ur = (sev_uring *)base->uring;
+    unsigned tail = ur->sqe_tail;
+    if (tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries)
+    {
+        _uring_flush(base);
+        if (tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries)
+        {
+            return NULL;
+        }
+    }
+
+    unsigned index = tail & *ur->sq_mask;
+    struct io_uring_sqe *sqe = &ur->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ur->sq_array[index] = index;
+    ur->sqe_tail = tail + 1;
+    ur->to_submit++;
+    return sqe;
+}
+
+static int _uring_prep(sev_base *base, int opcode, int fd, const void *addr, unsigned int len, unsigned long long off,
+                       int flags, int buf_index, uring_callback cb, void *ctx)
+{
+    sev_uring *ur = (sev_uring *)base->uring;
+    if (!ur)
+    {
+        return -1;
+    }
+    if (!ur->free_ops)
+    {
+        LOG("too many io_uring ops in flight");
+        return -1;
+    }
+    struct io_uring_sqe *sqe = _uring_get_sqe(base);
+    if (!sqe)
+    {
+        LOG("io_uring sq is full");
+        return -1;
+    }
+
+    uring_op *op = ur->free_ops;
+    ur->free_ops = op->next;
+    op->cb = cb;
+    op->ctx = ctx;
+    op->fd = fd;
+    ur->inflight++;
+
+    sqe->opcode = (unsigned char)opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->rw_flags = flags;//和msg_flags是同一个字段
+    sqe->buf_index = (unsigned short)buf_index;
+    sqe->user_data = (unsigned long long)(uintptr_t)op;
+    return 0;
+}
+
+//处理完成队列，loop在io这一类里调用，每个完成事件都算io的预算
+//预算用完了剩下的留在完成队列里，返回1表示还有没处理的，下一轮接着处理
+int _uring_process(sev_base *base)
+{
+    sev_uring *ur = (sev_uring *)base->uring;
+    eventfd_t val;
+    eventfd_read(ur->event_fd, &val);
+
+    unsigned head = *ur->cq_head;
+    unsigned tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+    int done = 0;
+    while (head != tail)
+    {
+        //epoll的io事件可能已经把预算用完了，每轮至少处理一个，避免饿死
+        if (!_budget_take(base, SEV_PRI_IO) && done)
+        {
+            return 1;
+        }
+        done++;
+        struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cq_mask];
+        uring_op *op = (uring_op *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+        //先还节点再回调，回调里可以马上提交新的操作
+        uring_callback cb = op->cb;
+        void *ctx = op->ctx;
+        int fd = op->fd;
+        op->next = ur->free_ops;
+        ur->free_ops = op;
+        ur->inflight--;
+
+        if (cb)
+        {
+            STATS_CALL(base, SEV_STATS_URING, cb, cb(fd, res, ctx));
+        }
+
+        if (head == tail)
+        {
+            tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+    return 0;
+}
+
+//在途的操作不会再回调，调用前要保证它们用的缓冲区在内核完成前不被释放(关掉fd即可让它们结束)
+void _uring_free(sev_base *base)
+{
+    sev_uring *ur = (sev_uring *)base->uring;
+    if (!ur)
+    {
+        return;
+    }
+    epoll_ctl(base->epoll_fd, EPOLL_CTL_DEL, ur->event_fd, NULL);
+    _uring_destroy(ur);
+    base->uring = NULL;
+}
+
+//注册固定缓冲区，之后read_fixed/write_fixed用下标引用，内核不用每次映射用户内存
+int sev_uring_register_buffers(sev_base *base, struct iovec *iov, unsigned int n)
+{
+    sev_uring *ur = (sev_uring *)base->uring;
+    if (!ur)
+    {
+        return -1;
+    }
+    if (_sys_uring_register(ur->ring_fd, IORING_REGISTER_BUFFERS, iov, n) != 0)
+    {
+        LOG("io_uring register buffers failed, errno = %d", errno);
+        return -1;
+    }
+    return 0;
+}
+
+int sev_uring_read(sev_base *base, int fd, void *buf, unsigned int len, uring_callback cb, void *ctx)
+{
+    return _uring_prep(base, IORING_OP_READ, fd, buf, len, (unsigned long long)-1, 0, 0, cb, ctx);
+}
+
+int sev_uring_write(sev_base *base, int fd, const void *buf, unsigned int len, uring_callback cb, void *ctx)
+{
+    return _uring_prep(base, IORING_OP_WRITE, fd, buf, len, (unsigned long long)-1, 0, 0, cb, ctx);
+}
+
+int sev_uring_read_fixed(sev_base *base, int fd, void *buf, unsigned int len, int buf_index, uring_callback cb, void *ctx)
+{
+    return _uring_prep(base, IORING_OP_READ_FIXED, fd, buf, len, (unsigned long long)-1, 0, buf_index, cb, ctx);
+}
+
+int sev_uring_write_fixed(sev_base *base, int fd, const void *buf, unsigned int len, int buf_index, uring_callback cb, void *ctx)
+{
+    return _uring_prep(base, IORING_OP_WRITE_FIXED, fd, buf, len, (unsigned long long)-1, 0, buf_index, cb, ctx);
+}
+
+int sev_uring_recvmsg(sev_base *base, int fd, struct msghdr *msg, int flags, uring_callback cb, void *ctx)
+{
+    return _uring_prep(base, IORING_OP_RECVMSG, fd, msg, 1, 0, flags, 0, cb, ctx);
+}
+
+int sev_uring_sendmsg(sev_base *base, int fd, const struct msghdr *msg, int flags, uring_callback cb, void *ctx)
+{
+    return _uring_prep(base, IORING_OP_SENDMSG, fd, msg, 1, 0, flags, 0, cb, ctx);
+}
+
+#else
+
+int sev_uring_enable(sev_base *base, unsigned int entries)
+{
+    LOG("io_uring not compiled in, define SEV_HAVE_URING");
+    return -1;
+}
+void _uring_flush(sev_base *base) {}
+int _uring_process(sev_base *base) { return 0; }
+void _uring_free(sev_base *base) {}
+int sev_uring_register_buffers(sev_base *base, struct iovec *iov, unsigned int n) { return -1; }
+int sev_uring_read(sev_base *base, int fd, void *buf, unsigned int len, uring_callback cb, void *ctx) { return -1; }
+int sev_uring_write(sev_base *base, int fd, const void *buf, unsigned int len, uring_callback cb, void *ctx) { return -1; }
+int sev_uring_read_fixed(sev_base *base, int fd, void *buf, unsigned int len, int buf_index, uring_callback cb, void *ctx) { return -1; }
+int sev_uring_write_fixed(sev_base *base, int fd, const void *buf, unsigned int len, int buf_index, uring_callback cb, void *ctx) { return -1; }
+int sev_uring_recvmsg(sev_base *base, int fd, struct msghdr *msg, int flags, uring_callback cb, void *ctx) { return -1; }
+int sev_uring_sendmsg(sev_base *base, int fd, const struct msghdr *msg, int flags, uring_callback cb, void *ctx) { return -1; }
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdlib.h>
+
+//单生产者单消费者无锁环形队列
+//生产者只写tail，消费者只写head，两边各自缓存对方的下标，大部分时候不用读对方的cache line
+//容量向上取整到2的幂，下标一直递增，用mask取模
+
+#define SPSC_CACHE_LINE 64
+
+typedef struct spsc_stats_
+{
+    unsigned long long push_ok;   //入队成功次数
+    unsigned long long push_full; //队列满入队失败次数(被反压)
+    unsigned long long pop_ok;    //出队次数
+    unsigned int depth;           //当前队列长度
+    unsigned int high_water;      //出现过的最大长度
+    unsigned int cap;
+} spsc_stats;
+
+typedef struct spsc_queue_
+{
+    //生产者独占
+    unsigned int tail __attribute__((aligned(SPSC_CACHE_LINE)));
+    unsigned int head_cache;
+    unsigned int high_water;
+    unsigned long long push_ok;
+    unsigned long long push_full;
+
+    //消费者独占
+    unsigned int head __attribute__((aligned(SPSC_CACHE_LINE)));
+    unsigned int tail_cache;
+    unsigned long long pop_ok;
+
+    //初始化后只读
+    unsigned int mask __attribute__((aligned(SPSC_CACHE_LINE)));
+    unsigned int cap;
+    void **data;
+} spsc_queue;
+
+static inline int spsc_init(spsc_queue *q, unsigned int cap)
+{
+    unsigned int n = 2;
+    while (n < cap)
+    {
+        n <<= 1;
+    }
+
+    void **data = (void **)calloc(n, sizeof(void *));
+    if (!data)
+    {
+        return -1;
+    }
+    q->tail = q->head_cache = q->high_water = 0;
+    q->push_ok = q->push_full = 0;
+    q->head = q->tail_cache = 0;
+    q->pop_ok = 0;
+    q->mask = n - 1;
+    q->cap = n;
+    q->data = data;
+    return 0;
+}
+
+static inline void spsc_destroy(spsc_queue *q)
+{
+    free(q->data);
+    q->data = NULL;
+    q->cap = q->mask = 0;
+}
+
+//生产者调用。成功返回1，满了返回0
+static inline int spsc_push(spsc_queue *q, void *item)
+{
+    unsigned int tail = q->tail;
+    if (tail - q->head_cache >= q->cap)
+    {
+        q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (tail - q->head_cache >= q->cap)
+        {
+            __atomic_store_n(&q->push_full, q->push_full + 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+
+    q->data[tail & q->mask] = item;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&q->push_ok, q->push_ok + 1, __ATOMIC_RELAXED);
+    //head_cache是旧的，用它算出来的长度偏大，可能超过最大值时才重新读一次head
+    if (tail + 1 - q->head_cache > q->high_water)
+    {
+        q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        unsigned int depth = tail + 1 - q->head_cache;
+        if (depth > q->high_water)
+        {
+            __atomic_store_n(&q->high_water, depth, __ATOMIC_RELAXED);
+        }
+    }
+    return 1;
+}
+
+//消费者调用。最多取max个队头元素的指针放到items里，不出队，返回取到的个数
+static inline unsigned int spsc_peek_batch(spsc_queue *q, void **items, unsigned int max)
+{
+    unsigned int head = q->head;
+    if (q->tail_cache - head < max)
+    {
+        q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    }
+
+    unsigned int n = q->tail_cache - head;
+    n = n < max ? n : max;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        items[i] = q->data[(head + i) & q->mask];
+    }
+    return n;
+}
+
+static inline void *spsc_peek(spsc_queue *q)
+{
+    void *item = NULL;
+    return spsc_peek_batch(q, &item, 1) ? item : NULL;
+}
+
+//消费者调用。出队n个，n不能超过之前peek到的个数
+static inline void spsc_pop_n(spsc_queue *q, unsigned int n)
+{
+    __atomic_store_n(&q->pop_ok, q->pop_ok + n, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->head, q->head + n, __ATOMIC_RELEASE);
+}
+
+static inline void *spsc_pop(spsc_queue *q)
+{
+    void *item = spsc_peek(q);
+    if (item)
+    {
+        spsc_pop_n(q, 1);
+    }
+    return item;
+}
+
+//两边都可以调用，结果只是个近似值
+static inline unsigned int spsc_size(spsc_queue *q)
+{
+    return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+}
+
+static inline int spsc_empty(spsc_queue *q)
+{
+    return spsc_size(q) == 0;
+}
+
+//统计值由两个线程分别写，读到的是近似快照
+static inline void spsc_get_stats(spsc_queue *q, spsc_stats *st)
+{
+    st->push_ok = __atomic_load_n(&q->push_ok, __ATOMIC_RELAXED);
+    st->push_full = __atomic_load_n(&q->push_full, __ATOMIC_RELAXED);
+    st->pop_ok = __atomic_load_n(&q->pop_ok, __ATOMIC_RELAXED);
+    st->depth = spsc_size(q);
+    st->high_water = __atomic_load_n(&q->high_water, __ATOMIC_RELAXED);
+    st->cap = q->cap;
+}
+
+#endif
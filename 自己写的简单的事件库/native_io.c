@@ -11,9 +11,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
 
 #include "simple_event.h"
 #include "simple_event_macro.h"
+#include "spsc_queue.h"
 
 #define QUIC_LOG(fmt, ...) printf("##QUIC## "fmt "\n", ##__VA_ARGS__)
 #define QUIC_TRACE QUIC_LOG("%s",__func__)
@@ -117,86 +120,29 @@ struct client_ctx
 
     int stream_count;
     void *queue[MAX_STREAM_COUNT];
+    unsigned int head_off[MAX_STREAM_COUNT]; //队头数据已经发出去的字节数
+    int head_zc[MAX_STREAM_COUNT];           //队头数据有一部分是零拷贝发的
     struct timeval *delay[MAX_STREAM_COUNT];
+    void *zc;                                //zc_ctx，不用零拷贝时为空
 
     contrl_ctx_t *ctrl_ctx;
 };
 
 /////////////////////////////////////////////////////////////////
-#define QUEUE_SIZE (360/MAX_STREAM_COUNT)
-typedef struct queue_
-{
-    int max;
-    int front;
-    int tail;
-    void *data[QUEUE_SIZE];
-
-    pthread_mutex_t mutex;
-} queue;
-
-queue data_queue[MAX_STREAM_COUNT];
-
-// 初始化队列
-void initQueue(queue *q)
-{
-    q->max = QUEUE_SIZE;
-    q->front = 0;
-    q->tail = 0;
-}
-
-// 检查队列是否为空
-int isEmpty(queue *q)
-{
-    return q->front == q->tail;
-}
-
-// 检查队列是否已满
-int isFull(queue *q)
-{
-    return (q->tail + 1) % q->max == q->front;
-}
-
-// 入队函数
-int enqueue(queue *q, void *item)
-{
-    pthread_mutex_lock(&q->mutex);
-    if (isFull(q))
-    {
-        pthread_mutex_unlock(&q->mutex);
-        return 0; // 队列已满，入队失败
-    }
-    q->data[q->tail] = item;
-    q->tail = (q->tail + 1) % q->max;
-    pthread_mutex_unlock(&q->mutex);
-    return 1; // 入队成功
-}
+#define QUEUE_SIZE 128 /*每路流的队列容量，2的幂*/
 
-// 出队函数
-void *dequeue(queue *q)
-{
-    pthread_mutex_lock(&q->mutex);
-    if (isEmpty(q))
-    {
-        pthread_mutex_unlock(&q->mutex);
-        return NULL; // 队列为空，出队失败
-    }
-    void *item = q->data[q->front];
-    q->front = (q->front + 1) % q->max;
-    pthread_mutex_unlock(&q->mutex);
-    return item; // 出队成功
-}
+spsc_queue data_queue[MAX_STREAM_COUNT];
 
-void *queue_head(queue *q)
+//spsc队列只能在生产者和消费者线程都开始用之前初始化一次，在main里调用
+static void init_queues(spsc_queue *ques)
 {
-    pthread_mutex_lock(&q->mutex);
-    if (isEmpty(q))
+    for (int i = 0; i < MAX_STREAM_COUNT; i++)
     {
-        pthread_mutex_unlock(&q->mutex);
-        return NULL; 
+        if (!ques[i].data)
+        {
+            spsc_init(&ques[i], QUEUE_SIZE);
+        }
     }
-    void *item = q->data[q->front];
-    pthread_mutex_unlock(&q->mutex);
-    return item; 
 }
 
 static void clear_queue(client_ctx_t* cctx)
@@ -219,7 +165,7 @@ static void clear_queue(client_ctx_t* cctx)
         contrl_ctx_t *ctrl_ctx = cctx->ctrl_ctx;
 
             QUIC_LOG("clear_queue 3");
-        void *item = queue_head((queue *)que);
+        void *item = spsc_pop((spsc_queue *)que);
         while (item)
         {
             if (ctrl_ctx->fn_free)
@@ -227,72 +173,307 @@ static void clear_queue(client_ctx_t* cctx)
                 ctrl_ctx->fn_free(item);
             }
 
-            (void)dequeue((queue *)que);
-            item = queue_head((queue *)que);
+            item = spsc_pop((spsc_queue *)que);
         }
             QUIC_LOG("clear_queue 4");
     }
 }
 
-//从队列取出数据并填满缓冲区
-int send_data_from_queue(void* cctx, int num, int fd)
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+#define SEND_IOV_MAX 64 /*一次sendmsg最多带多少个队列元素，不能超过IOV_MAX(1024)*/
+#define ZC_PENDING 1024 /*等零拷贝完成的元素个数上限，快满了就先不用零拷贝*/
+
+//零拷贝发送：数据在内核通知完成之前不能释放，先挂在这里
+//内核给每次带MSG_ZEROCOPY的成功发送按顺序编号，完成通知从错误队列里读，给出已完成的编号区间
+typedef struct zc_pending_
 {
-    static int index = 0;
-    void *que = ((client_ctx_t *)cctx)->queue[num];
-    index = (index + 1)%MAX_STREAM_COUNT;
-    contrl_ctx_t *ctrl_ctx = ((client_ctx_t *)cctx)->ctrl_ctx;
+    void *item;
+    data_free fn_free;
+    unsigned int seq; //最后一次引用这个元素的零拷贝发送的编号
+} zc_pending;
 
-    int ret = 0;
+typedef struct zc_ctx_
+{
+    int enable;
+    unsigned int threshold; //一次发送的字节数超过这个值才用零拷贝，小数据拷贝更便宜
+    unsigned int next_seq;
+    unsigned int acked;    //已经完成的零拷贝发送个数，等于next_seq时内核不再引用任何数据
+    unsigned int head;
+    unsigned int tail;
+    zc_pending pending[ZC_PENDING];
+} zc_ctx;
+
+//打开socket的零拷贝，内核不支持时返回-1，照常拷贝发送
+static int zc_init(zc_ctx *zc, int fd, unsigned int threshold)
+{
+    memset(zc, 0, sizeof(zc_ctx));
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0)
+    {
+        QUIC_LOG("SO_ZEROCOPY not supported, errno %d", errno);
+        return -1;
+    }
+    zc->enable = 1;
+    zc->threshold = threshold;
+    return 0;
+}
+
+static void zc_defer(zc_ctx *zc, void *item, data_free fn_free)
+{
+    zc_pending *p = &zc->pending[zc->tail % ZC_PENDING];
+    p->item = item;
+    p->fn_free = fn_free;
+    p->seq = zc->next_seq - 1;
+    zc->tail++;
+}
+
+//释放编号不超过done的元素
+static void zc_complete(zc_ctx *zc, unsigned int done)
+{
+    while (zc->head != zc->tail)
+    {
+        zc_pending *p = &zc->pending[zc->head % ZC_PENDING];
+        if ((int)(p->seq - done) > 0)
+        {
+            break;
+        }
+        if (p->fn_free)
+        {
+            p->fn_free(p->item);
+        }
+        zc->head++;
+    }
+    zc->acked = done + 1;
+}
+
+//发出去的零拷贝数据都完成了(包括发了一半还在队列里的)
+static int zc_idle(zc_ctx *zc)
+{
+    return zc->acked == zc->next_seq;
+}
+
+//读错误队列里的完成通知，socket报SEV_IO_ERROR时调用
+static void zc_reap(zc_ctx *zc, int fd)
+{
     while (1)
     {
-        void *item = queue_head((queue *)que);
-        if (!item)
+        char control[128];
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
         {
             break;
         }
 
-        int len = 0;
-        void *data = 0;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+            {
+                continue;
+            }
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY && serr->ee_errno == 0)
+            {
+                zc_complete(zc, serr->ee_data);//ee_info到ee_data是完成的区间，TCP下按顺序完成
+            }
+        }
+    }
+}
+
+//socket关闭后调用，没等到完成通知的也一起释放。只有确认内核不再引用(zc_idle或者RST关闭)时才能调用
+static void zc_clear(zc_ctx *zc)
+{
+    zc_complete(zc, zc->next_seq - 1);
+    zc->head = zc->tail = 0;
+}
 
-        if (ctrl_ctx->fn_parse)
+//把队列里的数据尽量用一次sendmsg发出去，写不完的按head_off记在队头，不用重新分配
+//最多发budget个字节(限速用)。返回发送的字节数，出错返回-1。*blocked为1表示socket发送缓冲区满了
+static ssize_t send_queue_gather(int fd, spsc_queue *que, unsigned int *head_off, int *head_zc,
+                                 data_parse fn_parse, data_free fn_free, zc_ctx *zc, size_t budget, int *blocked)
+{
+    ssize_t sent = 0;
+    *blocked = 0;
+    while (budget > 0)
+    {
+        void *items[SEND_IOV_MAX];
+        unsigned int n = spsc_peek_batch(que, items, SEND_IOV_MAX);
+        if (n == 0)
         {
-            len = ctrl_ctx->fn_parse(item, &data);
+            break;
         }
 
-        ssize_t wlen = send(fd, data, len,0);
+        struct iovec iov[SEND_IOV_MAX];
+        size_t rem[SEND_IOV_MAX]; //每个元素还没发的字节数，最后一个iov可能被budget截短
+        size_t total = 0;
+        for (unsigned int i = 0; i < n; i++)
+        {
+            void *data = 0;
+            int len = fn_parse ? fn_parse(items[i], &data) : 0;
+            unsigned int off = i == 0 ? *head_off : 0;
+            rem[i] = len - off;
+            iov[i].iov_base = (char *)data + off;
+            iov[i].iov_len = rem[i] < budget - total ? rem[i] : budget - total;
+            total += iov[i].iov_len;
+            if (total == budget)
+            {
+                n = i + 1;
+                break;
+            }
+        }
+
+        int use_zc = zc && zc->enable && total >= zc->threshold && zc->tail - zc->head + n + 1 <= ZC_PENDING;
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t wlen = sendmsg(fd, &msg, MSG_NOSIGNAL | (use_zc ? MSG_ZEROCOPY : 0));
+        if (wlen < 0 && use_zc && errno == ENOBUFS)
+        {
+            use_zc = 0;//超过了optmem限制，这次先拷贝发送
+            wlen = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        }
         if (wlen < 0)
         {
-            QUIC_LOG("lsquic_stream_write error");
-            return 0;
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                *blocked = 1;
+                break;
+            }
+            QUIC_LOG("sendmsg error %d", errno);
+            return -1;
         }
-        else
+        if (use_zc)
         {
-            ret += wlen;
-            if (wlen < len)
+            zc->next_seq++;
+        }
+        sent += wlen;
+
+        //发完的元素出队，零拷贝发过的要等完成通知再释放
+        size_t left = (size_t)wlen;
+        unsigned int done = 0;
+        for (; done < n; done++)
+        {
+            if (left < rem[done])
+            {
+                *head_off = (done == 0 ? *head_off : 0) + left;
+                *head_zc = (done == 0 ? *head_zc : 0) || (use_zc && left > 0);
+                break;
+            }
+            left -= rem[done];
+            if (use_zc || (done == 0 && *head_zc))
+            {
+                zc_defer(zc, items[done], fn_free);
+            }
+            else if (fn_free)
             {
-                // 缓冲区已满，剩余数据继续存在队头
-                if (ctrl_ctx->fn_remake)
-                {
-                    ctrl_ctx->fn_remake(item, len - wlen);
-                    break;
-                }
-                else
-                {
-                    QUIC_LOG("fn_remake is null");
-                }
+                fn_free(items[done]);
+            }
+            if (done == 0)
+            {
+                *head_off = 0;
+                *head_zc = 0;
             }
-            //else wlen == len
         }
-        
-        //数据完全拷到了缓冲区，出队
-        (void)dequeue((queue *)que);
-        if (ctrl_ctx->fn_free)
+        spsc_pop_n(que, done);
+
+        budget -= wlen;
+        if ((size_t)wlen < total)
         {
-            ctrl_ctx->fn_free(item);
+            *blocked = 1;
+            break;
         }
     }
+    return sent;
+}
 
-    return ret;
+//令牌桶限速：令牌按rate(字节/秒)累积，最多攒burst个，发多少字节扣多少
+//rate为0表示不限速
+typedef struct token_bucket_
+{
+    long long rate;
+    long long burst;
+    double tokens;
+    unsigned long long last; //上次补充令牌的时间(ns)
+} token_bucket;
+
+#define TB_DEFAULT_BURST (16 * 1024)
+#define TB_MIN_BURST 1500 /*至少能攒够一个包*/
+
+static void tb_set(token_bucket *tb, long long rate, long long burst, unsigned long long now)
+{
+    tb->rate = rate > 0 ? rate : 0;
+    if (burst <= 0)
+    {
+        burst = tb->rate / 20;//默认攒50ms的量
+        burst = burst > TB_DEFAULT_BURST ? burst : TB_DEFAULT_BURST;
+    }
+    tb->burst = burst > TB_MIN_BURST ? burst : TB_MIN_BURST;
+    if (tb->tokens > tb->burst || tb->last == 0)
+    {
+        tb->tokens = tb->burst;
+    }
+    tb->last = now;
+}
+
+//当前可以发的字节数，不限速时返回(size_t)-1
+static size_t tb_avail(token_bucket *tb, unsigned long long now)
+{
+    if (!tb->rate)
+    {
+        return (size_t)-1;
+    }
+    if (now > tb->last)
+    {
+        tb->tokens += (double)tb->rate * (now - tb->last) / 1e9;
+        tb->tokens = tb->tokens < tb->burst ? tb->tokens : tb->burst;
+        tb->last = now;
+    }
+    return tb->tokens > 0 ? (size_t)tb->tokens : 0;
+}
+
+static void tb_consume(token_bucket *tb, size_t len)
+{
+    if (tb->rate)
+    {
+        tb->tokens -= len;
+    }
+}
+
+//攒够need个令牌还要多久(ns)
+static unsigned long long tb_wait(token_bucket *tb, size_t need)
+{
+    if (!tb->rate || tb->tokens >= need)
+    {
+        return 0;
+    }
+    return (unsigned long long)((need - tb->tokens) * 1e9 / tb->rate);
+}
+
+//从队列取出数据并填满缓冲区
+int send_data_from_queue(void* cctx, int num, int fd)
+{
+    client_ctx_t *ctx = (client_ctx_t *)cctx;
+    contrl_ctx_t *ctrl_ctx = ctx->ctrl_ctx;
+
+    int blocked = 0;
+    ssize_t ret = send_queue_gather(fd, (spsc_queue *)ctx->queue[num], &ctx->head_off[num], &ctx->head_zc[num],
+                                    ctrl_ctx->fn_parse, ctrl_ctx->fn_free, (zc_ctx *)ctx->zc, (size_t)-1, &blocked);
+    return ret < 0 ? 0 : (int)ret;
 }
 
 // int get_data_from_queue(void *cctx, int num, void **data, void **pitem)
@@ -529,9 +710,9 @@ static int wait_status(contrl_ctx_t *ctrl_ctx, int status, int overtime/*ms*/)
 
 QUIC_API int quic_push_data(int index, void *data)
 {
-    queue *que = &data_queue[index%MAX_STREAM_COUNT];
-    
-    int ret = enqueue(que, (void *)data);
+    spsc_queue *que = &data_queue[index%MAX_STREAM_COUNT];
+
+    int ret = spsc_push(que, (void *)data);
     if (!ret)
     {
         // QUIC_LOG("push data failed");
@@ -622,6 +803,9 @@ typedef struct test_ctx_
     int peer_port;
 
     int local_sock;
+    io_evt *ev_tcp;
+    int closing_sock;         //关闭时还有零拷贝数据没完成，fd先留着收完成通知
+    sev_timer_id close_timer; //等完成通知的时限
 } test_ctx;
 
 int make_frame(int index)
@@ -683,6 +867,7 @@ void print_drop_info(int drop_len)
 #define FRM_LEN 1536
 
 static int make_data_interval = 0;
+static int zerocopy_threshold = 0; //一次发送超过这么多字节时用MSG_ZEROCOPY，0不用
 int GetInterval()
 {
     return (make_data_interval==0?MAKE_DATA_INTERVAL_:make_data_interval);
@@ -719,24 +904,42 @@ static void data_cb(int fd, int event, int is_overtime, void *arg)
 }
 #else
 
-queue x_que[MAX_STREAM_COUNT];
-int init_queue = 0;
+spsc_queue x_que[MAX_STREAM_COUNT];
+static unsigned int x_off[MAX_STREAM_COUNT];
+static int x_zc[MAX_STREAM_COUNT];
+static zc_ctx x_zc_ctx;
 typedef struct x_data_{
     void* data;
     int len;
-    int off;
 }x_data;
+static int x_parse(void *item, void **data)
+{
+    x_data *x = (x_data *)item;
+    *data = x->data;
+    return x->len;
+}
+static void x_free(void *item)
+{
+    x_data *x = (x_data *)item;
+    free(x->data);
+    free(x);
+}
+
+//限速：每路流一个令牌桶，所有流再共用一个总的令牌桶
+//令牌不够时关掉可写，用定时器等令牌攒够再打开，不会被可写事件空转唤醒
+#define PACE_QUANTUM 1460 /*令牌至少攒够这么多字节才恢复发送，避免发很多小包*/
+
+typedef struct pacer_
+{
+    token_bucket total;
+    token_bucket stream[MAX_STREAM_COUNT];
+    sev_timer_id timer; //等令牌的定时器，非0表示正在等
+} pacer;
+
+static pacer x_pacer;
+
 static void data_cb(int fd, int event, int is_overtime, void *arg)
 {
-    if (!init_queue)
-    {
-        init_queue = 1;
-        for (int i = 0; i < MAX_STREAM_COUNT; i++)
-        {
-            initQueue(&x_que[i]);
-        }
-    }
-    
     test_ctx *tctx = (test_ctx *)arg;
 
     for (int i = 0; i < MAX_STREAM_COUNT; i++)
@@ -746,44 +949,189 @@ static void data_cb(int fd, int event, int is_overtime, void *arg)
         x_data *data = calloc(1,sizeof(x_data));
         data->data = calloc(1, size);
         data->len = size;
-        if(!enqueue(&x_que[i],data))
+        if(!spsc_push(&x_que[i],data))
         {
             // QUIC_LOG("drop a frame");
-            free(data->data);
-            free(data);
+            x_free(data);
         }
     }
 
+    //有数据要发了才关心可写，在等令牌时由限速定时器打开
+    if (tctx->ev_tcp && !x_pacer.timer)
+    {
+        mod_io_event(tctx->eb, tctx->ev_tcp, SEV_IO_READABLE|SEV_IO_WRITEABLE|SEV_IO_ERROR);
+    }
+
     struct timeval tv = {.tv_sec = 0, .tv_usec = MAKE_DATA_INTERVAL};
     add_cus_event(tctx->eb, tctx->ev_data, &tv);
 }
 
-void onsend(void* args, int fd, int num)
+//运行中修改限速，stream为-1时改总速率。rate为0不限速，burst为0用默认值
+void pacer_set_rate(sev_base *base, int stream, long long rate, long long burst)
+{
+    token_bucket *tb = stream < 0 ? &x_pacer.total : &x_pacer.stream[stream % MAX_STREAM_COUNT];
+    tb_set(tb, rate, burst, sev_now(base));
+    QUIC_LOG("pace stream %d rate %lld burst %lld", stream, tb->rate, tb->burst);
+}
+
+static int x_que_empty();
+static void pace_timer_cb(void *arg)
+{
+    test_ctx *tctx = (test_ctx *)arg;
+    x_pacer.timer = 0;
+    if (tctx->ev_tcp && !x_que_empty())
+    {
+        mod_io_event(tctx->eb, tctx->ev_tcp, SEV_IO_READABLE|SEV_IO_WRITEABLE|SEV_IO_ERROR);
+    }
+}
+
+//令牌不够，等最快能恢复的那路流攒够一个PACE_QUANTUM
+static void pace_wait(test_ctx *tctx, unsigned long long wait)
+{
+    if (tctx->ev_tcp)
+    {
+        mod_io_event(tctx->eb, tctx->ev_tcp, SEV_IO_READABLE|SEV_IO_ERROR);
+    }
+    if (!x_pacer.timer)
+    {
+        wait = wait > 1000000 ? wait : 1000000;//定时器精度是ms
+        struct timeval tv = {.tv_sec = wait / 1000000000ULL, .tv_usec = (wait % 1000000000ULL) / 1000};
+        x_pacer.timer = set_timer(tctx->eb, pace_timer_cb, 0, tctx, &tv);
+    }
+}
+
+//各路流轮流发，每路一次sendmsg带上队列里的多个数据，发送缓冲区满了就等下次可写
+//返回1表示有数据因为限速没发，要等令牌。socket出错返回-1，要关掉连接
+int onsend(test_ctx *tctx, int fd)
 {
     static int index = 0;
-    queue* que = &x_que[index];
     index = (index + 1)%MAX_STREAM_COUNT;
-    while (1)
+    unsigned long long now = sev_now(tctx->eb);
+    unsigned long long wait = 0;
+    int throttled = 0;
+    int blocked = 0;
+    for (int k = 0; k < MAX_STREAM_COUNT; k++)
     {
-        void* item = queue_head(que);
-        if (!item)
+        int i = (index + k) % MAX_STREAM_COUNT;
+        if (!x_que[i].data || spsc_empty(&x_que[i]))
         {
-            break;
+            continue;
         }
-        
-        x_data *x = (x_data*)item;
-        int wlen = send(fd, x->data+x->off, x->len-x->off,0);
-        if (wlen<0){}
-        else if(wlen<x->len-x->off)
+
+        token_bucket *tbs = &x_pacer.stream[i];
+        size_t budget = tb_avail(tbs, now);
+        size_t total = tb_avail(&x_pacer.total, now);
+        budget = budget < total ? budget : total;
+
+        ssize_t sent = 0;
+        if (budget > 0)
+        {
+            sent = send_queue_gather(fd, &x_que[i], &x_off[i], &x_zc[i], x_parse, x_free, &x_zc_ctx, budget, &blocked);
+        }
+        if (sent < 0)
+        {
+            return -1;//EPIPE、ECONNRESET这类错误，等令牌也发不出去
+        }
+        if (sent > 0)
+        {
+            tb_consume(tbs, sent);
+            tb_consume(&x_pacer.total, sent);
+        }
+        if (blocked)
         {
-            x->off+=wlen;
             break;
         }
-        
-        (void)dequeue(que);
-        free(x->data);
-        free(x);
+        if (!spsc_empty(&x_que[i]))
+        {
+            //不是socket满了就是令牌用完了
+            unsigned long long w = tb_wait(tbs, PACE_QUANTUM);
+            unsigned long long wt = tb_wait(&x_pacer.total, PACE_QUANTUM);
+            w = w > wt ? w : wt;
+            wait = throttled && wait < w ? wait : w;
+            throttled = 1;
+        }
     }
+    //socket满了照常等可写，可写时再按令牌发
+    if (throttled && !blocked)
+    {
+        pace_wait(tctx, wait);
+        return 1;
+    }
+    return 0;
+}
+
+static int x_que_empty()
+{
+    for (int i = 0; i < MAX_STREAM_COUNT; i++)
+    {
+        if (x_que[i].data && !spsc_empty(&x_que[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#define ZC_CLOSE_WAIT 2 /*s，关闭时最多等零拷贝的完成通知这么久*/
+
+//真正关掉socket，释放零拷贝挂着的数据。abort时对端一直没确认，用RST让内核丢掉发送队列、不再引用这些数据
+static void finish_close(test_ctx *tctx, int abort)
+{
+    int fd = tctx->closing_sock;
+    if (tctx->close_timer)
+    {
+        cancel_timer(tctx->eb, tctx->close_timer);
+        tctx->close_timer = 0;
+    }
+    remove_io_event(tctx->eb, fd, 1);
+    if (abort)
+    {
+        struct linger lg = {.l_onoff = 1, .l_linger = 0};
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    close(fd);
+    tctx->closing_sock = -1;
+    zc_clear(&x_zc_ctx);
+    x_zc_ctx.enable = 0;
+}
+
+static void close_timeout_cb(void *arg)
+{
+    test_ctx *tctx = (test_ctx *)arg;
+    tctx->close_timer = 0;
+    zc_reap(&x_zc_ctx, tctx->closing_sock);
+    if (!zc_idle(&x_zc_ctx))
+    {
+        QUIC_LOG("zerocopy completions timeout, reset connection");
+    }
+    finish_close(tctx, !zc_idle(&x_zc_ctx));
+}
+
+//停止发送，队头发了一半的数据项重连后从头发。零拷贝发出去的数据内核确认之前还在用，
+//先半关闭等完成通知(对端确认了数据才会来)，都完成了再关fd、释放数据
+static void close_conn(test_ctx *tctx)
+{
+    int fd = tctx->local_sock;
+    mod_io_event(tctx->eb, tctx->ev_tcp, SEV_IO_ERROR);//只收完成通知，不再发
+    tctx->local_sock = -1;
+    tctx->ev_tcp = 0;
+    if (x_pacer.timer)
+    {
+        cancel_timer(tctx->eb, x_pacer.timer);
+        x_pacer.timer = 0;
+    }
+    memset(x_off, 0, sizeof(x_off));
+    memset(x_zc, 0, sizeof(x_zc));
+
+    tctx->closing_sock = fd;
+    if (!x_zc_ctx.enable || zc_idle(&x_zc_ctx))
+    {
+        finish_close(tctx, 0);
+        return;
+    }
+    shutdown(fd, SHUT_WR);
+    struct timeval tv = {.tv_sec = ZC_CLOSE_WAIT, .tv_usec = 0};
+    tctx->close_timer = set_timer(tctx->eb, close_timeout_cb, 0, tctx, &tv);
 }
 #endif
 
@@ -801,6 +1149,11 @@ static void stdin_cb(int fd, int what, void *arg)
 
     if (0 == strcmp("conn", buf))
     {
+        if (tctx->closing_sock != -1)
+        {
+            QUIC_LOG("last connection is still closing");
+            return;
+        }
         if (tctx->local_sock == -1)
         {
             struct sockaddr_in local;
@@ -808,9 +1161,14 @@ static void stdin_cb(int fd, int what, void *arg)
             make_addr(local_addr, 0, 0);
             int sock = make_tcp_sock(local_addr);
             tctx->local_sock = sock;
+            if (zerocopy_threshold > 0)
+            {
+                zc_init(&x_zc_ctx, sock, zerocopy_threshold);
+            }
                 
-            io_evt* ev_tcp = new_io_event(sock, SEV_IO_READABLE|SEV_IO_WRITEABLE|SEV_IO_ERROR, 1, on_tcp_event, 0);
+            io_evt* ev_tcp = new_io_event(sock, SEV_IO_READABLE|SEV_IO_WRITEABLE|SEV_IO_ERROR, 1, on_tcp_event, tctx);
             add_io_event(tctx->eb, ev_tcp);
+            tctx->ev_tcp = ev_tcp;
         }
         
         struct sockaddr peer_addr;
@@ -833,9 +1191,20 @@ static void stdin_cb(int fd, int what, void *arg)
     }
     else if (0 == strcmp("close", buf))
     {
-        remove_io_event(tctx->eb, tctx->local_sock, 1);
-        close(tctx->local_sock);
-        tctx->local_sock = -1;
+        if (tctx->local_sock != -1)
+        {
+            close_conn(tctx);
+        }
+    }
+    else if (0 == strncmp("rate ", buf, 5))
+    {
+        //rate <stream|-1> <字节/秒> [burst]
+        int stream = -1;
+        long long rate = 0, burst = 0;
+        if (sscanf(buf + 5, "%d %lld %lld", &stream, &rate, &burst) >= 2)
+        {
+            pacer_set_rate(tctx->eb, stream, rate, burst);
+        }
     }
     else if (0 == strcmp("stop", buf))
     {
@@ -852,9 +1221,37 @@ void on_recv(void* arg, void* data, int len)
 
 void on_tcp_event(int fd, int what, void *arg)
 {
+    test_ctx *tctx = (test_ctx *)arg;
+    if (tctx && fd == tctx->closing_sock)
+    {
+        //正在关闭，只等零拷贝的完成通知
+        zc_reap(&x_zc_ctx, fd);
+        if (zc_idle(&x_zc_ctx))
+        {
+            finish_close(tctx, 0);
+        }
+        return;
+    }
+    if ((what & SEV_IO_ERROR) && x_zc_ctx.enable)
+    {
+        zc_reap(&x_zc_ctx, fd);//零拷贝的完成通知
+    }
     if (what&SEV_IO_WRITEABLE)
     {
-        onsend(0,fd,0);
+#if !USE_PLAN_A
+        int throttled = onsend(tctx,fd);
+        if (throttled < 0)
+        {
+            QUIC_LOG("send failed, close connection");
+            close_conn(tctx);
+            return;
+        }
+        //队列都发空了就不再关心可写，等data_cb有新数据再打开
+        if (tctx && tctx->ev_tcp && !throttled && x_que_empty())
+        {
+            mod_io_event(tctx->eb, tctx->ev_tcp, SEV_IO_READABLE|SEV_IO_ERROR);
+        }
+#endif
     }
     
 }
@@ -891,7 +1288,7 @@ int main(int argc, char *argv[])
 {
     if (argc < 4)
     {
-        fprintf(stderr, "Usage: %s <localport> <serverip> <serverport> <interval>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <localport> <serverip> <serverport> <interval> [zerocopy_threshold]\n", argv[0]);
         return 1;
     }
 
@@ -902,14 +1299,22 @@ int main(int argc, char *argv[])
     {
         make_data_interval = atoi(argv[4]);
     }
+    if (argc >= 6)
+    {
+        zerocopy_threshold = atoi(argv[5]);
+    }
+
+    init_queues(data_queue);
+    init_queues(x_que);
 
     contrl_ctx_t ctrl_ctx = {0};
     contrl_ctx_t *pctrl = &ctrl_ctx;
 
     sev_base *base = sev_new_base();
 
-    test_ctx test = {.ctrl_ctx = pctrl, .eb = base,.peer_ip = serverip,.peer_port = serverport, .local_sock = -1};
+    test_ctx test = {.ctrl_ctx = pctrl, .eb = base,.peer_ip = serverip,.peer_port = serverport, .local_sock = -1, .closing_sock = -1};
     io_evt *ev_std = new_io_event(STDIN_FILENO, SEV_IO_READABLE, 1, stdin_cb, (void *)&test);
+    sev_io_set_priority(ev_std, SEV_PRI_CONTROL);//控制命令不能被大量数据发送拖住
     add_io_event(base, ev_std);
 
     sev_loop(base);
@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sys/uio.h>
 
 #include "simple_event.h"
 #include "simple_event_macro.h"
@@ -19,94 +20,69 @@ typedef sev_base evb;
 typedef sev_io_event io_evt;
 typedef sev_custom_event cus_evt;
 
-int tm_compare(struct timeval *point_time, struct timeval *cur)
+#define STAT_INTERVAL 2 /*s*/
+
+//每个reactor一份，统计只在自己的线程里改，不用加锁
+typedef struct reactor_ctx_
 {
-    if ((cur->tv_sec - point_time->tv_sec) > 0)
-    {
-        return 1;
-    }
-    if ((cur->tv_sec - point_time->tv_sec) == 0 &&
-        (cur->tv_usec - point_time->tv_usec) > 0)
-    {
-        return 1;
-    }
+    int index;
+    evb *base;
+    int listen_fd;
+    long long total; //本统计周期收到的字节数
+} reactor_ctx;
 
-    return 0;
+static void on_stat_timer(void *arg)
+{
+    reactor_ctx *rctx = (reactor_ctx *)arg;
+    LOG("reactor %d speed %lld bytes/s", rctx->index, rctx->total / STAT_INTERVAL);
+    rctx->total = 0;
+
+    struct timeval tv = {.tv_sec = STAT_INTERVAL, .tv_usec = 0};
+    set_timer(rctx->base, on_stat_timer, 0, rctx, &tv);
 }
 
-void on_tcp_data(int fd, int what, void *arg)
+#define READ_INIT_SIZE (64 * 1024)
+#define READ_MAX_SIZE (4 * 1024 * 1024)
+
+//连接的收发缓冲区由sev_conn管理，测带宽只统计字节数
+static void on_tcp_data(sev_conn *conn, void *arg)
 {
-    static int total = 0;
-    const int interval = 2;
-    static struct timeval point = {0};
-    struct timeval cur;
-    gettimeofday(&cur, NULL);
-    if (point.tv_sec == 0&& point.tv_usec == 0)
-    {
-        point = cur;
-        point.tv_sec+=interval;
-    }
+    reactor_ctx *rctx = (reactor_ctx *)arg;
+    size_t len = sev_buf_len(&conn->input);
+    rctx->total += len;
+    sev_buf_drain(&conn->input, len);
+}
 
-    char buf[1024]={0};
-    int buf_len = sizeof(buf);
-    if (what & SEV_IO_READABLE)
-    {
-        while (1)
-        {
-            int ret = read(fd, buf, buf_len);
-            if (ret == 0)//对端关闭了连接
-            {
-                remove_io_event(arg, fd, 1);
-                break;
-            }
-            
-
-            if ((ret < 0) && (errno != EAGAIN) && (errno != EINTR))
-            {
-                
-            }
-            else if(ret < 0)
-            {
-                break;
-            }
-
-            // LOG("%s",buf);
-            total+=ret;
-            if (tm_compare(&point,&cur))
-            {
-                point.tv_sec += interval;
-                int speed = total/interval;
-                total = 0;
-                LOG("speed %d bytes/s",speed);
-            }
-            if (ret < buf_len)//读完了
-            {
-                break;
-            }
-        }
-    }
-    else if (what & SEV_IO_ERROR)
-    {
-        remove_io_event(arg, fd, 1);
-    }
-    
+static void on_tcp_event(sev_conn *conn, int what, void *arg)
+{
+    sev_conn_free(conn);
 }
 
 void on_conn(int fd, int what, void *arg)
 {
-    struct sockaddr_in server_addr, client_addr;
+    reactor_ctx *rctx = (reactor_ctx *)arg;
+    struct sockaddr_in client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
 
     if (what & SEV_IO_READABLE)
     {
         int conn_fd = accept(fd, (struct sockaddr *)&client_addr, &client_addr_len);
+        if (conn_fd < 0)
+        {
+            return;//SO_REUSEPORT下别的reactor可能已经把连接取走了
+        }
 
-        int flags = fcntl(conn_fd, F_GETFL, 0);
-        flags |= O_NONBLOCK;
-        int res = fcntl(conn_fd, F_SETFL, flags);
-
-        io_evt* ev_tcp = new_io_event(conn_fd, SEV_IO_READABLE|SEV_IO_WRITEABLE|SEV_IO_ERROR, 1, on_tcp_data, arg);
-        add_io_event((sev_base*)arg, ev_tcp);
+        //只收不发，输出缓冲区一直是空的，不会关心可写
+        sev_conn *conn = sev_conn_new(rctx->base, conn_fd, 1);
+        if (!conn)
+        {
+            close(conn_fd);
+            return;
+        }
+        sev_conn_set_cb(conn, on_tcp_data, 0, on_tcp_event, rctx);
+        //边沿触发，从64KB开始一次读满就翻倍，大流量时几次readv就能读空
+        sev_conn_set_read_size(conn, READ_INIT_SIZE, READ_MAX_SIZE);
+        sev_conn_set_edge(conn, 1);
     }
 }
 
@@ -116,11 +92,19 @@ static void make_addr(struct sockaddr_in *addr, char *ip, int port)
     addr->sin_port = htons(port);
     addr->sin_addr.s_addr = ip == 0 ? INADDR_ANY : inet_addr(ip);
 }
-int make_tcp_sock(struct sockaddr_in *local_addr)
+int make_tcp_sock(struct sockaddr_in *local_addr, int reuseport)
 {
     int res = 0;
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
+    int on = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (reuseport)
+    {
+        //每个reactor绑定同一个端口，由内核把新连接分到各个监听socket上
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    }
+
     int flags = fcntl(sockfd, F_GETFL, 0);
     flags |= O_NONBLOCK;
     res = fcntl(sockfd, F_SETFL, flags);
@@ -139,39 +123,86 @@ int make_tcp_sock(struct sockaddr_in *local_addr)
     return sockfd;
 }
 
+static int init_reactor(reactor_ctx *rctx, int index, evb *base, int port, int reuseport)
+{
+    rctx->index = index;
+    rctx->base = base;
+
+    struct sockaddr_in local;
+    make_addr(&local, 0, port);
+    rctx->listen_fd = make_tcp_sock(&local, reuseport);
+    if (rctx->listen_fd < 0)
+    {
+        LOG("reactor %d listen on %d failed", index, port);
+        return -1;
+    }
+    listen(rctx->listen_fd, 128);
+
+    io_evt* ev_tcp = new_io_event(rctx->listen_fd, SEV_IO_READABLE|SEV_IO_ERROR, 1, on_conn, rctx);
+    add_io_event(base, ev_tcp);
+
+    struct timeval tv = {.tv_sec = STAT_INTERVAL, .tv_usec = 0};
+    set_timer(base, on_stat_timer, 0, rctx, &tv);
+    return 0;
+}
+
+//关掉前n个reactor的监听socket，释放pool(连同里面的base)和reactor上下文
+static void free_reactors(sev_pool *pool, reactor_ctx *rctxs, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        close(rctxs[i].listen_fd);
+    }
+    free(rctxs);
+    sev_free_pool(pool);
+}
+
 int main(int argc, char *argv[])
 {
     if (argc < 2)
     {
-        fprintf(stderr, "Usage: %s <serverport> \n", argv[0]);
+        fprintf(stderr, "Usage: %s <serverport> [reactors]\n", argv[0]);
+        fprintf(stderr, "  reactors: 0 or omitted runs one loop on the main thread, -1 uses one reactor per cpu\n");
         return 1;
     }
 
     int serverport = atoi(argv[1]);
+    int reactors = argc >= 3 ? atoi(argv[2]) : 0;
 
-    sev_base *base = sev_new_base();
-
-    struct sockaddr_in local;
-    struct sockaddr_in *local_addr = &local;
-    make_addr(local_addr, 0, serverport);
-    int sock = make_tcp_sock(local_addr);
-    
-    listen(sock, 0);
-
-    io_evt* ev_tcp = new_io_event(sock, SEV_IO_READABLE|SEV_IO_WRITEABLE|SEV_IO_ERROR, 1, on_conn, base);
-    add_io_event(base, ev_tcp);
+    if (reactors == 0)
+    {
+        sev_base *base = sev_new_base();
+        reactor_ctx rctx = {0};
+        if (init_reactor(&rctx, 0, base, serverport, 0) != 0)
+        {
+            sev_free_base(base);
+            return 1;
+        }
 
+        sev_loop(base);
 
-    // cus_evt *ev_data = new_cus_event(1, 0, 0, data_cb, (void *)&test);
-    // test.ev_data = ev_data;
+        close(rctx.listen_fd);
+        sev_free_base(base);
+        return 0;
+    }
 
-    // struct timeval tv = {.tv_sec = 0, .tv_usec = MAKE_DATA_INTERVAL};
-    // add_cus_event(test.eb, ev_data, &tv);
+    //多reactor模式：每个reactor各自用SO_REUSEPORT监听同一个端口，连接只在自己的线程里处理
+    sev_pool *pool = sev_new_pool(reactors, 1);
+    reactor_ctx *rctxs = (reactor_ctx *)calloc(pool->count, sizeof(reactor_ctx));
+    for (int i = 0; i < pool->count; i++)
+    {
+        if (init_reactor(&rctxs[i], i, sev_pool_base(pool, i), serverport, 1) != 0)
+        {
+            free_reactors(pool, rctxs, i);
+            return 1;
+        }
+    }
+    LOG("start %d reactors on port %d", pool->count, serverport);
 
-    sev_loop(base);
+    sev_pool_start(pool);
+    sev_pool_wait(pool);
 
-    free_io_event(ev_tcp);
-    sev_free_base(base);
+    free_reactors(pool, rctxs, pool->count);
 }
 
 /* ****************  test  ***************** */
\ No newline at end of file